@@ -0,0 +1,241 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mp_math.h"
+#include "multiple.h"
+#include "file.h"
+#include "audit.h"
+
+#define AUDIT_MAX_THREADS   64
+
+//One level of the product or remainder tree. Every node of a level is independent of the others, so node(level, i)
+//is run for i = 0..count-1 spread over the threads, each taking every threads'th node
+typedef struct audit_level_s
+{
+    mp_t *dst; //the level being built
+    mp_t *src; //the level it is built from, the one below for the product tree and the one above for the remainders
+    mp_t *mod; //the product tree level the remainders are taken against
+    mp_ptr *out; //the gcds, filled in at the leaves
+    int count; //nodes in dst
+    int src_count; //nodes in src
+    int first; //set by audit_level for each thread
+    int step;
+    void (*node)(struct audit_level_s *level, int i);
+} audit_level_t;
+
+//Internal function prototypes
+int audit_threads(void);
+void *audit_worker(void *arg);
+void audit_level(audit_level_t *level);
+void audit_product(audit_level_t *level, int i);
+void audit_remainder(audit_level_t *level, int i);
+void audit_leaf(audit_level_t *level, int i);
+mp_t *audit_new_level(int count);
+void audit_free_level(mp_t *level, int count);
+
+//External functions
+int audit_batch_gcd(mp_ptr *n, int count, mp_ptr *g)
+{
+    int i, k, depth, weak = 0;
+    int counts[8*sizeof(int)];
+    mp_t *tree[8*sizeof(int)], *rem, *next;
+    audit_level_t level;
+    if(count < 2)
+    {
+        for(i = 0; i < count; i++) mp_assign_s64(g[i], 1);
+        return 0;
+    }
+    //Product tree, the leaves are the moduli and every level up is the product of pairs of the one below.
+    //The node left over on an odd level is carried up as it is
+    tree[0] = audit_new_level(count); counts[0] = count;
+    for(i = 0; i < count; i++) { mp_init(tree[0][i], n[i]->len); mp_assign(tree[0][i], n[i]); }
+    for(depth = 0; counts[depth] > 1; depth++)
+    {
+        counts[depth+1] = (counts[depth] + 1) / 2;
+        tree[depth+1] = audit_new_level(counts[depth+1]);
+        level.dst = tree[depth+1]; level.count = counts[depth+1];
+        level.src = tree[depth]; level.src_count = counts[depth];
+        level.mod = NULL; level.out = NULL; level.node = audit_product;
+        audit_level(&level);
+    }
+    //Remainder tree, going back down: each node is its parent's remainder mod the node's own product squared,
+    //so the leaves end up as (product of all moduli) mod n[i]^2
+    rem = tree[depth]; tree[depth] = NULL;
+    for(k = depth - 1; k >= 0; k--)
+    {
+        next = audit_new_level(counts[k]);
+        level.dst = next; level.count = counts[k];
+        level.src = rem; level.src_count = counts[k+1];
+        level.mod = tree[k]; level.out = NULL; level.node = audit_remainder;
+        audit_level(&level);
+        audit_free_level(rem, counts[k+1]);
+        rem = next;
+    }
+    //g[i] = gcd((product mod n[i]^2) / n[i], n[i]), the rest of the product is divisible by n[i] only where it
+    //shares a factor
+    level.dst = rem; level.count = count;
+    level.src = tree[0]; level.src_count = count;
+    level.mod = NULL; level.out = g; level.node = audit_leaf;
+    for(i = 0; i < count; i++) mp_grow(g[i], n[i]->len);
+    audit_level(&level);
+    for(i = 0; i < count; i++)
+        if(!(g[i]->len == 1 && g[i]->value[0] == 1)) weak++;
+    audit_free_level(rem, count);
+    for(k = 0; k < depth; k++) audit_free_level(tree[k], counts[k]);
+    return weak;
+}
+
+int audit_run(char **keyfiles, int count)
+{
+    int i, j, weak;
+    mp_ptr *n = NULL, *g = NULL;
+    mp_t f;
+    multiple_rsa_t rsa;
+    double start;
+    struct timespec t;
+    if((n = (mp_ptr *)malloc(count*sizeof(mp_ptr))) == NULL || (g = (mp_ptr *)malloc(count*sizeof(mp_ptr))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(i = 0; i < count; i++)
+    {
+        if((n[i] = (mp_ptr)malloc(sizeof(mp_t))) == NULL || (g[i] = (mp_ptr)malloc(sizeof(mp_t))) == NULL)
+            mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+        //Only n is kept from each key
+        file_read_publickey(&rsa, keyfiles[i]);
+        mp_init(n[i], rsa.n->len); mp_assign(n[i], rsa.n);
+        mp_init(g[i], rsa.n->len);
+        mp_free_n(2, rsa.n, rsa.e); mp_mont_free(&rsa.mont_n);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t); start = t.tv_sec + t.tv_nsec / 1e9;
+    weak = audit_batch_gcd(n, count, g);
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    printf("Audited %d moduli on %d threads in %.3f seconds, %d share a factor.\r\n",
+        count, audit_threads(), t.tv_sec + t.tv_nsec / 1e9 - start, weak);
+    //Only the weak keys are gone over in pairs, to say which other keys they share a factor with
+    mp_init(f, 1);
+    for(i = 0; i < count; i++)
+    {
+        if(g[i]->len == 1 && g[i]->value[0] == 1) continue;
+        if(mp_compare(g[i], n[i]) == 0)
+            printf("%s: both factors are shared, n is reused or can be factored\r\n", keyfiles[i]);
+        else
+            printf("%s: a factor is shared, n can be factored\r\n", keyfiles[i]);
+        for(j = 0; j < count; j++)
+        {
+            if(j == i || (g[j]->len == 1 && g[j]->value[0] == 1)) continue;
+            mp_gcd(f, n[i], n[j]);
+            if(f->len == 1 && f->value[0] == 1) continue;
+            printf("    %s %s\r\n", (mp_compare(f, n[i]) == 0) ? "same modulus as" : "shares a factor with", keyfiles[j]);
+        }
+    }
+    mp_free(f);
+    for(i = 0; i < count; i++) { mp_free_n(2, n[i], g[i]); free(n[i]); free(g[i]); }
+    free(n); free(g);
+    return weak;
+}
+
+//Internal functions
+int audit_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1) return 1;
+    return (cpus > AUDIT_MAX_THREADS) ? AUDIT_MAX_THREADS : (int)cpus;
+}
+
+void *audit_worker(void *arg)
+{
+    audit_level_t *level = (audit_level_t *)arg;
+    int i;
+    for(i = level->first; i < level->count; i += level->step)
+        level->node(level, i);
+    return NULL;
+}
+
+//Runs every node of a level, the calling thread doing its own share. The nodes of a level are roughly the
+//same size, so an even split keeps the threads busy until the level is done
+void audit_level(audit_level_t *level)
+{
+    int t, threads = audit_threads();
+    audit_level_t work[AUDIT_MAX_THREADS];
+    pthread_t id[AUDIT_MAX_THREADS];
+    if(threads > level->count) threads = level->count;
+    for(t = 0; t < threads; t++)
+        { work[t] = *level; work[t].first = t; work[t].step = threads; }
+    for(t = 1; t < threads; t++)
+        if(pthread_create(&id[t], NULL, audit_worker, &work[t]) != 0)
+            mp_fail(MP_ERR_MEMORY, "pthread_create failed: [%s, %d]\n", __FILE__, __LINE__);
+    audit_worker(&work[0]);
+    for(t = 1; t < threads; t++)
+        pthread_join(id[t], NULL);
+}
+
+void audit_product(audit_level_t *level, int i)
+{
+    mp_ptr a = level->src[2*i];
+    if(2*i + 1 < level->src_count)
+    {
+        mp_ptr b = level->src[2*i + 1];
+        mp_init(level->dst[i], a->len + b->len);
+        mp_multiply(level->dst[i], a, b);
+    }
+    else
+    {
+        mp_init(level->dst[i], a->len);
+        mp_assign(level->dst[i], a);
+    }
+}
+
+void audit_remainder(audit_level_t *level, int i)
+{
+    mp_ptr m = level->mod[i];
+    mp_t sq;
+    mp_init(sq, 2*m->len);
+    mp_square(sq, m);
+    mp_init(level->dst[i], sq->len);
+    mp_mod(level->dst[i], level->src[i / 2], sq);
+    mp_free(sq);
+}
+
+//dst holds the remainders at the leaves and src the moduli
+void audit_leaf(audit_level_t *level, int i)
+{
+    mp_ptr z = level->dst[i], n = level->src[i];
+    mp_t q;
+    mp_init(q, z->len);
+    mp_divide(q, z, n);
+    mp_gcd(level->out[i], q, n);
+    mp_free(q);
+}
+
+mp_t *audit_new_level(int count)
+{
+    mp_t *level;
+    if((level = (mp_t *)malloc(count*sizeof(mp_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    return level;
+}
+
+void audit_free_level(mp_t *level, int count)
+{
+    int i;
+    for(i = 0; i < count; i++) mp_free(level[i]);
+    free(level);
+}
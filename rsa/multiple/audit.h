@@ -0,0 +1,30 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef AUDIT_H
+#define AUDIT_H
+
+#include "mp_math.h"
+
+//Bernstein's batch GCD. g[i] = gcd(n[i], product of all the other moduli), so g[i] != 1 means n[i] shares a
+//factor with at least one other modulus. Returns how many of the count moduli do
+int audit_batch_gcd(mp_ptr *n, int count, mp_ptr *g);
+//Reads the moduli of the keys, with the same loader as -encrypt, and reports the ones that share a factor.
+//Returns the number of weak keys found
+int audit_run(char **keyfiles, int count);
+
+#endif
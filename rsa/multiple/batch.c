@@ -0,0 +1,356 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "file.h"
+#include "mp_math.h"
+#include "batch.h"
+
+#define BATCH_CHUNK         64 //blocks a piece of a file is split down to, 4 batches of MULTIPLE_BATCH
+#define BATCH_PATH          1024 //longest output path
+
+//One input file, mapped once by whichever thread takes it first. pending counts the blocks still to be written, and
+//the thread writing the last of them unmaps and closes it
+typedef struct
+{
+    char *path;
+    char *in;
+    char *out;
+    int length;
+    int out_length;
+    int blocks;
+    int pending;
+    int failed;
+} batch_file_t;
+
+//A task is a whole file while first is -1, and a range of its blocks once the file is open
+typedef struct
+{
+    batch_file_t *file;
+    int first;
+    int count;
+} batch_task_t;
+
+//Tasks of one thread. The owner pushes and pops at the bottom, thieves take from the top, which holds the oldest
+//and so the biggest pieces
+typedef struct
+{
+    pthread_mutex_t lock;
+    batch_task_t *tasks;
+    int size;
+    int top;
+    int bottom;
+} batch_deque_t;
+
+typedef struct
+{
+    librsa_ctx_t *ctx;
+    char *outdir;
+    int in_block; //bytes of a message per block
+    int out_block; //bytes of ciphertext per block
+    batch_deque_t *deques;
+    int threads;
+    pthread_mutex_t lock; //guards outstanding and the pending and failed fields of the files
+    int outstanding; //tasks pushed and not yet finished, the pool is done when this gets to 0
+} batch_pool_t;
+
+typedef struct
+{
+    batch_pool_t *pool;
+    int id;
+} batch_worker_t;
+
+//Internal function prototypes
+double batch_now(void);
+void batch_push(batch_pool_t *pool, int id, batch_task_t task);
+int batch_pop(batch_pool_t *pool, int id, batch_task_t *task);
+int batch_steal(batch_pool_t *pool, int id, batch_task_t *task);
+void *batch_worker(void *arg);
+const char *batch_name(const char *path);
+int batch_open(batch_pool_t *pool, batch_file_t *file);
+void batch_run(batch_pool_t *pool, int id, batch_task_t task, char *scratch);
+void batch_done(batch_pool_t *pool, batch_file_t *file, int blocks, int failed);
+
+//External functions
+int batch_encrypt(librsa_ctx_t *ctx, char **files, int count, char *outdir, int threads)
+{
+    int i, j, failed = 0;
+    long long bytes = 0;
+    double start, elapsed;
+    batch_pool_t pool;
+    batch_file_t *file;
+    batch_worker_t *worker;
+    batch_task_t task;
+    pthread_t *id;
+    if(threads < 1 && (threads = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1) threads = 1;
+    //Outputs are named after the inputs alone, so two inputs with one name would both be written to one file
+    for(i = 0; i < count; i++)
+        for(j = 0; j < i; j++)
+            if(strcmp(batch_name(files[i]), batch_name(files[j])) == 0)
+            {
+                printf("Files '%s' and '%s' would both be written to '%s/%s'!\r\n", files[j], files[i], outdir,
+                    batch_name(files[i]));
+                return count;
+            }
+    if(mkdir(outdir, 0755) != 0 && errno != EEXIST)
+        { printf("Could not create the output directory '%s'!\r\n", outdir); return count; }
+    pool.ctx = ctx; pool.outdir = outdir; pool.threads = threads; pool.outstanding = 0;
+    if(librsa_block_size(ctx, LIBRSA_ENCRYPT, &pool.in_block, &pool.out_block) != LIBRSA_OK)
+        { printf("%s", librsa_error_message()); return count; }
+    pthread_mutex_init(&pool.lock, NULL);
+    if((file = (batch_file_t *)calloc(count, sizeof(batch_file_t))) == NULL ||
+        (pool.deques = (batch_deque_t *)calloc(threads, sizeof(batch_deque_t))) == NULL ||
+        (worker = (batch_worker_t *)malloc(threads*sizeof(batch_worker_t))) == NULL ||
+        (id = (pthread_t *)malloc(threads*sizeof(pthread_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(i = 0; i < threads; i++)
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    //Whole files are dealt out in turn, stealing evens out whatever their sizes turn out to be
+    for(i = 0; i < count; i++)
+    {
+        file[i].path = files[i];
+        task.file = &file[i]; task.first = -1; task.count = 0;
+        batch_push(&pool, i % threads, task);
+    }
+    start = batch_now();
+    for(i = 0; i < threads; i++)
+    {
+        worker[i].pool = &pool; worker[i].id = i;
+        if(pthread_create(&id[i], NULL, batch_worker, &worker[i]) != 0)
+            mp_fail(MP_ERR_MEMORY, "pthread_create failed: [%s, %d]\n", __FILE__, __LINE__);
+    }
+    for(i = 0; i < threads; i++)
+        pthread_join(id[i], NULL);
+    elapsed = batch_now() - start;
+    for(i = 0; i < count; i++)
+    {
+        if(file[i].failed == 1) failed++;
+        else bytes += file[i].length;
+    }
+    printf("Encrypted %d files, %.3f MB in %.3f seconds on %d threads, %.3f MB/s\r\n",
+        count - failed, bytes / 1e6, elapsed, threads, (elapsed > 0) ? bytes / 1e6 / elapsed : 0.0);
+    for(i = 0; i < threads; i++)
+        { pthread_mutex_destroy(&pool.deques[i].lock); free(pool.deques[i].tasks); }
+    pthread_mutex_destroy(&pool.lock);
+    free(file); free(pool.deques); free(worker); free(id);
+    return failed;
+}
+
+int batch_manifest(FILE *file, char ***files)
+{
+    int count = 0, size = 0, length;
+    char *line;
+    *files = NULL;
+    while((line = file_readln(&file)) != NULL)
+    {
+        length = strlen(line);
+        while(length > 0 && (line[length-1] == '\n' || line[length-1] == '\r')) line[--length] = '\0';
+        if(length == 0) { free(line); continue; }
+        if(count == size)
+        {
+            size = (size == 0) ? 64 : 2*size;
+            if((*files = (char **)realloc(*files, size*sizeof(char *))) == NULL)
+                mp_fail(MP_ERR_MEMORY, "realloc failed: [%s, %d]\n", __FILE__, __LINE__);
+        }
+        (*files)[count++] = line;
+    }
+    return count;
+}
+
+//Internal functions
+double batch_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void batch_push(batch_pool_t *pool, int id, batch_task_t task)
+{
+    batch_deque_t *deque = &pool->deques[id];
+    pthread_mutex_lock(&pool->lock);
+    pool->outstanding++;
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom == deque->size)
+    {
+        deque->size = (deque->size == 0) ? 64 : 2*deque->size;
+        if((deque->tasks = (batch_task_t *)realloc(deque->tasks, deque->size*sizeof(batch_task_t))) == NULL)
+            mp_fail(MP_ERR_MEMORY, "realloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    }
+    deque->tasks[deque->bottom++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+int batch_pop(batch_pool_t *pool, int id, batch_task_t *task)
+{
+    batch_deque_t *deque = &pool->deques[id];
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom > deque->top)
+        { *task = deque->tasks[--deque->bottom]; found = 1; }
+    if(deque->bottom == deque->top) deque->top = deque->bottom = 0;
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+int batch_steal(batch_pool_t *pool, int id, batch_task_t *task)
+{
+    int i, found = 0;
+    batch_deque_t *deque;
+    for(i = 1; i < pool->threads && found == 0; i++)
+    {
+        deque = &pool->deques[(id + i) % pool->threads];
+        pthread_mutex_lock(&deque->lock);
+        if(deque->bottom > deque->top)
+            { *task = deque->tasks[deque->top++]; found = 1; }
+        if(deque->bottom == deque->top) deque->top = deque->bottom = 0;
+        pthread_mutex_unlock(&deque->lock);
+    }
+    return found;
+}
+
+void *batch_worker(void *arg)
+{
+    batch_worker_t *worker = (batch_worker_t *)arg;
+    batch_pool_t *pool = worker->pool;
+    batch_task_t task;
+    char *scratch;
+    int outstanding;
+    if((scratch = (char *)malloc(BATCH_CHUNK*pool->out_block + 1)) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(;;)
+    {
+        if(batch_pop(pool, worker->id, &task) == 1 || batch_steal(pool, worker->id, &task) == 1)
+        {
+            batch_run(pool, worker->id, task, scratch);
+            pthread_mutex_lock(&pool->lock);
+            pool->outstanding--;
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        //Nothing to take, but a task still running may split off more
+        pthread_mutex_lock(&pool->lock);
+        outstanding = pool->outstanding;
+        pthread_mutex_unlock(&pool->lock);
+        if(outstanding == 0) break;
+        sched_yield();
+    }
+    free(scratch);
+    return NULL;
+}
+
+//The name an input's output is given under the output directory
+const char *batch_name(const char *path)
+{
+    const char *name = strrchr(path, '/');
+    return (name != NULL) ? name + 1 : path;
+}
+
+//Maps the input, and creates the output at its full size so pieces can be written into it in any order
+int batch_open(batch_pool_t *pool, batch_file_t *file)
+{
+    char path[BATCH_PATH];
+    struct stat st;
+    int in, out;
+    snprintf(path, sizeof(path), "%s/%s", pool->outdir, batch_name(file->path));
+    if((in = open(file->path, O_RDONLY)) < 0 || fstat(in, &st) != 0)
+    {
+        printf("File '%s' does not exist!\r\n", file->path);
+        if(in >= 0) close(in);
+        return 0;
+    }
+    file->length = (int)st.st_size;
+    file->blocks = (file->length + pool->in_block - 1) / pool->in_block;
+    file->out_length = file->blocks*pool->out_block;
+    file->pending = file->blocks;
+    if((out = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(out, file->out_length) != 0)
+    {
+        printf("Could not write '%s'!\r\n", path);
+        close(in); if(out >= 0) close(out);
+        return 0;
+    }
+    file->in = file->out = NULL;
+    if(file->length > 0)
+    {
+        file->in = (char *)mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, in, 0);
+        file->out = (char *)mmap(NULL, file->out_length, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+    }
+    close(in); close(out); //the mappings stay valid
+    if(file->in == MAP_FAILED || file->out == MAP_FAILED)
+    {
+        printf("Could not map '%s'!\r\n", file->path);
+        if(file->in != MAP_FAILED && file->in != NULL) munmap(file->in, file->length);
+        if(file->out != MAP_FAILED && file->out != NULL) munmap(file->out, file->out_length);
+        return 0;
+    }
+    return 1;
+}
+
+//Splits the range in half, leaving the top half for thieves, until it is down to BATCH_CHUNK blocks, then
+//encrypts what is left through scratch, as librsa_process terminates its output and the next piece may already be
+//written
+void batch_run(batch_pool_t *pool, int id, batch_task_t task, char *scratch)
+{
+    batch_file_t *file = task.file;
+    batch_task_t half;
+    int length, written, failed = 0;
+    if(task.first < 0)
+    {
+        if(batch_open(pool, file) == 0) { file->failed = 1; return; }
+        if(file->blocks == 0) return;
+        task.first = 0; task.count = file->blocks;
+    }
+    while(task.count > BATCH_CHUNK)
+    {
+        half.file = file;
+        half.count = task.count / 2;
+        half.first = task.first + task.count - half.count;
+        task.count -= half.count;
+        batch_push(pool, id, half);
+    }
+    length = task.count*pool->in_block;
+    if(task.first*pool->in_block + length > file->length) length = file->length - task.first*pool->in_block;
+    if(librsa_process(pool->ctx, LIBRSA_ENCRYPT, file->in + task.first*pool->in_block, length,
+        scratch, BATCH_CHUNK*pool->out_block + 1, &written) != LIBRSA_OK)
+        { printf("%s", librsa_error_message()); failed = 1; }
+    else
+        memcpy(file->out + task.first*pool->out_block, scratch, written);
+    batch_done(pool, file, task.count, failed);
+}
+
+void batch_done(batch_pool_t *pool, batch_file_t *file, int blocks, int failed)
+{
+    int last;
+    pthread_mutex_lock(&pool->lock);
+    if(failed == 1) file->failed = 1;
+    file->pending -= blocks;
+    last = (file->pending == 0) ? 1 : 0;
+    pthread_mutex_unlock(&pool->lock);
+    if(last == 1)
+        { munmap(file->in, file->length); munmap(file->out, file->out_length); }
+}
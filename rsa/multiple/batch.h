@@ -0,0 +1,31 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "librsa.h"
+
+//Encrypts count files with one key into outdir, each under the name of its input without the directory. Files go to
+//a pool of threads, each taking files from its own queue and stealing from the others when that runs dry, and big
+//files are split into pieces of BATCH_CHUNK blocks as they are taken, so the pieces can be stolen too.
+//threads is the pool size, or 0 for one per online CPU. Returns the number of files that could not be encrypted
+int batch_encrypt(librsa_ctx_t *ctx, char **files, int count, char *outdir, int threads);
+//Reads the list of files for batch_encrypt, one per line, until the end of the file. Returns the number read
+int batch_manifest(FILE *file, char ***files);
+
+#endif
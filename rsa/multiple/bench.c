@@ -0,0 +1,676 @@
+/*
+ *  Benchmarks for the RSA implementation (multiple precision).
+ *
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mp_math.h"
+#include "mp_kernel.h"
+#include "multiple.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define bench_cycles()      __rdtsc() //time stamp counter, i.e. cycles at the nominal clock rate
+#define CYCLE_UNIT          "cycles"
+#else
+#define bench_cycles()      ((u64_t) (bench_now()*1e9))
+#define CYCLE_UNIT          "ns"
+#endif
+
+#define MESSAGE_LENGTH      16384 //bytes encrypted and decrypted per key size
+#define CHECK_TRIALS        2000 //random inputs each kernel is compared on
+#define CHECK_MAX_LEN       300 //longest row, in limbs, used when comparing kernels
+#define ROW_PRODUCTS        (1 << 24) //limb products timed per row length in the cycle count
+#define NTT_CHECK_TRIALS    200 //random products the NTT is compared on
+#define NTT_CHECK_MAX_LEN   3000 //longest operand, in limbs, used when checking the NTT
+#define PRIM_WARMUP         3 //runs thrown away before each primitive is timed
+#define PRIM_RUNS           21 //timed runs per primitive, the median and percentiles are taken over these
+#define PRIM_RUN_TIME       2e-3 //seconds a run should take at least, calls per run are doubled until it does
+
+int default_bits[] = {512, 1024, 2048, 3072, 4096};
+int primitive_bits[] = {256, 512, 1024, 2048};
+
+//Operands for the primitives at one size: a, b and e of len limbs, x of len - 1 limbs so it is below the odd
+//modulus n, and wide of 2*len limbs to divide
+typedef struct
+{
+    mp_t a, b, e, x, n, wide, q, r, dst;
+    int bits, seed;
+} primitive_t;
+
+typedef struct
+{
+    const char *name;
+    void (*run)(primitive_t *p);
+} primitive_op_t;
+
+double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//Keygen time, then encrypt and decrypt throughput for one key size
+void bench_keysize(int bits)
+{
+    multiple_rsa_t rsa;
+    char *message, *ciphertext, *recovered;
+    int i, length_c, length_m;
+    double t0, t_keygen, t_encrypt, t_decrypt;
+
+    if((message = (char *)malloc(MESSAGE_LENGTH)) == NULL)
+        { printf("malloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
+    for(i = 0; i < MESSAGE_LENGTH; i++) //printable 7 bit text
+        message[i] = ' ' + rand() % 95;
+
+    t0 = bench_now();
+    multiple_generate_keys(&rsa, bits);
+    t_keygen = bench_now() - t0;
+
+    t0 = bench_now();
+    ciphertext = multiple_encrypt_message(&rsa, message, MESSAGE_LENGTH, &length_c);
+    t_encrypt = bench_now() - t0;
+
+    t0 = bench_now();
+    recovered = multiple_decrypt_message(&rsa, ciphertext, length_c, &length_m);
+    t_decrypt = bench_now() - t0;
+
+    if(length_m < MESSAGE_LENGTH || memcmp(message, recovered, MESSAGE_LENGTH) != 0)
+        { printf("%d bits: round trip failed!\n", bits); exit(1); }
+
+    printf("%6d %12.3f %14.1f %14.1f\n", bits, t_keygen,
+        MESSAGE_LENGTH / 1024.0 / t_encrypt, MESSAGE_LENGTH / 1024.0 / t_decrypt);
+    fflush(stdout);
+    free(message); free(ciphertext); free(recovered);
+}
+
+void random_limbs(int *dst, int len)
+{
+    int i;
+    for(i = 0; i < len; i++)
+        dst[i] = rand() % RADIX;
+}
+
+//Compares every kernel in the given set against the scalar kernels on random rows. Returns the number of mismatches
+int check_kernel(mp_kernel_t *kernel)
+{
+    int trial, i, len, q, bad = 0;
+    int a[CHECK_MAX_LEN], b[CHECK_MAX_LEN], r1[CHECK_MAX_LEN], r2[CHECK_MAX_LEN];
+    u64_t acc1[CHECK_MAX_LEN + 1], acc2[CHECK_MAX_LEN + 1];
+    for(trial = 0; trial < CHECK_TRIALS; trial++)
+    {
+        len = 1 + rand() % (CHECK_MAX_LEN - 1);
+        random_limbs(a, len); random_limbs(b, len);
+        //Bias some limbs to the values that propagate carries and borrows
+        for(i = 0; i < len; i++)
+            if(rand() % 4 == 0) { a[i] = RADIX - 1 - b[i] + rand() % 2; if(a[i] >= RADIX) a[i] = 0; }
+        if(mp_kernel_scalar.add_row(r1, a, b, len) != kernel->add_row(r2, a, b, len) || memcmp(r1, r2, len*sizeof(int)) != 0)
+            { printf("%s add_row differs, len %d\n", kernel->name, len); bad++; }
+        for(i = 0; i < len; i++)
+            if(rand() % 4 == 0) a[i] = b[i] - rand() % 2 + ((b[i] == 0) ? 1 : 0);
+        if(mp_kernel_scalar.sub_row(r1, a, b, len) != kernel->sub_row(r2, a, b, len) || memcmp(r1, r2, len*sizeof(int)) != 0)
+            { printf("%s sub_row differs, len %d\n", kernel->name, len); bad++; }
+        for(i = 0; i <= len; i++) acc1[i] = acc2[i] = ((u64_t) rand() << 20) ^ rand();
+        q = rand() % RADIX;
+        mp_kernel_scalar.mac_row(acc1, q, b, len); kernel->mac_row(acc2, q, b, len);
+        mp_kernel_scalar.redc_row(acc1, q, a, len); kernel->redc_row(acc2, q, a, len);
+        if(memcmp(acc1, acc2, (len + 1)*sizeof(u64_t)) != 0)
+            { printf("%s mac_row/redc_row differs, len %d\n", kernel->name, len); bad++; }
+        for(i = 0; i < MAC_BLOCK; i++) acc1[i] = acc2[i] = rand();
+        if(len >= MAC_BLOCK) //a stands in for a padded number, b[k - j] never leaves it
+        {
+            mp_kernel_scalar.mac_block(acc1, b, a + len - MAC_BLOCK, len - MAC_BLOCK + 1);
+            kernel->mac_block(acc2, b, a + len - MAC_BLOCK, len - MAC_BLOCK + 1);
+        }
+        if(memcmp(acc1, acc2, MAC_BLOCK*sizeof(u64_t)) != 0)
+            { printf("%s mac_block differs, len %d\n", kernel->name, len); bad++; }
+        for(i = 0; i < len; i++) r1[i] = r2[i] = rand() % (RADIX*RADIX);
+        mp_kernel_scalar.submul_row(r1, q, b, len); kernel->submul_row(r2, q, b, len);
+        if(memcmp(r1, r2, len*sizeof(int)) != 0)
+            { printf("%s submul_row differs, len %d\n", kernel->name, len); bad++; }
+    }
+    return bad;
+}
+
+//Random odd modulus of the given number of limbs
+void random_modulus(mp_ptr n, int len)
+{
+    int i;
+    mp_init(n, len);
+    for(i = 0; i < len; i++) n->value[i] = rand() % RADIX;
+    n->value[0] |= 1; n->value[len-1] |= 1;
+    n->len = len;
+}
+
+//Times mp_modexp_mont and mp_modexp_batch with the kernels in use, checking both against the scalar result
+void bench_modexp(const char *name, int bits)
+{
+    int k, len = (bits + RADIX_BITS - 1) / RADIX_BITS, count = 16;
+    double t0, t_single, t_batch;
+    mp_t n, e, x[16], y[16], ref;
+    mp_ptr x_ptr[16], y_ptr[16];
+    mp_mont_t mont;
+    mp_kernel_t in_use = mp_kernel;
+    mp_word_kernel_t word_in_use = mp_word_kernel;
+    random_modulus(n, len);
+    random_modulus(e, len);
+    mp_mont_init(&mont, n);
+    for(k = 0; k < count; k++)
+    {
+        random_modulus(x[k], len - 1); x_ptr[k] = x[k];
+        mp_init(y[k], len); y_ptr[k] = y[k];
+    }
+    mp_init(ref, len);
+    t0 = bench_now();
+    for(k = 0; k < count; k++) mp_modexp_mont(y[k], x[k], e, &mont);
+    t_single = (bench_now() - t0) / count;
+    mp_kernel = mp_kernel_scalar; mp_word_kernel = mp_word_kernel_off;
+    mp_modexp_mont(ref, x[count-1], e, &mont);
+    mp_kernel = in_use; mp_word_kernel = word_in_use;
+    if(mp_compare(ref, y[count-1]) != 0)
+        { printf("%s: mp_modexp_mont differs from scalar!\n", name); exit(1); }
+    t0 = bench_now();
+    mp_modexp_batch(y_ptr, x_ptr, count, e, &mont);
+    t_batch = (bench_now() - t0) / count;
+    if(mp_compare(ref, y[count-1]) != 0)
+        { printf("%s: mp_modexp_batch differs from scalar!\n", name); exit(1); }
+    printf("%-8s %6d %14.3f %14.3f\n", name, bits, t_single*1000, t_batch*1000);
+    fflush(stdout);
+    for(k = 0; k < count; k++) mp_free_n(2, x[k], y[k]);
+    mp_free_n(3, n, e, ref);
+    mp_mont_free(&mont);
+}
+
+u64_t random_word(void)
+{
+    return ((u64_t) rand() << 62) ^ ((u64_t) rand() << 31) ^ (u64_t) rand();
+}
+
+//Compares a set of word kernels against the int128 ones on random rows. Returns the number of mismatches
+int check_word_kernel(mp_word_kernel_t *kernel)
+{
+    int trial, i, len, bad = 0;
+    u64_t a[CHECK_MAX_LEN], b[CHECK_MAX_LEN], r1[CHECK_MAX_LEN], r2[CHECK_MAX_LEN], q;
+    for(trial = 0; trial < CHECK_TRIALS; trial++)
+    {
+        len = 1 + rand() % (CHECK_MAX_LEN - 1);
+        for(i = 0; i < len; i++)
+        {
+            a[i] = random_word(); b[i] = random_word();
+            if(rand() % 4 == 0) a[i] = ~b[i] + rand() % 2; //words that propagate carries and borrows
+        }
+        if(mp_word_kernel_int128.add_row(r1, a, b, len) != kernel->add_row(r2, a, b, len) || memcmp(r1, r2, len*sizeof(u64_t)) != 0)
+            { printf("%s add_row differs, len %d\n", kernel->name, len); bad++; }
+        for(i = 0; i < len; i++)
+            if(rand() % 4 == 0) a[i] = b[i] - rand() % 2;
+        if(mp_word_kernel_int128.sub_row(r1, a, b, len) != kernel->sub_row(r2, a, b, len) || memcmp(r1, r2, len*sizeof(u64_t)) != 0)
+            { printf("%s sub_row differs, len %d\n", kernel->name, len); bad++; }
+        for(i = 0; i < len; i++) r1[i] = r2[i] = (rand() % 4 == 0) ? ~(u64_t) 0 : random_word();
+        q = (rand() % 4 == 0) ? ~(u64_t) 0 : random_word();
+        if(mp_word_kernel_int128.addmul_row(r1, q, b, len) != kernel->addmul_row(r2, q, b, len) || memcmp(r1, r2, len*sizeof(u64_t)) != 0)
+            { printf("%s addmul_row differs, len %d\n", kernel->name, len); bad++; }
+    }
+    return bad;
+}
+
+//Compares mp_mul_ui, mp_divmod_ui and mp_mod_ui against mp_multiply and mp_divide on random numbers.
+//Returns the number of mismatches
+int check_word_operand(void)
+{
+    int trial, len, bad = 0;
+    unsigned int b, r;
+    mp_t a, w, p1, p2, q;
+    for(trial = 0; trial < CHECK_TRIALS; trial++)
+    {
+        len = 1 + rand() % (CHECK_MAX_LEN - 1);
+        random_modulus(a, len);
+        b = (rand() % 2 == 0) ? (unsigned int) (1 + rand() % 16) : ((unsigned int) rand() << 1) | 1; //small divisors and full words
+        mp_init(w, 3); mp_assign_s64(w, b);
+        mp_init(p1, len + 3); mp_init(p2, 1); mp_init(q, 1);
+        mp_multiply(p1, a, w);
+        mp_mul_ui(p2, a, b);
+        if(mp_compare(p1, p2) != 0)
+            { printf("mp_mul_ui differs, len %d\n", len); bad++; }
+        mp_increment(p1, rand() % 1000);
+        r = mp_divmod_ui(q, p1, b);
+        if(r != mp_mod_ui(p1, b))
+            { printf("mp_mod_ui differs, len %d\n", len); bad++; }
+        mp_divide(p2, p1, w); //p1 becomes the remainder
+        mp_assign_s64(w, r);
+        if(mp_compare(q, p2) != 0 || mp_compare(p1, w) != 0)
+            { printf("mp_divmod_ui differs, len %d\n", len); bad++; }
+        mp_free_n(5, a, w, p1, p2, q);
+    }
+    return bad;
+}
+
+//Cycles per limb product of the multiply-accumulate rows, best of three runs. A 64 bit word product does the
+//work of (64/14)^2 = 21 limb products, so the limb kernels are also given per 64x64 bit product
+void bench_rows(void)
+{
+    int i, k, len, run, reps;
+    int a[64], b[64];
+    u64_t acc[2*64], wa[64], wb[64], t0, best;
+    mp_kernel_t *kernels[] = {&mp_kernel_scalar, &mp_kernel_avx2};
+    mp_word_kernel_t *words[] = {&mp_word_kernel_int128, &mp_word_kernel_adx};
+    random_limbs(a, 64); random_limbs(b, 64);
+    for(i = 0; i < 64; i++) { wa[i] = random_word(); wb[i] = random_word(); }
+    printf("%-8s %-10s %4s %16s %16s\n", "kernel", "row", "len", CYCLE_UNIT "/product", CYCLE_UNIT "/64x64");
+    for(len = 8; len <= 64; len *= 2)
+    {
+        reps = ROW_PRODUCTS / (len*len);
+        for(k = 0; k < (int)(sizeof(kernels)/sizeof(kernels[0])); k++)
+        {
+            if(mp_kernel_supported(kernels[k]) == 0) continue;
+            for(run = 0, best = ~(u64_t) 0; run < 3; run++)
+            {
+                for(i = 0; i < 2*len; i++) acc[i] = 0;
+                t0 = bench_cycles();
+                for(i = 0; i < reps*len; i++)
+                    kernels[k]->mac_row(acc + i % len, a[i % len], b, len);
+                if(bench_cycles() - t0 < best) best = bench_cycles() - t0;
+            }
+            printf("%-8s %-10s %4d %16.3f %16.3f\n", kernels[k]->name, "mac_row", len, (double) best / ROW_PRODUCTS,
+                (double) best / ROW_PRODUCTS * (64.0/RADIX_BITS) * (64.0/RADIX_BITS));
+        }
+        for(k = 0; k < (int)(sizeof(words)/sizeof(words[0])); k++)
+        {
+            if(words[k]->addmul_row == NULL || mp_word_kernel_supported(words[k]) == 0) continue;
+            for(run = 0, best = ~(u64_t) 0; run < 3; run++)
+            {
+                for(i = 0; i < 2*len; i++) acc[i] = 0;
+                t0 = bench_cycles();
+                for(i = 0; i < reps*len; i++)
+                    acc[i % len + len] += words[k]->addmul_row(acc + i % len, wa[i % len], wb, len);
+                if(bench_cycles() - t0 < best) best = bench_cycles() - t0;
+            }
+            printf("%-8s %-10s %4d %16.3f %16.3f\n", words[k]->name, "addmul_row", len, (double) best / ROW_PRODUCTS,
+                (double) best / ROW_PRODUCTS);
+        }
+    }
+}
+
+//The row by row multiply mp_multiply used before Comba, kept to compare against
+void rows_multiply(int *dst, int *a, int *b, int len, u64_t *acc)
+{
+    int i;
+    u64_t c;
+    for(i = 0; i < 2*len; i++) acc[i] = 0;
+    for(i = 0; i < len; i++)
+        mp_kernel.mac_row(acc + i, a[i], b, len);
+    for(i = 0, c = 0; i < 2*len; i++)
+    {
+        c += acc[i];
+        dst[i] = (int) (c & RADIX_MASK);
+        c >>= RADIX_BITS;
+    }
+}
+
+//Times a multiply of two len limb numbers row by row, with mp_multiply and with mp_square, and checks they agree
+void bench_multiply(int len)
+{
+    int i, reps = ROW_PRODUCTS / (len*len);
+    mp_t a, b, c, d;
+    u64_t *acc = NULL;
+    double t0, t_rows, t_comba, t_square;
+    if((acc = (u64_t *)malloc(2*len*sizeof(u64_t))) == NULL)
+        { printf("malloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
+    random_modulus(a, len); random_modulus(b, len);
+    mp_init(c, 2*len); mp_init(d, 2*len);
+    t0 = bench_now();
+    for(i = 0; i < reps; i++) rows_multiply(c->value, a->value, b->value, len, acc);
+    t_rows = (bench_now() - t0) / reps;
+    c->len = 2*len; mp_length(c);
+    t0 = bench_now();
+    for(i = 0; i < reps; i++) mp_multiply(d, a, b);
+    t_comba = (bench_now() - t0) / reps;
+    if(mp_compare(c, d) != 0)
+        { printf("%d limbs: mp_multiply differs from the row multiply!\n", len); exit(1); }
+    rows_multiply(c->value, a->value, a->value, len, acc);
+    c->len = 2*len; mp_length(c);
+    t0 = bench_now();
+    for(i = 0; i < reps; i++) mp_square(d, a);
+    t_square = (bench_now() - t0) / reps;
+    if(mp_compare(c, d) != 0)
+        { printf("%d limbs: mp_square differs from the row multiply!\n", len); exit(1); }
+    printf("%6d %12.3f %12.3f %12.3f\n", len, t_rows*1e6, t_comba*1e6, t_square*1e6);
+    fflush(stdout);
+    mp_free_n(4, a, b, c, d);
+    free(acc);
+}
+
+//Compares mp_multiply and mp_square through the NTT against the Comba code on random operands of up to
+//NTT_CHECK_MAX_LEN limbs, a quarter of them with every limb RADIX - 1 for the largest column sums. Returns the number of mismatches
+int check_ntt(void)
+{
+    int trial, i, a_len, b_len, bad = 0, saved = mp_ntt_len;
+    mp_t a, b, c, d;
+    for(trial = 0; trial < NTT_CHECK_TRIALS; trial++)
+    {
+        a_len = 1 + rand() % NTT_CHECK_MAX_LEN;
+        b_len = (rand() % 2 == 0) ? a_len : 1 + rand() % NTT_CHECK_MAX_LEN;
+        random_modulus(a, a_len); random_modulus(b, b_len);
+        if(rand() % 4 == 0)
+        {
+            for(i = 0; i < a_len; i++) a->value[i] = RADIX - 1;
+            for(i = 0; i < b_len; i++) b->value[i] = RADIX - 1;
+        }
+        mp_init(c, 1); mp_init(d, 1);
+        mp_ntt_len = 1 << 30;
+        mp_multiply(c, a, b);
+        mp_ntt_len = 1;
+        mp_multiply(d, a, b);
+        if(mp_compare(c, d) != 0)
+            { printf("NTT product differs, %d by %d limbs\n", a_len, b_len); bad++; }
+        mp_ntt_len = 1 << 30;
+        mp_square(c, a);
+        mp_ntt_len = 1;
+        mp_square(d, a);
+        if(mp_compare(c, d) != 0)
+            { printf("NTT square differs, %d limbs\n", a_len); bad++; }
+        mp_free_n(4, a, b, c, d);
+    }
+    mp_ntt_len = saved;
+    return bad;
+}
+
+//Times a len by len limb multiply with the Comba code and through the NTT
+void bench_ntt(int len)
+{
+    int i, reps = (len <= 1024) ? 16 : 4, saved = mp_ntt_len;
+    double t0, t_comba, t_ntt;
+    mp_t a, b, c;
+    random_modulus(a, len); random_modulus(b, len);
+    mp_init(c, 2*len);
+    mp_ntt_len = 1 << 30;
+    t0 = bench_now();
+    for(i = 0; i < reps; i++) mp_multiply(c, a, b);
+    t_comba = (bench_now() - t0) / reps;
+    mp_ntt_len = 1;
+    t0 = bench_now();
+    for(i = 0; i < reps; i++) mp_multiply(c, a, b);
+    t_ntt = (bench_now() - t0) / reps;
+    mp_ntt_len = saved;
+    printf("%6d %12.3f %12.3f\n", len, t_comba*1e3, t_ntt*1e3);
+    fflush(stdout);
+    mp_free_n(3, a, b, c);
+}
+
+//Divides a 2*len limb number by a len limb one, with the schoolbook division and with the Newton reciprocal, and
+//checks both give a quotient q and remainder r with q*b + r = a and r < b
+void bench_divide(int len)
+{
+    int i, reps = (len <= 256) ? 16 : 2, saved = mp_div_newton_len;
+    double t0, t_school, t_newton;
+    mp_t a, b, w, q, r, qn, rn;
+    random_modulus(a, 2*len); random_modulus(b, len);
+    mp_init(w, 2*len); mp_init(q, len + 1); mp_init(r, 2*len);
+    mp_init(qn, len + 1); mp_init(rn, 2*len);
+    mp_div_newton_len = 1 << 30;
+    t0 = bench_now();
+    for(i = 0; i < reps; i++) { mp_assign(r, a); mp_divide(q, r, b); }
+    t_school = (bench_now() - t0) / reps;
+    mp_div_newton_len = 1;
+    t0 = bench_now();
+    for(i = 0; i < reps; i++) { mp_assign(rn, a); mp_divide(qn, rn, b); }
+    t_newton = (bench_now() - t0) / reps;
+    mp_div_newton_len = saved;
+    mp_multiply(w, q, b); mp_add(w, w, r);
+    if(mp_compare(w, a) != 0 || mp_compare(r, b) >= 0)
+        { printf("%d limbs: schoolbook division is wrong!\n", len); exit(1); }
+    if(mp_compare(q, qn) != 0 || mp_compare(r, rn) != 0)
+        { printf("%d limbs: Newton division differs from schoolbook!\n", len); exit(1); }
+    printf("%6d %14.3f %14.3f\n", len, t_school*1e3, t_newton*1e3);
+    fflush(stdout);
+    mp_free_n(7, a, b, w, q, r, qn, rn);
+}
+
+//Times mp_modexp_mont on a modulus of exactly the given bits, with the fixed width code selected for it and with
+//the word kernels, and checks they agree
+void bench_fixed(int bits)
+{
+    int i, len = (bits + RADIX_BITS - 1) / RADIX_BITS, reps = 8;
+    double t0, t_fixed, t_kernel;
+    mp_t n, e, x, y, z;
+    mp_mont_t mont;
+    random_modulus(n, len);
+    n->value[len-1] &= (1 << ((bits - 1) % RADIX_BITS + 1)) - 1;
+    n->value[len-1] |= 1 << ((bits - 1) % RADIX_BITS);
+    random_modulus(e, len - 1); random_modulus(x, len - 1);
+    mp_init(y, len); mp_init(z, len);
+    mp_mont_init(&mont, n);
+    if(mont.wsqr == NULL)
+        { printf("%6d %6d: no fixed width code\n", bits, mont.wlen); mp_free_n(5, n, e, x, y, z); mp_mont_free(&mont); return; }
+    t0 = bench_now();
+    for(i = 0; i < reps; i++) mp_modexp_mont(y, x, e, &mont);
+    t_fixed = (bench_now() - t0) / reps;
+    mont.wmul = NULL; mont.wsqr = NULL;
+    t0 = bench_now();
+    for(i = 0; i < reps; i++) mp_modexp_mont(z, x, e, &mont);
+    t_kernel = (bench_now() - t0) / reps;
+    if(mp_compare(y, z) != 0)
+        { printf("%d bits: fixed width modexp differs from the word kernels!\n", bits); exit(1); }
+    printf("%6d %6d %14.3f %14.3f\n", bits, mont.wlen, t_kernel*1000, t_fixed*1000);
+    fflush(stdout);
+    mp_free_n(5, n, e, x, y, z);
+    mp_mont_free(&mont);
+}
+
+//Checks the vectorised and word kernels against the portable ones, then times each
+void bench_kernels(void)
+{
+    int i, j;
+    mp_kernel_t *kernels[] = {&mp_kernel_scalar, &mp_kernel_avx2};
+    mp_word_kernel_t *words[] = {&mp_word_kernel_int128, &mp_word_kernel_adx};
+    if(check_word_operand() != 0)
+        { printf("word operand routines do not match mp_multiply/mp_divide!\n"); exit(1); }
+    printf("word operand routines: %d random trials match mp_multiply/mp_divide\n", CHECK_TRIALS);
+    for(i = 1; i < (int)(sizeof(kernels)/sizeof(kernels[0])); i++)
+    {
+        if(mp_kernel_supported(kernels[i]) == 0)
+            { printf("%s: not supported by this CPU\n", kernels[i]->name); continue; }
+        if(check_kernel(kernels[i]) != 0)
+            { printf("%s: kernels do not match scalar!\n", kernels[i]->name); exit(1); }
+        printf("%s: %d random trials match scalar\n", kernels[i]->name, CHECK_TRIALS);
+    }
+    for(i = 1; i < (int)(sizeof(words)/sizeof(words[0])); i++)
+    {
+        if(words[i]->addmul_row == NULL || mp_word_kernel_supported(words[i]) == 0 || words[0]->addmul_row == NULL)
+            { printf("%s: not supported by this CPU\n", words[i]->name); continue; }
+        if(check_word_kernel(words[i]) != 0)
+            { printf("%s: kernels do not match int128!\n", words[i]->name); exit(1); }
+        printf("%s: %d random trials match int128\n", words[i]->name, CHECK_TRIALS);
+    }
+    bench_rows();
+    printf("%-8s %6s %14s %14s\n", "kernel", "bits", "modexp (ms)", "batched (ms)");
+    mp_word_kernel = mp_word_kernel_off;
+    for(i = 0; i < (int)(sizeof(kernels)/sizeof(kernels[0])); i++)
+    {
+        if(mp_kernel_supported(kernels[i]) == 0) continue;
+        mp_kernel = *kernels[i];
+        for(j = 512; j <= 2048; j *= 2)
+            bench_modexp(kernels[i]->name, j);
+    }
+    mp_kernel_init();
+    for(i = 0; i < (int)(sizeof(words)/sizeof(words[0])); i++)
+    {
+        if(words[i]->addmul_row == NULL || mp_word_kernel_supported(words[i]) == 0) continue;
+        mp_word_kernel = *words[i];
+        for(j = 512; j <= 2048; j *= 2)
+            bench_modexp(words[i]->name, j);
+    }
+    mp_kernel_init();
+    if(mp_word_kernel.addmul_row == NULL) return;
+    printf("%6s %6s %14s %14s\n", "bits", "words", mp_word_kernel.name, "fixed (ms)");
+    for(j = 512; j <= 4096; j *= 2)
+        bench_fixed(j);
+}
+
+void primitive_add(primitive_t *p) { mp_add(p->dst, p->a, p->b); }
+void primitive_multiply(primitive_t *p) { mp_multiply(p->dst, p->a, p->b); }
+void primitive_divide(primitive_t *p) { mp_assign(p->r, p->wide); mp_divide(p->q, p->r, p->b); } //the dividend becomes the remainder
+void primitive_mod(primitive_t *p) { mp_mod(p->r, p->wide, p->n); }
+void primitive_modexp(primitive_t *p) { mp_modexp(p->dst, p->x, p->e, p->n); }
+void primitive_coprime(primitive_t *p) { mp_is_coprime(p->a, p->b); }
+void primitive_jacobi(primitive_t *p) { mp_J(p->x, p->n); }
+void primitive_prime(primitive_t *p) { random_prime(p->dst, p->bits/2, p->seed++, 100); } //a prime for a key of these bits
+
+primitive_op_t primitive_ops[] = {{"mp_add", primitive_add}, {"mp_multiply", primitive_multiply}, {"mp_divide", primitive_divide},
+    {"mp_mod", primitive_mod}, {"mp_modexp", primitive_modexp}, {"mp_is_coprime", primitive_coprime}, {"mp_J", primitive_jacobi},
+    {"random_prime", primitive_prime}};
+
+int compare_double(const void *a, const void *b)
+{
+    return (*(const double *)a > *(const double *)b) - (*(const double *)a < *(const double *)b);
+}
+
+//Nearest rank percentile of sorted samples
+double percentile(double *sorted, int count, double fraction)
+{
+    return sorted[(int)(fraction*(count - 1) + 0.5)];
+}
+
+//Times one primitive: the calls per run are doubled until a run takes PRIM_RUN_TIME, then PRIM_WARMUP runs are
+//thrown away and PRIM_RUNS are kept. Prints ns per call and cycles per limb as a table row, CSV or JSON
+void bench_primitive(primitive_op_t *op, primitive_t *p, int len, const char *format, const char *label, int first)
+{
+    int i, run, calls;
+    double t0, ns[PRIM_RUNS], cycles[PRIM_RUNS];
+    u64_t c0;
+    for(calls = 1; ; calls *= 2)
+    {
+        t0 = bench_now();
+        for(i = 0; i < calls; i++) op->run(p);
+        if(bench_now() - t0 >= PRIM_RUN_TIME || calls >= (1 << 24)) break;
+    }
+    for(run = 0; run < PRIM_WARMUP + PRIM_RUNS; run++)
+    {
+        t0 = bench_now(); c0 = bench_cycles();
+        for(i = 0; i < calls; i++) op->run(p);
+        if(run < PRIM_WARMUP) continue;
+        cycles[run - PRIM_WARMUP] = (double)(bench_cycles() - c0) / calls / len;
+        ns[run - PRIM_WARMUP] = (bench_now() - t0)*1e9 / calls;
+    }
+    qsort(ns, PRIM_RUNS, sizeof(double), compare_double);
+    qsort(cycles, PRIM_RUNS, sizeof(double), compare_double);
+    if(strcmp(format, "csv") == 0)
+        printf("%s,%s,%s,%d,%d,%d,%.1f,%.1f,%.1f,%.1f,%.3f\n", label, mp_kernel.name, op->name, p->bits, len, calls,
+            percentile(ns, PRIM_RUNS, 0.5), percentile(ns, PRIM_RUNS, 0.1), percentile(ns, PRIM_RUNS, 0.9), ns[0],
+            percentile(cycles, PRIM_RUNS, 0.5));
+    else if(strcmp(format, "json") == 0)
+        printf("%s  {\"label\": \"%s\", \"kernel\": \"%s\", \"op\": \"%s\", \"bits\": %d, \"limbs\": %d, \"calls\": %d, "
+            "\"median_ns\": %.1f, \"p10_ns\": %.1f, \"p90_ns\": %.1f, \"min_ns\": %.1f, \"median_%s_per_limb\": %.3f}",
+            (first == 1) ? "" : ",\n", label, mp_kernel.name, op->name, p->bits, len, calls, percentile(ns, PRIM_RUNS, 0.5),
+            percentile(ns, PRIM_RUNS, 0.1), percentile(ns, PRIM_RUNS, 0.9), ns[0], CYCLE_UNIT, percentile(cycles, PRIM_RUNS, 0.5));
+    else
+        printf("%-14s %6d %6d %8d %14.1f %14.1f %14.1f %14.3f\n", op->name, p->bits, len, calls, percentile(ns, PRIM_RUNS, 0.5),
+            percentile(ns, PRIM_RUNS, 0.1), percentile(ns, PRIM_RUNS, 0.9), percentile(cycles, PRIM_RUNS, 0.5));
+    fflush(stdout);
+}
+
+//Times every primitive in primitive_ops at each size, the same operands being used for all of them
+void bench_primitives(int *bits, int count, const char *format, const char *label)
+{
+    int i, k, len, first = 1;
+    primitive_t p;
+    if(strcmp(format, "csv") == 0)
+        printf("label,kernel,op,bits,limbs,calls,median_ns,p10_ns,p90_ns,min_ns,median_%s_per_limb\n", CYCLE_UNIT);
+    else if(strcmp(format, "json") == 0)
+        printf("[\n");
+    else
+        printf("%-14s %6s %6s %8s %14s %14s %14s %14s\n", "op", "bits", "limbs", "calls", "median (ns)", "p10 (ns)", "p90 (ns)",
+            CYCLE_UNIT "/limb");
+    for(i = 0; i < count; i++)
+    {
+        len = (bits[i] + RADIX_BITS - 1) / RADIX_BITS;
+        p.bits = bits[i]; p.seed = 1;
+        random_modulus(p.a, len); random_modulus(p.b, len); random_modulus(p.e, len);
+        random_modulus(p.x, len - 1); random_modulus(p.n, len); random_modulus(p.wide, 2*len);
+        mp_init(p.q, len + 2); mp_init(p.r, 2*len + 1); mp_init(p.dst, 2*len + 1);
+        for(k = 0; k < (int)(sizeof(primitive_ops)/sizeof(primitive_ops[0])); k++, first = 0)
+            bench_primitive(&primitive_ops[k], &p, len, format, label, first);
+        mp_free_n(9, p.a, p.b, p.e, p.x, p.n, p.wide, p.q, p.r, p.dst);
+    }
+    if(strcmp(format, "json") == 0)
+        printf("\n]\n");
+}
+
+//Usage: ./bench [bits...], defaults to 512 1024 2048 3072 4096
+//       ./bench -kernels, to check and time the limb and word kernels
+//       ./bench -multiply [kernel], to time mp_multiply and mp_square from 8 to 128 limbs
+//       ./bench -divide, to time schoolbook and Newton division of 2n by n limbs, n from 64 to 1024
+//       ./bench -ntt, to check the NTT multiply against Comba, then time both from 256 to 8192 limbs
+//       ./bench -primitives [-csv|-json] [-label <name>] [bits...], to time each mp_math primitive, defaults to 256 512 1024 2048
+int main(int argc, char *argv[])
+{
+    int i, count = 0, *bits = NULL;
+    const char *format = "table", *label = "";
+    srand(1);
+    mp_kernel_init();
+    if(argc > 1 && strcmp(argv[1], "-kernels") == 0)
+        { bench_kernels(); return 0; }
+    if(argc > 1 && strcmp(argv[1], "-multiply") == 0)
+    {
+        if(argc > 2) mp_kernel_select(argv[2]);
+        printf("%6s %12s %12s %12s\n", "limbs", "rows (us)", "comba (us)", "square (us)");
+        for(i = 8; i <= 128; i *= 2) bench_multiply(i);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "-ntt") == 0)
+    {
+        if(check_ntt() != 0)
+            { printf("NTT products do not match Comba!\n"); return 1; }
+        printf("NTT: %d random products and squares match Comba\n", NTT_CHECK_TRIALS);
+        printf("%6s %12s %12s\n", "limbs", "comba (ms)", "ntt (ms)");
+        for(i = 256; i <= 8192; i *= 2) bench_ntt(i);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "-primitives") == 0)
+    {
+        if((bits = (int *)malloc(argc*sizeof(int))) == NULL)
+            { printf("malloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
+        for(i = 2; i < argc; i++)
+        {
+            if(strcmp(argv[i], "-csv") == 0) format = "csv";
+            else if(strcmp(argv[i], "-json") == 0) format = "json";
+            else if(strcmp(argv[i], "-label") == 0 && i + 1 < argc) label = argv[++i];
+            else if(atoi(argv[i]) >= 4*RADIX_BITS) bits[count++] = atoi(argv[i]);
+        }
+        if(count == 0)
+            bench_primitives(primitive_bits, (int)(sizeof(primitive_bits)/sizeof(primitive_bits[0])), format, label);
+        else
+            bench_primitives(bits, count, format, label);
+        free(bits);
+        return 0;
+    }
+    if(argc > 1 && strcmp(argv[1], "-divide") == 0)
+    {
+        printf("%6s %14s %14s\n", "limbs", "schoolbook (ms)", "newton (ms)");
+        for(i = 64; i <= 1024; i *= 2) bench_divide(i);
+        return 0;
+    }
+    printf("%6s %12s %14s %14s\n", "bits", "keygen (s)", "encrypt (KB/s)", "decrypt (KB/s)");
+    if(argc > 1)
+        for(i = 1; i < argc; i++) bench_keysize(atoi(argv[i]));
+    else
+        for(i = 0; i < (int)(sizeof(default_bits)/sizeof(default_bits[0])); i++) bench_keysize(default_bits[i]);
+    return 0;
+}
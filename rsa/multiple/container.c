@@ -0,0 +1,283 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mp_math.h"
+#include "container.h"
+#include "lz.h"
+
+//One segment to run through librsa_process, from in to its place in out
+typedef struct
+{
+    char *in;
+    int length;
+    char *out;
+    int packed; //chars of LZ output to decompress after decrypting, 0 if the segment is stored as is
+    int raw; //chars the segment decompresses to
+    int skip; //bytes at the start of the output that are not wanted
+    int keep; //bytes of the output that are
+} container_piece_t;
+
+typedef struct
+{
+    librsa_ctx_t *ctx;
+    int op;
+    container_piece_t *pieces;
+    int count;
+    int next; //first piece not yet taken
+    int scratch_size;
+    int raw_size; //scratch for decompressing, 0 if no piece needs it
+    int failed;
+    pthread_mutex_t lock;
+} container_work_t;
+
+//Internal function prototypes
+int container_threads(int threads);
+void container_run(container_work_t *work, int threads);
+void *container_worker(void *arg);
+
+//External functions
+int container_detect(char *in, int length)
+{
+    return (length >= CONTAINER_HEADER_INTS*(int)sizeof(int) && memcmp(in, CONTAINER_MAGIC, sizeof(int)) == 0) ? 1 : 0;
+}
+
+int container_encrypt(librsa_ctx_t *ctx, char *in, int length, int index, int packing, int threads, char **out, int *length_out)
+{
+    int i, j, in_block, out_block, per, raw, size, blocks, segments, header, width, cipher, high, largest;
+    int *head;
+    char *packed = NULL;
+    unsigned long long fingerprint;
+    container_work_t work;
+    if(librsa_block_size(ctx, LIBRSA_ENCRYPT, &in_block, &out_block) != LIBRSA_OK || librsa_fingerprint(ctx, &fingerprint) != LIBRSA_OK)
+        { printf("%s", librsa_error_message()); return 0; }
+    //Compressed segments are made at least a window long, as LZ finds little to match in less
+    per = CONTAINER_SEGMENT;
+    if(packing == CONTAINER_PACK_LZ && per*in_block < LZ_WINDOW) per = (LZ_WINDOW + in_block - 1) / in_block;
+    raw = per*in_block;
+    segments = (length + raw - 1) / raw;
+    if(packing == CONTAINER_PACK_LZ) index = 1; //compressed segments can only be found through the index
+    width = CONTAINER_INDEX_INTS(packing);
+    if((work.pieces = (container_piece_t *)malloc((segments + 1)*sizeof(container_piece_t))) == NULL ||
+        (packing == CONTAINER_PACK_LZ && (packed = (char *)malloc(segments*LZ_BOUND(raw) + 1)) == NULL))
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    //Compress each segment into its own place in packed. A segment is kept as is if it is all 7 bit chars and
+    //compressing saves no blocks, as the blocks are what cost. Chars above 127 only survive escaped by LZ, so a
+    //segment holding any is always compressed, even if that makes it longer
+    for(i = 0, blocks = 0, largest = per*out_block; i < segments; i++)
+    {
+        work.pieces[i].in = in + i*raw;
+        work.pieces[i].length = (i == segments - 1) ? length - i*raw : raw;
+        work.pieces[i].raw = work.pieces[i].length;
+        work.pieces[i].packed = 0;
+        if(packing == CONTAINER_PACK_LZ)
+        {
+            for(j = 0, high = 0; j < work.pieces[i].raw && high == 0; j++)
+                high = ((unsigned char)in[i*raw + j] >= 128) ? 1 : 0;
+            size = lz_compress(in + i*raw, work.pieces[i].raw, packed + i*LZ_BOUND(raw), LZ_BOUND(work.pieces[i].raw));
+            if(size > 0 && (high == 1 || (size + in_block - 1) / in_block < (work.pieces[i].raw + in_block - 1) / in_block))
+            {
+                work.pieces[i].in = packed + i*LZ_BOUND(raw);
+                work.pieces[i].length = work.pieces[i].packed = size;
+            }
+        }
+        work.pieces[i].skip = 0;
+        work.pieces[i].keep = ((work.pieces[i].length + in_block - 1) / in_block)*out_block;
+        blocks += work.pieces[i].keep / out_block;
+        if(work.pieces[i].keep > largest) largest = work.pieces[i].keep;
+    }
+    header = (CONTAINER_HEADER_INTS + ((index == 1) ? width*segments : 0))*sizeof(int);
+    *length_out = header + blocks*out_block;
+    if((*out = (char *)malloc(*length_out + 1)) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    head = (int *)*out;
+    memcpy(head, CONTAINER_MAGIC, sizeof(int));
+    head[1] = CONTAINER_VERSION;
+    head[2] = (index == 1) ? CONTAINER_FLAG_INDEX : 0;
+    head[3] = packing;
+    head[4] = (int)(fingerprint & 0xffffffff);
+    head[5] = (int)(fingerprint >> 32);
+    head[6] = length;
+    head[7] = in_block;
+    head[8] = out_block;
+    head[9] = blocks;
+    head[10] = per;
+    head[11] = segments;
+    for(i = 0, cipher = 0; i < segments; i++)
+    {
+        work.pieces[i].out = *out + header + cipher;
+        if(index == 1)
+        {
+            head[CONTAINER_HEADER_INTS + width*i] = i*raw;
+            head[CONTAINER_HEADER_INTS + width*i + 1] = cipher;
+            if(packing == CONTAINER_PACK_LZ)
+                head[CONTAINER_HEADER_INTS + width*i + 2] = work.pieces[i].packed;
+        }
+        cipher += work.pieces[i].keep;
+        work.pieces[i].packed = 0; //nothing to decompress on the way in
+    }
+    work.ctx = ctx; work.op = LIBRSA_ENCRYPT; work.count = segments;
+    work.scratch_size = largest + 1;
+    work.raw_size = 0;
+    container_run(&work, threads);
+    free(work.pieces);
+    if(packed != NULL) free(packed);
+    if(work.failed == 1) { free(*out); return 0; }
+    return 1;
+}
+
+int container_decrypt(librsa_ctx_t *ctx, char *in, int length_in, int offset, int length, int threads, char **out, int *length_out)
+{
+    int i, in_block, out_block, first, last, raw, plain, cipher, header, width;
+    int *head = (int *)in, *entry;
+    unsigned long long fingerprint;
+    container_work_t work;
+    if(container_detect(in, length_in) == 0)
+        { printf("Not a ciphertext container!\r\n"); return 0; }
+    if(head[1] != CONTAINER_VERSION || (head[3] != CONTAINER_PACK_CHARS && head[3] != CONTAINER_PACK_LZ) ||
+        (head[3] == CONTAINER_PACK_LZ && (head[2] & CONTAINER_FLAG_INDEX) == 0))
+        { printf("Container has unsupported version %d or packing %d!\r\n", head[1], head[3]); return 0; }
+    if(librsa_block_size(ctx, LIBRSA_DECRYPT, &in_block, &out_block) != LIBRSA_OK || librsa_fingerprint(ctx, &fingerprint) != LIBRSA_OK)
+        { printf("%s", librsa_error_message()); return 0; }
+    if(head[4] != (int)(fingerprint & 0xffffffff) || head[5] != (int)(fingerprint >> 32) || head[7] != out_block || head[8] != in_block)
+        { printf("The container was encrypted for a different key!\r\n"); return 0; }
+    //The counts have to agree with each other and fit in the file before anything is worked out from them
+    width = CONTAINER_INDEX_INTS(head[3]);
+    if(head[10] < 1 || head[10] > INT_MAX / ((in_block > out_block) ? in_block : out_block) || head[6] < 0 || head[9] < 0 ||
+        head[11] != head[6] / (head[10]*out_block) + ((head[6] % (head[10]*out_block) != 0) ? 1 : 0))
+        { printf("The container header is corrupt!\r\n"); return 0; }
+    if(head[11] > (length_in / (int)sizeof(int) - CONTAINER_HEADER_INTS) / width)
+        { printf("The container is truncated!\r\n"); return 0; }
+    header = (CONTAINER_HEADER_INTS + (((head[2] & CONTAINER_FLAG_INDEX) != 0) ? width*head[11] : 0))*sizeof(int);
+    if(head[9] > (length_in - header) / in_block)
+        { printf("The container is truncated!\r\n"); return 0; }
+    //Compared against what is left after offset, as offset + length can overflow
+    if(offset >= 0 && offset <= head[6] && length < 0) length = head[6] - offset;
+    if(offset < 0 || offset > head[6] || length < 0 || length > head[6] - offset)
+        { printf("Range %d:%d is outside the %d bytes of plaintext!\r\n", offset, length, head[6]); return 0; }
+    *length_out = length;
+    if((*out = (char *)malloc(length + 1)) == NULL || (work.pieces = (container_piece_t *)malloc((head[11] + 1)*sizeof(container_piece_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    (*out)[length] = '\0';
+    //Only the segments overlapping [offset, offset + length). With an index the segments are found through it,
+    //without one their places follow from the block sizes. Where each segment goes in the plaintext always follows
+    //from the block sizes, and an index that disagrees, or whose segments are not whole blocks in order, is rejected
+    raw = head[10]*out_block;
+    first = offset / raw;
+    last = (length == 0) ? first - 1 : (offset + length - 1) / raw;
+    for(i = first, work.count = 0; i <= last; i++, work.count++)
+    {
+        entry = head + CONTAINER_HEADER_INTS + width*i;
+        plain = i*raw;
+        cipher = ((head[2] & CONTAINER_FLAG_INDEX) != 0) ? entry[1] : i*head[10]*in_block;
+        work.pieces[work.count].in = in + header + cipher;
+        if(i == head[11] - 1)
+            work.pieces[work.count].length = head[9]*in_block - cipher;
+        else
+            work.pieces[work.count].length = ((head[2] & CONTAINER_FLAG_INDEX) != 0) ? entry[width + 1] - cipher : head[10]*in_block;
+        work.pieces[work.count].packed = (head[3] == CONTAINER_PACK_LZ) ? entry[2] : 0;
+        work.pieces[work.count].raw = (i == head[11] - 1) ? head[6] - plain : raw;
+        if(((head[2] & CONTAINER_FLAG_INDEX) != 0 && entry[0] != plain) || cipher < 0 || cipher % in_block != 0 ||
+            work.pieces[work.count].length < 0 || work.pieces[work.count].length % in_block != 0 ||
+            work.pieces[work.count].length > head[9]*in_block - cipher ||
+            work.pieces[work.count].packed < 0 || work.pieces[work.count].packed > LZ_BOUND(raw))
+            { printf("The container index is corrupt!\r\n"); free(*out); free(work.pieces); return 0; }
+        work.pieces[work.count].skip = (offset > plain) ? offset - plain : 0;
+        work.pieces[work.count].keep = ((offset + length < plain + raw) ? offset + length : plain + raw)
+            - plain - work.pieces[work.count].skip;
+        work.pieces[work.count].out = *out + plain + work.pieces[work.count].skip - offset;
+    }
+    work.ctx = ctx; work.op = LIBRSA_DECRYPT;
+    //A compressed segment escaping 8 bit chars can decrypt to more than raw chars, up to LZ_BOUND(raw) in whole blocks
+    work.scratch_size = ((head[3] == CONTAINER_PACK_LZ) ? ((LZ_BOUND(raw) + out_block - 1) / out_block)*out_block : raw) + 1;
+    work.raw_size = (head[3] == CONTAINER_PACK_LZ) ? raw : 0;
+    container_run(&work, threads);
+    free(work.pieces);
+    if(work.failed == 1) { free(*out); return 0; }
+    return 1;
+}
+
+//Internal functions
+int container_threads(int threads)
+{
+    if(threads < 1 && (threads = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1) threads = 1;
+    return threads;
+}
+
+void container_run(container_work_t *work, int threads)
+{
+    int t;
+    pthread_t *id;
+    threads = container_threads(threads);
+    if(threads > work->count) threads = work->count;
+    work->next = 0; work->failed = 0;
+    pthread_mutex_init(&work->lock, NULL);
+    if((id = (pthread_t *)malloc((threads + 1)*sizeof(pthread_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(t = 1; t < threads; t++)
+        if(pthread_create(&id[t], NULL, container_worker, work) != 0)
+            mp_fail(MP_ERR_MEMORY, "pthread_create failed: [%s, %d]\n", __FILE__, __LINE__);
+    if(threads > 0) container_worker(work);
+    for(t = 1; t < threads; t++)
+        pthread_join(id[t], NULL);
+    pthread_mutex_destroy(&work->lock);
+    free(id);
+}
+
+//Takes the next piece until there are none. Each goes through scratch, as librsa_process terminates its output and
+//only part of it may be wanted, and compressed pieces are then decompressed into unpacked
+void *container_worker(void *arg)
+{
+    container_work_t *work = (container_work_t *)arg;
+    container_piece_t *piece;
+    char *scratch, *unpacked = NULL, *from;
+    int written, error;
+    if((scratch = (char *)malloc(work->scratch_size)) == NULL || (work->raw_size > 0 && (unpacked = (char *)malloc(work->raw_size)) == NULL))
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(;;)
+    {
+        pthread_mutex_lock(&work->lock);
+        piece = (work->next < work->count && work->failed == 0) ? &work->pieces[work->next++] : NULL;
+        pthread_mutex_unlock(&work->lock);
+        if(piece == NULL) break;
+        from = scratch;
+        if((error = librsa_process(work->ctx, work->op, piece->in, piece->length, scratch, work->scratch_size, &written)) != LIBRSA_OK)
+            printf("%s", librsa_error_message());
+        else if(piece->packed > 0 && (piece->packed > written || lz_decompress(scratch, piece->packed, unpacked, piece->raw) != piece->raw))
+            { printf("A compressed segment of the container is corrupt!\r\n"); error = 1; }
+        else if(piece->packed > 0)
+            from = unpacked;
+        else if(piece->skip + piece->keep > written)
+            { printf("A segment of the container is shorter than its index says!\r\n"); error = 1; }
+        if(error != LIBRSA_OK)
+        {
+            pthread_mutex_lock(&work->lock);
+            work->failed = 1;
+            pthread_mutex_unlock(&work->lock);
+            continue;
+        }
+        memcpy(piece->out, from + piece->skip, piece->keep);
+    }
+    free(scratch);
+    if(unpacked != NULL) free(unpacked);
+    return NULL;
+}
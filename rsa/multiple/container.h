@@ -0,0 +1,46 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include "librsa.h"
+
+//A ciphertext container is a header of ints, an optional index, then the blocks. The plaintext is cut into segments
+//of CONTAINER_SEGMENT blocks, each encrypted on its own, and the index gives where each segment starts in the
+//plaintext and in the blocks, so any part can be decrypted without the rest
+#define CONTAINER_MAGIC         "RSAC"
+#define CONTAINER_VERSION       1
+#define CONTAINER_FLAG_INDEX    1
+#define CONTAINER_PACK_CHARS    0 //chars two to a limb, as multiple.c packs them
+#define CONTAINER_PACK_LZ       1 //each segment compressed by lz.c before packing, unless it saves no blocks and is all 7 bit
+#define CONTAINER_HEADER_INTS   12 //magic, version, flags, packing, fingerprint (2), plaintext length, plaintext and
+                                   //ciphertext bytes per block, blocks, blocks per segment, segments
+#define CONTAINER_SEGMENT       64 //blocks per segment, or more for CONTAINER_PACK_LZ
+//An index entry is the plaintext and ciphertext offsets of a segment, then for CONTAINER_PACK_LZ the chars of
+//compressed data it decrypts to, or 0 if it was stored as is. Compressed containers always have the index
+#define CONTAINER_INDEX_INTS(packing) (((packing) == CONTAINER_PACK_LZ) ? 3 : 2)
+
+int container_detect(char *in, int length); //1 if in starts with a container header
+//Encrypts in into a malloced container, with the index if index is set and the segments packed as packing.
+//Returns 0 on failure
+int container_encrypt(librsa_ctx_t *ctx, char *in, int length, int index, int packing, int threads, char **out, int *length_out);
+//Decrypts length bytes of plaintext from offset, or everything if length is -1, decrypting only the segments that
+//cover them. The segments are spread over threads, or one per online CPU if 0. Returns 0 on failure
+int container_decrypt(librsa_ctx_t *ctx, char *in, int length_in, int offset, int length, int threads, char **out, int *length_out);
+
+#endif
@@ -19,11 +19,28 @@
 
 #define MAXLEN 1000
 
+//Binary key files start with a header of ints, followed by the numbers as "<len><limbs...>"
+//in the order exponent, n, R^2 mod n, then p, q, dp, dq, qinv, R^2 mod p, R^2 mod q if the CRT flag is set
+#define KEY_MAGIC           "RSAK"
+#define KEY_VERSION         1
+#define KEY_FLAG_CRT        1
+#define KEY_HEADER_INTS     8 //magic, version, flags, bits, numChar, ninv of n, p and q
+
+//Internal function prototypes
+void file_read_key(multiple_rsa_t *rsa, mp_ptr exponent, int crt, char *keyfile);
+void file_parse_key(multiple_rsa_t *rsa, mp_ptr exponent, int crt, int *buffer, int length, char *keyfile);
+int *file_pack_number(int *dst, mp_ptr n);
+int *file_unpack_number(mp_ptr dst, int *src, int *end, char *keyfile);
+int *file_unpack_mont(mp_mont_t *mont, mp_ptr n, int ninv, int *src, int *end, char *keyfile);
+void file_check_modulus(mp_ptr n, mp_ptr rr, int ninv, char *keyfile);
+void file_close_cleanup(void *file);
+void file_free_cleanup(void *n);
+
 void file_init(FILE **file, char *fileName, char *params)
 {
     *file = fopen(fileName, params);
     if(*file == NULL)
-        { printf("File '%s' does not exist!\r\n", fileName); exit(0); }
+        mp_fail(MP_ERR_FILE, "File '%s' does not exist!\r\n", fileName);
 }
 
 void file_writekeys(multiple_rsa_t *rsa, char *publickey, char *privatekey)
@@ -52,29 +69,90 @@ void file_writekeys(multiple_rsa_t *rsa, char *publickey, char *privatekey)
 }
 
 void file_read_publickey(multiple_rsa_t *rsa, char *publickey)
+{
+    //Read public key, in binary format or text format "<e>\n<n>"
+    file_read_key(rsa, rsa->e, 0, publickey);
+}
+
+void file_read_privatekey(multiple_rsa_t *rsa, char *privatekey)
+{
+    //Read private key, in binary format or text format "<d>\n<n>"
+    file_read_key(rsa, rsa->d, 1, privatekey);
+}
+
+//Writes one key in binary format, with the precomputed values needed to use it straight away.
+//exponent is e for a public key or d for a private key. The CRT values are only written if crt is set
+void file_write_key_binary(multiple_rsa_t *rsa, mp_ptr exponent, int crt, char *keyfile)
 {
     FILE *file;
-    char *tmp;
-    
-    //Read public key, in format "<e>\n<n>"
-    file_init(&file, publickey, "r");
-    tmp = file_readln(&file); rsa->e->value = NULL; mp_char2numIO(rsa->e, tmp); free(tmp);
-    tmp = file_readln(&file); rsa->n->value = NULL; mp_char2numIO(rsa->n, tmp); free(tmp);
+    int *buffer = NULL, *ptr;
+    int size = KEY_HEADER_INTS + 3 + exponent->len + rsa->n->len + rsa->mont_n.rr->len;
+    crt = (crt == 1 && rsa->crt == 1) ? 1 : 0;
+    if(crt == 1)
+        size += 7 + rsa->p->len + rsa->q->len + rsa->dp->len + rsa->dq->len + rsa->qinv->len + rsa->mont_p.rr->len + rsa->mont_q.rr->len;
+    if((buffer = (int *)malloc(size*sizeof(int))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    memcpy(buffer, KEY_MAGIC, sizeof(int));
+    buffer[1] = KEY_VERSION;
+    buffer[2] = (crt == 1) ? KEY_FLAG_CRT : 0;
+    buffer[3] = rsa->bits;
+    buffer[4] = rsa->numChar;
+    buffer[5] = rsa->mont_n.ninv;
+    buffer[6] = (crt == 1) ? rsa->mont_p.ninv : 0;
+    buffer[7] = (crt == 1) ? rsa->mont_q.ninv : 0;
+    ptr = buffer + KEY_HEADER_INTS;
+    ptr = file_pack_number(ptr, exponent);
+    ptr = file_pack_number(ptr, rsa->n);
+    ptr = file_pack_number(ptr, rsa->mont_n.rr);
+    if(crt == 1)
+    {
+        ptr = file_pack_number(ptr, rsa->p);
+        ptr = file_pack_number(ptr, rsa->q);
+        ptr = file_pack_number(ptr, rsa->dp);
+        ptr = file_pack_number(ptr, rsa->dq);
+        ptr = file_pack_number(ptr, rsa->qinv);
+        ptr = file_pack_number(ptr, rsa->mont_p.rr);
+        ptr = file_pack_number(ptr, rsa->mont_q.rr);
+    }
+    file_init(&file, keyfile, "wb");
+    file_write(&file, (char *) buffer, size*sizeof(int));
     file_close(&file);
+    free(buffer);
 }
 
-void file_read_privatekey(multiple_rsa_t *rsa, char *privatekey)
+void file_writekeys_binary(multiple_rsa_t *rsa, char *publickey, char *privatekey)
+{
+    file_write_key_binary(rsa, rsa->e, 0, publickey);
+    file_write_key_binary(rsa, rsa->d, 1, privatekey);
+}
+
+//Writes one key in text format "<exponent>\n<n>"
+void file_write_key_text(multiple_rsa_t *rsa, mp_ptr exponent, char *keyfile)
 {
     FILE *file;
     char *tmp;
-    
-    //Read private key, in format "<d>\n<n>"
-    file_init(&file, privatekey, "r");
-    tmp = file_readln(&file); rsa->d->value = NULL; mp_char2numIO(rsa->d, tmp); free(tmp);
-    tmp = file_readln(&file); rsa->n->value = NULL; mp_char2numIO(rsa->n, tmp); free(tmp);    
+    file_init(&file, keyfile, "w");
+    tmp = mp_num2charIO(exponent); file_writeln(&file, tmp, ""); free(tmp);
+    tmp = mp_num2charIO(rsa->n); file_writeln(&file, tmp, ""); free(tmp);
     file_close(&file);
 }
 
+//Converts a key file between the binary and text formats. CRT values are kept if
+//converting to binary from binary, they are not part of the text format
+void file_convert_key(char *keyin, char *keyout, int text)
+{
+    multiple_rsa_t rsa;
+    multiple_empty(&rsa);
+    mp_cleanup_push(multiple_cleanup, &rsa);
+    file_read_key(&rsa, rsa.e, 1, keyin);
+    if(text == 1)
+        file_write_key_text(&rsa, rsa.e, keyout);
+    else
+        file_write_key_binary(&rsa, rsa.e, 1, keyout);
+    mp_cleanup_pop();
+    multiple_free(&rsa);
+}
+
 void file_writeln(FILE **file, char *line, char *termination)
 {
     fprintf(*file, "%s%s", line, termination);
@@ -103,7 +181,7 @@ char *file_read(FILE **file, int *length)
     rewind(*file);
     
     if((readln = (char *) calloc(fileSize+1, sizeof(char))) == NULL)
-        { printf("calloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
+        mp_fail(MP_ERR_MEMORY, "calloc failed: [%s, %d]\n", __FILE__, __LINE__);
     
     dummy = fread(readln, 1, fileSize, *file);
 
@@ -111,17 +189,145 @@ char *file_read(FILE **file, int *length)
     return readln;
 }
 
+//Reads one line, growing the buffer by MAXLEN at a time so lines are not limited in length
 char *file_readln(FILE **file)
 {
     char *line = NULL; char *tmp = NULL;
-    if((line = (char *)malloc(MAXLEN)) == NULL)
-        { printf("malloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
-    tmp = fgets(line, MAXLEN, *file);
-    if(tmp == NULL) line = NULL;
+    int size = MAXLEN, used = 0;
+    if((line = (char *)malloc(size)) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    while((tmp = fgets(line + used, size - used, *file)) != NULL)
+    {
+        used += strlen(line + used);
+        if(used > 0 && line[used-1] == '\n') break;
+        if((line = (char *)realloc(line, size + MAXLEN)) == NULL)
+            mp_fail(MP_ERR_MEMORY, "realloc failed: [%s, %d]\n", __FILE__, __LINE__);
+        size += MAXLEN;
+    }
+    if(used == 0) { free(line); line = NULL; }
     return line;
 }
 
+//Internal functions
+void file_read_key(multiple_rsa_t *rsa, mp_ptr exponent, int crt, char *keyfile)
+{
+    FILE *file;
+    char *tmp;
+    int length;
+    file_init(&file, keyfile, "rb");
+    mp_cleanup_push(file_close_cleanup, file);
+    //Binary keys are loaded with a single read
+    tmp = file_read(&file, &length);
+    if(length >= KEY_HEADER_INTS*(int)sizeof(int) && memcmp(tmp, KEY_MAGIC, sizeof(int)) == 0)
+    {
+        mp_cleanup_push(free, tmp);
+        file_parse_key(rsa, exponent, crt, (int *) tmp, length / sizeof(int), keyfile);
+        mp_cleanup_pop();
+        free(tmp);
+    }
+    else
+    {
+        //Text format "<exponent>\n<n>", everything else has to be worked out again
+        free(tmp);
+        rewind(file);
+        tmp = file_readln(&file); exponent->value = NULL; mp_char2numIO(exponent, tmp); free(tmp);
+        tmp = file_readln(&file); rsa->n->value = NULL; mp_char2numIO(rsa->n, tmp); free(tmp);
+        multiple_precompute(rsa, 0);
+    }
+    mp_cleanup_pop();
+    file_close(&file);
+}
+
+void file_parse_key(multiple_rsa_t *rsa, mp_ptr exponent, int crt, int *buffer, int length, char *keyfile)
+{
+    int *ptr, *end = buffer + length, top;
+    if(buffer[1] != KEY_VERSION)
+        mp_fail(MP_ERR_KEY, "Key '%s' has unsupported version %d!\r\n", keyfile, buffer[1]);
+    rsa->crt = (crt == 1 && (buffer[2] & KEY_FLAG_CRT) != 0) ? 1 : 0;
+    ptr = buffer + KEY_HEADER_INTS;
+    ptr = file_unpack_number(exponent, ptr, end, keyfile);
+    ptr = file_unpack_number(rsa->n, ptr, end, keyfile);
+    ptr = file_unpack_mont(&rsa->mont_n, rsa->n, buffer[5], ptr, end, keyfile);
+    //numChar sizes the text buffers and bits is only informative, so both are worked out from n rather than trusted
+    rsa->numChar = 2*(rsa->n->len - 1);
+    for(top = rsa->n->value[rsa->n->len-1], rsa->bits = (rsa->n->len-1)*RADIX_BITS; top > 0; top >>= 1)
+        rsa->bits++;
+    if(buffer[4] != rsa->numChar)
+        mp_fail(MP_ERR_KEY, "Key '%s' header does not match its modulus!\r\n", keyfile);
+    if(rsa->crt == 1)
+    {
+        ptr = file_unpack_number(rsa->p, ptr, end, keyfile);
+        ptr = file_unpack_number(rsa->q, ptr, end, keyfile);
+        ptr = file_unpack_number(rsa->dp, ptr, end, keyfile);
+        ptr = file_unpack_number(rsa->dq, ptr, end, keyfile);
+        ptr = file_unpack_number(rsa->qinv, ptr, end, keyfile);
+        ptr = file_unpack_mont(&rsa->mont_p, rsa->p, buffer[6], ptr, end, keyfile);
+        ptr = file_unpack_mont(&rsa->mont_q, rsa->q, buffer[7], ptr, end, keyfile);
+    }
+}
+
+int *file_pack_number(int *dst, mp_ptr n)
+{
+    int i;
+    *dst++ = n->len;
+    for(i = 0; i < n->len; i++)
+        *dst++ = n->value[i];
+    return dst;
+}
+
+int *file_unpack_number(mp_ptr dst, int *src, int *end, char *keyfile)
+{
+    int i, len;
+    if(src >= end || src[0] < 0 || src[0] > end - src - 1)
+        mp_fail(MP_ERR_KEY, "Key '%s' is truncated!\r\n", keyfile);
+    len = *src++;
+    //Checked before dst is set up, so a failure never leaves it half built
+    for(i = 0; i < len; i++)
+        if(src[i] < 0 || src[i] >= RADIX)
+            mp_fail(MP_ERR_KEY, "Key '%s' has a limb out of range!\r\n", keyfile);
+    mp_init(dst, (len > 0) ? len : 1);
+    for(i = 0; i < len; i++)
+        dst->value[i] = *src++;
+    dst->len = len;
+    mp_length(dst);
+    return src;
+}
+
+//Reads R^2 mod n for the modulus n, checks it and ninv, and sets mont up from them
+int *file_unpack_mont(mp_mont_t *mont, mp_ptr n, int ninv, int *src, int *end, char *keyfile)
+{
+    mp_t rr;
+    src = file_unpack_number(rr, src, end, keyfile);
+    mp_cleanup_push(file_free_cleanup, rr);
+    file_check_modulus(n, rr, ninv, keyfile);
+    mp_mont_init_precomputed(mont, n, rr, ninv);
+    mp_cleanup_pop();
+    mp_free(rr);
+    return src;
+}
+
+//The Montgomery values stored with a modulus have to agree with it: n odd and more than one limb,
+//R^2 mod n below n, and n*ninv = -1 mod RADIX
+void file_check_modulus(mp_ptr n, mp_ptr rr, int ninv, char *keyfile)
+{
+    if(n->len < 2 || mp_is_even(n) == 1)
+        mp_fail(MP_ERR_KEY, "Key '%s' has an invalid modulus!\r\n", keyfile);
+    if(mp_compare(rr, n) >= 0 || ninv < 0 || ninv >= RADIX || ((n->value[0] * ninv + 1) & RADIX_MASK) != 0)
+        mp_fail(MP_ERR_KEY, "Key '%s' has invalid Montgomery values!\r\n", keyfile);
+}
+
 void file_close(FILE **file)
 {    
     fclose(*file);
 }
+
+//For mp_cleanup_push
+void file_close_cleanup(void *file)
+{
+    fclose((FILE *) file);
+}
+
+void file_free_cleanup(void *n)
+{
+    mp_free((mp_ptr) n);
+}
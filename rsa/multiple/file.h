@@ -27,6 +27,10 @@ void file_init(FILE **file, char *fileName, char *params);
 void file_writekeys(multiple_rsa_t *rsa, char *publickey, char *privatekey);
 void file_read_publickey(multiple_rsa_t *rsa, char *publickey);
 void file_read_privatekey(multiple_rsa_t *rsa, char *privatekey);
+void file_write_key_binary(multiple_rsa_t *rsa, mp_ptr exponent, int crt, char *keyfile);
+void file_writekeys_binary(multiple_rsa_t *rsa, char *publickey, char *privatekey);
+void file_write_key_text(multiple_rsa_t *rsa, mp_ptr exponent, char *keyfile);
+void file_convert_key(char *keyin, char *keyout, int text);
 void file_writeln(FILE **file, char *line, char *termination);
 void file_write(FILE **file, char *line, int length);
 char *file_read(FILE **file, int *length);
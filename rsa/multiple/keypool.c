@@ -0,0 +1,247 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "mp_math.h"
+#include "multiple.h"
+#include "file.h"
+#include "keypool.h"
+
+#define KEYPOOL_PATH        1024 //longest path built inside the pool
+#define KEYPOOL_ENTRY       (KEYPOOL_PATH - 16) //longest pair directory, leaving room for the key names under it
+#define KEYPOOL_REPORT      10 //seconds between statistics updates when no pair is added
+#define KEYPOOL_IDLE        1 //seconds a worker sleeps while the pool is full
+
+//Internal function prototypes
+double keypool_now(void);
+int keypool_count(char *dir, const char *prefix);
+void keypool_clean(char *dir);
+void keypool_remove(char *entry);
+void keypool_worker(char *dir, int bits, int depth, int out);
+void keypool_remove_cleanup(void *entry);
+void keypool_write_stats(char *dir, int bits, int depth, int workers, int ready, int generated, int claimed,
+    double seconds, double generating);
+
+//External functions
+int keypool_run(char *dir, int bits, int depth, int workers)
+{
+    int w, fds[2], start_depth, ready, generated = 0, n, ms;
+    double start, generating = 0;
+    pid_t pid;
+    struct pollfd p;
+    if(mkdir(dir, 0700) != 0 && errno != EEXIST)
+        { printf("Could not create the key pool '%s'!\r\n", dir); return 0; }
+    keypool_clean(dir);
+    if(workers < 1 && (workers = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1) workers = 1;
+    if(pipe(fds) != 0)
+        mp_fail(MP_ERR_MEMORY, "pipe failed: [%s, %d]\n", __FILE__, __LINE__);
+    //Workers are separate processes, so each can drop to the lowest priority on its own
+    for(w = 0; w < workers; w++)
+    {
+        if((pid = fork()) < 0)
+            mp_fail(MP_ERR_MEMORY, "fork failed: [%s, %d]\n", __FILE__, __LINE__);
+        if(pid == 0)
+        {
+            close(fds[0]);
+            (void)nice(19); //only idle cores, a failed nice still leaves a working pool
+            keypool_worker(dir, bits, depth, fds[1]);
+            _exit(0);
+        }
+    }
+    close(fds[1]);
+    //Each worker writes the milliseconds a pair took once it is in the pool
+    start = keypool_now();
+    start_depth = keypool_count(dir, "key-");
+    printf("Key pool '%s': %d bit pairs, depth %d, %d workers, %d pairs ready.\r\n", dir, bits, depth, workers, start_depth);
+    fflush(stdout);
+    p.fd = fds[0]; p.events = POLLIN;
+    for(;;)
+    {
+        n = poll(&p, 1, KEYPOOL_REPORT*1000);
+        if(n < 0 && errno != EINTR) break;
+        if(n > 0)
+        {
+            if(read(fds[0], &ms, sizeof(ms)) != sizeof(ms)) break; //every worker has gone
+            generated++; generating += ms / 1000.0;
+        }
+        ready = keypool_count(dir, "key-");
+        keypool_write_stats(dir, bits, depth, workers, ready, generated, start_depth + generated - ready,
+            keypool_now() - start, generating);
+    }
+    close(fds[0]);
+    return 1;
+}
+
+int keypool_claim(char *dir, int bits, char *publickey, char *privatekey, int text)
+{
+    char prefix[32], from[KEYPOOL_ENTRY], to[KEYPOOL_ENTRY], key[KEYPOOL_PATH];
+    struct dirent *entry;
+    DIR *d;
+    int claimed = 0;
+    if((d = opendir(dir)) == NULL) return 0;
+    snprintf(prefix, sizeof(prefix), "key-%d-", bits);
+    //rename is atomic, whoever renames a pair first has it and everyone else gets ENOENT and tries the next
+    while(claimed == 0 && (entry = readdir(d)) != NULL)
+    {
+        if(strncmp(entry->d_name, prefix, strlen(prefix)) != 0) continue;
+        if(snprintf(from, sizeof(from), "%s/%s", dir, entry->d_name) >= (int)sizeof(from) ||
+            snprintf(to, sizeof(to), "%s/claim-%d-%s", dir, (int)getpid(), entry->d_name) >= (int)sizeof(to))
+            break; //dir is too long for any pair in it
+        if(rename(from, to) == 0) claimed = 1;
+    }
+    closedir(d);
+    if(claimed == 0) return 0;
+    //The pool keeps the binary format, converting also writes the text format when asked for. If writing either key
+    //fails the pair may already be partly handed out, so it is removed rather than put back
+    mp_cleanup_push(keypool_remove_cleanup, to);
+    snprintf(key, sizeof(key), "%s/public", to); file_convert_key(key, publickey, text);
+    snprintf(key, sizeof(key), "%s/private", to); file_convert_key(key, privatekey, text);
+    mp_cleanup_pop();
+    keypool_remove(to);
+    return 1;
+}
+
+int keypool_stats(char *dir)
+{
+    char path[KEYPOOL_PATH], line[256];
+    FILE *file;
+    snprintf(path, sizeof(path), "%s/%s", dir, KEYPOOL_STATS);
+    printf("Key pool '%s': %d pairs ready, %d being generated.\r\n", dir, keypool_count(dir, "key-"), keypool_count(dir, "tmp-"));
+    if((file = fopen(path, "r")) == NULL)
+        { printf("No statistics, rsa -keypool has not added a pair yet.\r\n"); return 0; }
+    while(fgets(line, sizeof(line), file) != NULL)
+        printf("%s", line);
+    fclose(file);
+    return 1;
+}
+
+//Internal functions
+double keypool_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int keypool_count(char *dir, const char *prefix)
+{
+    struct dirent *entry;
+    DIR *d;
+    int count = 0;
+    if((d = opendir(dir)) == NULL) return 0;
+    while((entry = readdir(d)) != NULL)
+        if(strncmp(entry->d_name, prefix, strlen(prefix)) == 0) count++;
+    closedir(d);
+    return count;
+}
+
+//Pairs left half written by a worker that is no longer running would count against the depth for good, and pairs
+//claimed by a process that died before handing them out would never leave the pool
+void keypool_clean(char *dir)
+{
+    char path[KEYPOOL_ENTRY];
+    struct dirent *entry;
+    DIR *d;
+    int pid;
+    if((d = opendir(dir)) == NULL) return;
+    while((entry = readdir(d)) != NULL)
+    {
+        if(sscanf(entry->d_name, "tmp-%d-", &pid) != 1 && sscanf(entry->d_name, "claim-%d-", &pid) != 1) continue;
+        if(kill((pid_t)pid, 0) == 0 || errno != ESRCH) continue;
+        if(snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path)) continue;
+        keypool_remove(path);
+    }
+    closedir(d);
+}
+
+//entry is at most KEYPOOL_ENTRY long, so the key names always fit
+void keypool_remove(char *entry)
+{
+    char path[KEYPOOL_PATH];
+    snprintf(path, sizeof(path), "%s/public", entry); unlink(path);
+    snprintf(path, sizeof(path), "%s/private", entry); unlink(path);
+    rmdir(entry);
+}
+
+//For mp_cleanup_push
+void keypool_remove_cleanup(void *entry)
+{
+    keypool_remove((char *)entry);
+}
+
+//A worker reserves its place in the pool with a tmp- entry before counting, so the workers between them never
+//hold more than depth pairs, ready or being generated
+void keypool_worker(char *dir, int bits, int depth, int out)
+{
+    char tmp[KEYPOOL_ENTRY], ready[KEYPOOL_ENTRY], publickey[KEYPOOL_PATH], privatekey[KEYPOOL_PATH];
+    multiple_rsa_t rsa;
+    double start;
+    int seq, ms;
+    for(seq = 0;; seq++)
+    {
+        if(snprintf(tmp, sizeof(tmp), "%s/tmp-%d-%d", dir, (int)getpid(), seq) >= (int)sizeof(tmp) ||
+            snprintf(ready, sizeof(ready), "%s/key-%d-%d-%d", dir, bits, (int)getpid(), seq) >= (int)sizeof(ready))
+            { printf("The key pool path '%s' is too long!\r\n", dir); return; }
+        if(mkdir(tmp, 0700) != 0)
+            { printf("Could not write to the key pool '%s'!\r\n", dir); return; }
+        if(keypool_count(dir, "key-") + keypool_count(dir, "tmp-") > depth)
+            { rmdir(tmp); sleep(KEYPOOL_IDLE); continue; }
+        start = keypool_now();
+        multiple_empty(&rsa);
+        multiple_generate_keys(&rsa, bits);
+        snprintf(publickey, sizeof(publickey), "%s/public", tmp);
+        snprintf(privatekey, sizeof(privatekey), "%s/private", tmp);
+        file_writekeys_binary(&rsa, publickey, privatekey);
+        multiple_free(&rsa);
+        if(rename(tmp, ready) != 0)
+            { keypool_remove(tmp); return; }
+        ms = (int)((keypool_now() - start) * 1000);
+        if(write(out, &ms, sizeof(ms)) != sizeof(ms)) return; //keypool_run has gone
+    }
+}
+
+//Written to a temporary file and renamed over the old one, so keypool_stats never reads half of it
+void keypool_write_stats(char *dir, int bits, int depth, int workers, int ready, int generated, int claimed,
+    double seconds, double generating)
+{
+    char path[KEYPOOL_PATH], tmp[KEYPOOL_PATH];
+    FILE *file;
+    snprintf(path, sizeof(path), "%s/%s", dir, KEYPOOL_STATS);
+    snprintf(tmp, sizeof(tmp), "%s/%s.tmp", dir, KEYPOOL_STATS);
+    if((file = fopen(tmp, "w")) == NULL) return;
+    fprintf(file, "bits %d\n", bits);
+    fprintf(file, "depth %d\n", depth);
+    fprintf(file, "workers %d\n", workers);
+    fprintf(file, "ready %d\n", ready);
+    fprintf(file, "generated %d\n", generated);
+    fprintf(file, "claimed %d\n", claimed);
+    fprintf(file, "uptime_seconds %.0f\n", seconds);
+    fprintf(file, "pairs_per_minute %.2f\n", (seconds > 0) ? 60.0 * generated / seconds : 0.0);
+    fprintf(file, "seconds_per_pair %.3f\n", (generated > 0) ? generating / generated : 0.0);
+    fclose(file);
+    rename(tmp, path);
+}
@@ -0,0 +1,37 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KEYPOOL_H
+#define KEYPOOL_H
+
+#define KEYPOOL_DEPTH       16 //key pairs kept ready in the pool by default
+#define KEYPOOL_STATS       "stats" //file in the pool directory the statistics are written to
+
+//The pool is a directory of key pairs, one subdirectory each holding the files "public" and "private". A pair is
+//generated under a tmp- name and renamed to key-<bits>-... once written, and claimed by renaming it again, so a
+//pair is only ever seen complete and only one claimer can get it
+
+//Keeps up to depth key pairs of the given bits in dir, generating them in that many worker processes at the
+//lowest priority, one per online CPU if workers is 0. Runs until killed, rewriting the statistics file every time a pair is added
+int keypool_run(char *dir, int bits, int depth, int workers);
+//Moves a pair of the given bits out of the pool into publickey and privatekey, in the text format if text is set.
+//Returns 0 if the pool has none, in which case the caller generates the keys itself
+int keypool_claim(char *dir, int bits, char *publickey, char *privatekey, int text);
+//Prints how many pairs are in the pool, and the statistics of the keypool_run filling it
+int keypool_stats(char *dir);
+
+#endif
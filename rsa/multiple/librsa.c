@@ -0,0 +1,282 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include "mp_math.h"
+#include "mp_kernel.h"
+#include "multiple.h"
+#include "file.h"
+#include "librsa.h"
+
+struct librsa_ctx_s
+{
+    multiple_rsa_t rsa;
+    int parts; //LIBRSA_PUBLIC and LIBRSA_PRIVATE for the exponents rsa holds, 0 while there is no key
+};
+
+__thread jmp_buf *librsa_jump = NULL; //set while a library call is running on this thread
+__thread char librsa_message[256] = "";
+pthread_mutex_t librsa_lock = PTHREAD_MUTEX_INITIALIZER;
+int librsa_ready = 0;
+
+//Everything that reaches mp_math.c, multiple.c or file.c runs between these two, so mp_fail lands back in the call
+//with its error instead of exiting
+#define LIBRSA_ENTER() \
+    jmp_buf jump; \
+    int failed; \
+    if((failed = setjmp(jump)) != 0) { librsa_jump = NULL; return failed; } \
+    librsa_jump = &jump
+#define LIBRSA_LEAVE() librsa_jump = NULL
+
+//Internal function prototypes
+void librsa_fail(int error, const char *message);
+int librsa_error(int error, const char *message);
+void librsa_clear(librsa_ctx_t *ctx);
+int librsa_check(librsa_ctx_t *ctx, int op);
+
+//External functions
+int librsa_init(const char *tune_path)
+{
+    pthread_mutex_lock(&librsa_lock);
+    if(librsa_ready == 0)
+    {
+        mp_kernel_init();
+        if(tune_path != NULL) mp_tune_load(tune_path);
+        mp_fail_handler = librsa_fail;
+        librsa_ready = 1;
+    }
+    pthread_mutex_unlock(&librsa_lock);
+    return LIBRSA_OK;
+}
+
+librsa_ctx_t *librsa_new(void)
+{
+    librsa_ctx_t *ctx;
+    librsa_init(NULL);
+    if((ctx = (librsa_ctx_t *)malloc(sizeof(librsa_ctx_t))) == NULL) return NULL;
+    ctx->parts = 0;
+    return ctx;
+}
+
+void librsa_free(librsa_ctx_t *ctx)
+{
+    if(ctx == NULL) return;
+    librsa_clear(ctx);
+    free(ctx);
+}
+
+int librsa_generate(librsa_ctx_t *ctx, int bits)
+{
+    if(ctx == NULL || bits < LIBRSA_MIN_BITS) return librsa_error(LIBRSA_ERR_ARGUMENT, "Too few bits for a key!\r\n");
+    LIBRSA_ENTER();
+    librsa_clear(ctx);
+    multiple_empty(&ctx->rsa);
+    mp_cleanup_push(multiple_cleanup, &ctx->rsa);
+    multiple_generate_keys(&ctx->rsa, bits);
+    mp_cleanup_pop();
+    ctx->parts = LIBRSA_PUBLIC | LIBRSA_PRIVATE;
+    LIBRSA_LEAVE();
+    return LIBRSA_OK;
+}
+
+int librsa_load_key(librsa_ctx_t *ctx, const char *path, int which)
+{
+    if(ctx == NULL || path == NULL || (which != LIBRSA_PUBLIC && which != LIBRSA_PRIVATE))
+        return librsa_error(LIBRSA_ERR_ARGUMENT, "A key is loaded as either public or private!\r\n");
+    LIBRSA_ENTER();
+    librsa_clear(ctx);
+    multiple_empty(&ctx->rsa);
+    mp_cleanup_push(multiple_cleanup, &ctx->rsa); //a bad key file is freed again, rather than left half loaded
+    if(which == LIBRSA_PUBLIC)
+        file_read_publickey(&ctx->rsa, (char *)path);
+    else
+        file_read_privatekey(&ctx->rsa, (char *)path);
+    mp_cleanup_pop();
+    ctx->parts = which;
+    LIBRSA_LEAVE();
+    return LIBRSA_OK;
+}
+
+int librsa_save_key(librsa_ctx_t *ctx, const char *path, int which, int text)
+{
+    mp_ptr exponent;
+    if(ctx == NULL || path == NULL || (which != LIBRSA_PUBLIC && which != LIBRSA_PRIVATE))
+        return librsa_error(LIBRSA_ERR_ARGUMENT, "A key is saved as either public or private!\r\n");
+    if((ctx->parts & which) == 0)
+        return librsa_error(LIBRSA_ERR_NO_KEY, "There is no such exponent to save!\r\n");
+    exponent = (which == LIBRSA_PUBLIC) ? ctx->rsa.e : ctx->rsa.d;
+    LIBRSA_ENTER();
+    if(text == 1)
+        file_write_key_text(&ctx->rsa, exponent, (char *)path);
+    else
+        file_write_key_binary(&ctx->rsa, exponent, (which == LIBRSA_PRIVATE) ? 1 : 0, (char *)path);
+    LIBRSA_LEAVE();
+    return LIBRSA_OK;
+}
+
+int librsa_convert_key(const char *in, const char *out, int text)
+{
+    if(in == NULL || out == NULL) return librsa_error(LIBRSA_ERR_ARGUMENT, "Converting needs two key files!\r\n");
+    librsa_init(NULL);
+    LIBRSA_ENTER();
+    file_convert_key((char *)in, (char *)out, text);
+    LIBRSA_LEAVE();
+    return LIBRSA_OK;
+}
+
+int librsa_output_size(librsa_ctx_t *ctx, int op, int length, int *size)
+{
+    int error;
+    if((error = librsa_check(ctx, op)) != LIBRSA_OK) return error;
+    if(length < 0 || size == NULL) return librsa_error(LIBRSA_ERR_ARGUMENT, "The length must not be negative!\r\n");
+    *size = multiple_text_size(&ctx->rsa, (op == LIBRSA_DECRYPT || op == LIBRSA_VERIFY) ? 1 : 0, length) + 1;
+    return LIBRSA_OK;
+}
+
+int librsa_process(librsa_ctx_t *ctx, int op, const char *in, int length, char *out, int size, int *length_out)
+{
+    int error, needed, written;
+    if((error = librsa_output_size(ctx, op, length, &needed)) != LIBRSA_OK) return error;
+    if((in == NULL && length > 0) || out == NULL) return librsa_error(LIBRSA_ERR_ARGUMENT, "Missing input or output buffer!\r\n");
+    if(size < needed) return librsa_error(LIBRSA_ERR_BUFFER, "The output buffer is too small!\r\n");
+    LIBRSA_ENTER();
+    written = multiple_transform_text(&ctx->rsa, (op == LIBRSA_DECRYPT || op == LIBRSA_SIGN) ? 1 : 0,
+        (op == LIBRSA_DECRYPT || op == LIBRSA_VERIFY) ? 1 : 0, (char *)in, length, out);
+    LIBRSA_LEAVE();
+    if(length_out != NULL) *length_out = written;
+    return LIBRSA_OK;
+}
+
+int librsa_block_size(librsa_ctx_t *ctx, int op, int *in, int *out)
+{
+    int error, ciphertext = (op == LIBRSA_DECRYPT || op == LIBRSA_VERIFY) ? 1 : 0;
+    if((error = librsa_check(ctx, op)) != LIBRSA_OK) return error;
+    if(in != NULL) *in = multiple_block_chars(&ctx->rsa, ciphertext);
+    if(out != NULL) *out = multiple_block_chars(&ctx->rsa, !ciphertext);
+    return LIBRSA_OK;
+}
+
+//FNV-1a over the limbs of n
+int librsa_fingerprint(librsa_ctx_t *ctx, unsigned long long *fingerprint)
+{
+    int i;
+    unsigned long long hash = 14695981039346656037ULL;
+    if(ctx == NULL || fingerprint == NULL) return librsa_error(LIBRSA_ERR_ARGUMENT, "Missing context or fingerprint!\r\n");
+    if(ctx->parts == 0) return librsa_error(LIBRSA_ERR_NO_KEY, "There is no key to take the fingerprint of!\r\n");
+    for(i = 0; i < ctx->rsa.n->len; i++)
+        hash = (hash ^ (unsigned long long)ctx->rsa.n->value[i]) * 1099511628211ULL;
+    *fingerprint = hash;
+    return LIBRSA_OK;
+}
+
+int librsa_sign_encrypt_size(librsa_ctx_t *signer, librsa_ctx_t *recipient, int length, int *size)
+{
+    int error, signature;
+    if((error = librsa_output_size(signer, LIBRSA_SIGN, length, &signature)) != LIBRSA_OK) return error;
+    return librsa_output_size(recipient, LIBRSA_ENCRYPT, signature - 1, size);
+}
+
+int librsa_sign_encrypt(librsa_ctx_t *signer, librsa_ctx_t *recipient, const char *in, int length, char *out, int size, int *length_out)
+{
+    int error, needed, written;
+    char *signature;
+    if((error = librsa_sign_encrypt_size(signer, recipient, length, &needed)) != LIBRSA_OK) return error;
+    if((in == NULL && length > 0) || out == NULL) return librsa_error(LIBRSA_ERR_ARGUMENT, "Missing input or output buffer!\r\n");
+    if(size < needed) return librsa_error(LIBRSA_ERR_BUFFER, "The output buffer is too small!\r\n");
+    if((signature = (char *)malloc(multiple_text_size(&signer->rsa, 0, length) + 1)) == NULL)
+        return librsa_error(LIBRSA_ERR_MEMORY, "Out of memory for the signature!\r\n");
+    LIBRSA_ENTER();
+    mp_cleanup_push(free, signature);
+    written = multiple_transform_text(&signer->rsa, 1, 0, (char *)in, length, signature);
+    written = multiple_transform_text(&recipient->rsa, 0, 0, signature, written, out);
+    mp_cleanup_pop();
+    LIBRSA_LEAVE();
+    free(signature);
+    if(length_out != NULL) *length_out = written;
+    return LIBRSA_OK;
+}
+
+int librsa_decrypt_verify_size(librsa_ctx_t *recipient, librsa_ctx_t *signer, int length, int *size)
+{
+    int error, signature;
+    if((error = librsa_output_size(recipient, LIBRSA_DECRYPT, length, &signature)) != LIBRSA_OK) return error;
+    return librsa_output_size(signer, LIBRSA_VERIFY, signature - 1, size);
+}
+
+int librsa_decrypt_verify(librsa_ctx_t *recipient, librsa_ctx_t *signer, const char *in, int length, char *out, int size, int *length_out)
+{
+    int error, needed, written;
+    char *signature;
+    if((error = librsa_decrypt_verify_size(recipient, signer, length, &needed)) != LIBRSA_OK) return error;
+    if((in == NULL && length > 0) || out == NULL) return librsa_error(LIBRSA_ERR_ARGUMENT, "Missing input or output buffer!\r\n");
+    if(size < needed) return librsa_error(LIBRSA_ERR_BUFFER, "The output buffer is too small!\r\n");
+    if((signature = (char *)malloc(multiple_text_size(&recipient->rsa, 1, length) + 1)) == NULL)
+        return librsa_error(LIBRSA_ERR_MEMORY, "Out of memory for the signature!\r\n");
+    LIBRSA_ENTER();
+    mp_cleanup_push(free, signature);
+    written = multiple_transform_text(&recipient->rsa, 1, 1, (char *)in, length, signature);
+    written = multiple_transform_text(&signer->rsa, 0, 1, signature, written, out);
+    mp_cleanup_pop();
+    LIBRSA_LEAVE();
+    free(signature);
+    if(length_out != NULL) *length_out = written;
+    return LIBRSA_OK;
+}
+
+const char *librsa_error_message(void)
+{
+    return librsa_message;
+}
+
+//Internal functions
+//Installed as mp_fail_handler. Outside a library call, such as the file handling of the command line, it still
+//prints and exits, with the status the error would have had from a call
+void librsa_fail(int error, const char *message)
+{
+    error = (error == MP_ERR_MEMORY) ? LIBRSA_ERR_MEMORY : (error == MP_ERR_FILE) ? LIBRSA_ERR_FILE : LIBRSA_ERR_KEY;
+    if(librsa_jump == NULL)
+        { printf("%s", message); exit(LIBRSA_EXIT_STATUS(error)); }
+    snprintf(librsa_message, sizeof(librsa_message), "%s", message);
+    longjmp(*librsa_jump, error);
+}
+
+int librsa_error(int error, const char *message)
+{
+    snprintf(librsa_message, sizeof(librsa_message), "%s", message);
+    return error;
+}
+
+//Keys are always emptied before they are filled, so every number can be freed whichever parts are held
+void librsa_clear(librsa_ctx_t *ctx)
+{
+    if(ctx->parts == 0) return;
+    multiple_free(&ctx->rsa);
+    ctx->parts = 0;
+}
+
+//Encrypting and verifying need e, decrypting and signing need d
+int librsa_check(librsa_ctx_t *ctx, int op)
+{
+    if(ctx == NULL || op < LIBRSA_ENCRYPT || op > LIBRSA_VERIFY)
+        return librsa_error(LIBRSA_ERR_ARGUMENT, "Unknown operation!\r\n");
+    if((ctx->parts & ((op == LIBRSA_ENCRYPT || op == LIBRSA_VERIFY) ? LIBRSA_PUBLIC : LIBRSA_PRIVATE)) == 0)
+        return librsa_error(LIBRSA_ERR_NO_KEY, "The key does not have the exponent this needs!\r\n");
+    return LIBRSA_OK;
+}
@@ -0,0 +1,76 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBRSA_H
+#define LIBRSA_H
+
+//The library interface to rsa/multiple, built into librsa.a and librsa.so. Every call returns LIBRSA_OK or one of
+//the errors below rather than exiting, and output goes to buffers the caller owns, sized with librsa_output_size.
+//Each thread can use its own contexts freely. A context holding a key is only read by librsa_process, so once
+//loaded it can be shared by any number of threads, as long as none of them loads or generates into it
+//A failed load or generate closes its files and frees the partly built key, leaving the context without one
+
+typedef struct librsa_ctx_s librsa_ctx_t;
+
+#define LIBRSA_OK               0
+#define LIBRSA_ERR_MEMORY       -1 //an allocation failed, the working memory of the arithmetic it failed in is not recovered
+#define LIBRSA_ERR_FILE         -2 //a file could not be opened
+#define LIBRSA_ERR_KEY          -3 //a key file is truncated, tampered with or of an unknown version
+#define LIBRSA_ERR_NO_KEY       -4 //the context does not hold the exponent the operation needs
+#define LIBRSA_ERR_BUFFER       -5 //the output buffer is smaller than librsa_output_size
+#define LIBRSA_ERR_ARGUMENT     -6
+#define LIBRSA_EXIT_STATUS(error) (10 - (error)) //exit status for an error, 11 to 16, clear of rsa's 0 for success,
+                                                 //1 for usage and 2 for other failures
+
+#define LIBRSA_MIN_BITS         30 //smallest key librsa_generate makes, so that each prime is more than one 14 bit limb
+
+//Which exponent of a key, for loading and saving
+#define LIBRSA_PUBLIC           1 //e
+#define LIBRSA_PRIVATE          2 //d, with the CRT values when the key file has them
+
+//Operations. As on the command line a key file's exponent goes where it is loaded, so encrypting with a private
+//key file loaded as LIBRSA_PUBLIC signs
+#define LIBRSA_ENCRYPT          0 //message to ciphertext with e
+#define LIBRSA_DECRYPT          1 //ciphertext to message with d
+#define LIBRSA_SIGN             2 //message to ciphertext with d
+#define LIBRSA_VERIFY           3 //ciphertext to message with e
+
+//Picks the arithmetic kernels for this CPU and reads the tuning profile at tune_path, if not NULL. Only the first
+//call does anything, and librsa_new makes it with NULL if nothing has yet
+int librsa_init(const char *tune_path);
+librsa_ctx_t *librsa_new(void); //NULL if out of memory
+void librsa_free(librsa_ctx_t *ctx);
+int librsa_generate(librsa_ctx_t *ctx, int bits);
+int librsa_load_key(librsa_ctx_t *ctx, const char *path, int which); //replaces any key already in ctx
+int librsa_save_key(librsa_ctx_t *ctx, const char *path, int which, int text);
+int librsa_convert_key(const char *in, const char *out, int text);
+//size is set to the buffer length op needs for length bytes of input, including a terminating zero
+int librsa_output_size(librsa_ctx_t *ctx, int op, int length, int *size);
+int librsa_process(librsa_ctx_t *ctx, int op, const char *in, int length, char *out, int size, int *length_out);
+//Bytes of input and of output per block of op. Input cut at multiples of in can be processed in pieces, and the
+//outputs joined in order are the output of the whole
+int librsa_block_size(librsa_ctx_t *ctx, int op, int *in, int *out);
+//A 64 bit hash of n, the same for the public and private key of a pair
+int librsa_fingerprint(librsa_ctx_t *ctx, unsigned long long *fingerprint);
+//Signs with signer's d then encrypts with recipient's e, and the reverse, without the signature leaving memory
+int librsa_sign_encrypt_size(librsa_ctx_t *signer, librsa_ctx_t *recipient, int length, int *size);
+int librsa_sign_encrypt(librsa_ctx_t *signer, librsa_ctx_t *recipient, const char *in, int length, char *out, int size, int *length_out);
+int librsa_decrypt_verify_size(librsa_ctx_t *recipient, librsa_ctx_t *signer, int length, int *size);
+int librsa_decrypt_verify(librsa_ctx_t *recipient, librsa_ctx_t *signer, const char *in, int length, char *out, int size, int *length_out);
+const char *librsa_error_message(void); //what went wrong in this thread's last failed call
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "lz.h"
+
+//Internal function prototypes
+int lz_hash(const unsigned char *p);
+void lz_insert(int *table, int *prev, const unsigned char *p, int i);
+int lz_literals(char *out, int *index, int size, const char *in, int count);
+
+//External functions
+//Greedy parse. The places each 4 char sequence was seen are chained through a hash table, newest first, and the
+//longest match among the first LZ_CHAIN of them within the window is taken
+int lz_compress(const char *in, int length, char *out, int size)
+{
+    int table[1 << LZ_HASH_BITS], prev[LZ_WINDOW];
+    const unsigned char *p = (const unsigned char *)in;
+    int i, h, match, depth, run, best, distance, literal = 0, index = 0;
+    for(h = 0; h < (1 << LZ_HASH_BITS); h++)
+        table[h] = -1;
+    i = 0;
+    while(i + LZ_MIN_MATCH <= length)
+    {
+        for(match = table[lz_hash(p + i)], depth = 0, best = 0, distance = 0; match >= 0 && i - match <= LZ_WINDOW && depth < LZ_CHAIN;
+            match = prev[match % LZ_WINDOW], depth++)
+        {
+            for(run = 0; i + run < length && run < LZ_MAX_MATCH && p[match + run] == p[i + run]; run++);
+            if(run > best) { best = run; distance = i - match; }
+            if(run == LZ_MAX_MATCH) break;
+        }
+        if(best < LZ_MIN_MATCH)
+            { lz_insert(table, prev, p, i++); continue; }
+        if(lz_literals(out, &index, size, in + literal, i - literal) == 0 || index + 3 > size) return -1;
+        out[index++] = (char)(LZ_MAX_LITERALS + best - LZ_MIN_MATCH);
+        out[index++] = (char)((distance - 1) & 127);
+        out[index++] = (char)((distance - 1) >> 7);
+        //The places inside the match are chained too, or text repeated in it could not be found later
+        for(best += i; i < best; i++)
+            if(i + LZ_MIN_MATCH <= length) lz_insert(table, prev, p, i);
+        literal = i;
+    }
+    if(lz_literals(out, &index, size, in + literal, length - literal) == 0) return -1;
+    return index;
+}
+
+int lz_decompress(const char *in, int length, char *out, int size)
+{
+    const unsigned char *p = (const unsigned char *)in;
+    int i = 0, index = 0, token, run, distance;
+    while(i < length)
+    {
+        token = p[i++];
+        if(token < LZ_MAX_LITERALS)
+        {
+            run = token + 1;
+            if(i + run > length || index + run > size) return -1;
+            memcpy(out + index, in + i, run);
+            i += run; index += run;
+        }
+        else
+        {
+            if(token == LZ_ESCAPE)
+            {
+                if(i + 1 > length || index + 1 > size) return -1;
+                out[index++] = (char)(p[i++] | 128);
+                continue;
+            }
+            if(token >= 128 || i + 2 > length) return -1;
+            run = token - LZ_MAX_LITERALS + LZ_MIN_MATCH;
+            distance = p[i] + (p[i + 1] << 7) + 1;
+            i += 2;
+            if(distance > index || index + run > size) return -1;
+            //Byte by byte, as a match may overlap the chars it is writing
+            for(; run > 0; run--, index++)
+                out[index] = out[index - distance];
+        }
+    }
+    return index;
+}
+
+//Internal functions
+int lz_hash(const unsigned char *p)
+{
+    unsigned int x = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    return (int)((x * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+void lz_insert(int *table, int *prev, const unsigned char *p, int i)
+{
+    int h = lz_hash(p + i);
+    prev[i % LZ_WINDOW] = table[h];
+    table[h] = i;
+}
+
+//Writes count literal chars as runs of at most LZ_MAX_LITERALS, escaping those above 127. Returns 0 if they do not fit
+int lz_literals(char *out, int *index, int size, const char *in, int count)
+{
+    int run;
+    while(count > 0)
+    {
+        if((unsigned char)in[0] >= 128)
+        {
+            if(*index + 2 > size) return 0;
+            out[(*index)++] = (char)LZ_ESCAPE;
+            out[(*index)++] = (char)(in[0] & 127);
+            in++; count--;
+            continue;
+        }
+        for(run = 1; run < count && run < LZ_MAX_LITERALS && (unsigned char)in[run] < 128; run++);
+        if(*index + 1 + run > size) return 0;
+        out[(*index)++] = (char)(run - 1);
+        memcpy(out + *index, in, run);
+        *index += run; in += run; count -= run;
+    }
+    return 1;
+}
@@ -0,0 +1,39 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+//A small LZ77 codec whose output is 7 bit chars, as multiple.c packs them, so it can be encrypted like any message.
+//A token below 64 is followed by token + 1 literal chars, LZ_ESCAPE by the low 7 bits of a char above 127, and
+//any other token from 64 up is a match of token - 60 chars at the distance held in the two chars after it (low 7
+//bits first, less one)
+#define LZ_MIN_MATCH    4
+#define LZ_MAX_MATCH    66
+#define LZ_ESCAPE       127
+#define LZ_MAX_LITERALS 64
+#define LZ_WINDOW       16384 //farthest distance two 7 bit chars can hold
+#define LZ_HASH_BITS    12
+#define LZ_CHAIN        16 //earlier places tried for each match
+#define LZ_BOUND(length) (2*(length)) //longest compression of length chars, every one of them escaped
+
+//Returns the compressed length, or -1 if in does not compress into size chars
+int lz_compress(const char *in, int length, char *out, int size);
+//Returns the decompressed length, or -1 if in is corrupt or does not decompress into size chars
+int lz_decompress(const char *in, int length, char *out, int size);
+
+#endif
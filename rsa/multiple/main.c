@@ -25,146 +25,419 @@
 #include <stdlib.h>
 #include <time.h>
 #include "mp_math.h"
+#include "mp_kernel.h"
 #include "multiple.h"
 #include "file.h"
 #include "profile.h"
+#include "tune.h"
+#include "audit.h"
+#include "keypool.h"
+#include "server.h"
+#include "librsa.h"
+#include "batch.h"
+#include "container.h"
 
-//#define PROFILE
+#define RSA_EXIT_USAGE 1
+#define RSA_EXIT_FAILED 2 //an operation failed other than in a library call, which exit with LIBRSA_EXIT_STATUS
+
+//#define PROFILE //or make profile, which also times the exponentiations in mp_math.c
 
 void printUsage(void)
 {
-    printf("There are three modes in this RSA application.\r\n\n");
-    printf("1. To generate keys, eg: ./rsa -genkeys <publickey> <privatekey>\r\n");
+    printf("These are the modes of this RSA application.\r\n\n");
+    printf("1. To generate keys, eg: ./rsa -genkeys <publickey> <privatekey> [-bits <bits in n>]\r\n");
     printf("2. To encrypt files, eg: ./rsa -encrypt <file> -out <encrypt_file> -key <publickey>\r\n");
-    printf("3. To decrypt files, eg: ./rsa -decrypt <file> -out <decrypt_file> -key <privatekey>\r\n\n");
+    printf("3. To decrypt files, eg: ./rsa -decrypt <file> -out <decrypt_file> -key <privatekey>\r\n");
+    printf("4. To sign and encrypt files in one pass, eg: ./rsa -sign-encrypt <file> -out <encrypt_file> -key <signer_privatekey> -peer <recipient_publickey>\r\n");
+    printf("5. To decrypt and verify files in one pass, eg: ./rsa -decrypt-verify <file> -out <decrypt_file> -key <recipient_privatekey> -peer <signer_publickey>\r\n");
+    printf("6. To convert a key between the binary and text formats, eg: ./rsa -convert <key> -out <converted_key> [-text]\r\n");
+    printf("7. To tune the arithmetic to this machine, eg: ./rsa -tune [<tuning_file>]\r\n");
+    printf("8. To check public keys for moduli that share a factor, eg: ./rsa -audit <publickey> <publickey> ...\r\n");
+    printf("9. To keep a pool of generated keys ready, eg: ./rsa -keypool <pool_dir> [-bits <bits in n>] [-depth <pairs>] [-workers <processes>] [-stats]\r\n");
+    printf("10. To serve requests on a Unix socket with the keys loaded once, eg: ./rsa -serve <socket> <key> <key> ...\r\n");
+    printf("11. To put load on a server, eg: ./rsa -loadgen <socket> [-op encrypt|decrypt|sign|verify] [-index <key number>] [-clients <connections>] [-requests <count>] [-size <bytes>]\r\n");
+    printf("12. To encrypt many files with one key, eg: ./rsa -encrypt-batch [<file> <file> ...] -out <directory> -key <publickey> [-workers <threads>]\r\n\n");
     printf("Note: you need to generate keys before encryption can be done.\r\n");
     printf("Note: decrypt also has an optional -raw flag. This is to write the file as a binary file, rather than ASCII, which the decrypted text is actually binary.\r\n");
+    printf("Note: keys are written in binary format with precomputed values. Add -text to genkeys or convert to write the older text format instead. Either format can be read.\r\n");
+    printf("Note: genkeys takes -pool <pool_dir> to claim a pair from a key pool, and only generates the keys itself when the pool has none of that size.\r\n");
+    printf("Note: encrypt takes -container to write a container with a header and a block index (-noindex leaves the index out). Decrypt finds containers itself, decrypts them on -workers <threads>, and with -range <offset>:<length> decrypts only that part of the plaintext.\r\n");
+    printf("Note: encrypt -compress writes a container whose segments are compressed before encryption, keeping 8 bit chars intact. Segments of 7 bit chars that do not compress are stored as they are. Decrypt decompresses them itself.\r\n");
+    printf("Note: encrypt-batch reads the list of files from stdin, one per line, when none are given. Each output is named after its input, so the inputs must have distinct names.\r\n");
+    #ifdef MP_COUNT
+    printf("Note: this build counts the bignum operations, and prints them to stderr on exit, as JSON if $RSA_COUNT is json.\r\n");
+    #endif
+    printf("Note: the tuning file defaults to %s, or to $RSA_TUNE if set, and is read at startup when it exists.\r\n", MP_TUNE_FILE);
+    printf("Note: the exit status is 0 on success, %d for a usage error, %d when an operation fails, and %d to %d for a library error.\r\n",
+        RSA_EXIT_USAGE, RSA_EXIT_FAILED, LIBRSA_EXIT_STATUS(LIBRSA_ERR_MEMORY), LIBRSA_EXIT_STATUS(LIBRSA_ERR_ARGUMENT));
+}
+
+//Prints why a library call failed and exits with its status, the same one mp_fail gives outside a call
+void checkError(int error)
+{
+    if(error != LIBRSA_OK)
+        { printf("%s", librsa_error_message()); exit(LIBRSA_EXIT_STATUS(error)); }
+}
+
+//Writes the output file, as text up to the terminating zero if text is set (decrypted messages not written -raw)
+void writeOutput(char *fileOut, char *writeln, int length, int text)
+{
+    FILE *output;
+    if(text == 1)
+    {
+        file_init(&output, fileOut, "w");
+        file_writeln(&output, writeln, "");
+    }
+    else
+    {
+        file_init(&output, fileOut, "wb");
+        file_write(&output, writeln, length);
+    }
+    file_close(&output);
 }
 
-typedef enum {genkeys, encrypt, decrypt} mode_t;
+#ifdef PROFILE
+//For atexit: the scopes to stderr, and a Chrome trace to $RSA_TRACE if it is set
+void profileReport(void)
+{
+    const char *trace = getenv("RSA_TRACE");
+    profile_report(stderr);
+    if(trace != NULL && profile_trace_write(trace) == 0)
+        fprintf(stderr, "Could not write the trace '%s'!\r\n", trace);
+}
+#endif
+
+typedef enum {genkeys, encrypt, decrypt, sign_encrypt, decrypt_verify, convert, tune, audit, keypool, serve, loadgen, encrypt_batch} rsa_mode_t;
 
 #if 1
 int main(int argc, char *argv[])
 {
-    FILE *input, *output;
-    char *fileName = NULL, *fileOut = NULL, *publickey = NULL, *privatekey = NULL, *key = NULL;
-    char *readln, *writeln;
-    mode_t mode; int i, length_in = 0, length_out = 0, raw = 0;
-    multiple_rsa_t rsa;
-    #ifdef PROFILE
-    profile_t p;
-    #endif
+    FILE *input;
+    char *fileName = NULL, *fileOut = NULL, *publickey = NULL, *privatekey = NULL, *key = NULL, *peer = NULL;
+    const char *tunefile = mp_tune_path();
+    char *readln, *writeln, **files = NULL, *pool = NULL, *socket_path = NULL;
+    rsa_mode_t mode = genkeys; int i, file_count = 0, depth = KEYPOOL_DEPTH, workers = 0, stats = 0, op = SERVER_ENCRYPT, key_index = 0, clients = 4, requests = 1000, size = 1024, length_in = 0, length_out = 0, size_out = 0, raw = 0, text = 0, container = 0, index = 1, packing = CONTAINER_PACK_CHARS, offset = 0, range = -1, bits = MULTIPLE_DEFAULT_BITS;
+    librsa_ctx_t *ctx, *ctx_peer;
     
     if(argc <= 1 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "man") == 0 ||
         strcmp(argv[1], "-help") == 0) 
-        { printUsage(); exit(1); }
+        { printUsage(); exit(RSA_EXIT_USAGE); }
+
+    librsa_init(tunefile); //pick the fastest limb kernels this CPU supports, then whatever rsa -tune measured on this machine
+    #ifdef PROFILE
+    profile_init((getenv("RSA_TRACE") != NULL) ? PROFILE_TRACE | PROFILE_COUNTERS : PROFILE_COUNTERS);
+    atexit(profileReport);
+    #endif
+    #ifdef MP_COUNT
+    atexit(mp_count_report);
+    #endif
 
     for(i = 0; i < argc; i++)
     {        
         if(strcmp(argv[i], "-genkeys") == 0)
         {
             mode = genkeys;
-            if(argv[i+1] == NULL || argv[i+2] == NULL) { printUsage(); exit(1); }
+            if(argv[i+1] == NULL || argv[i+2] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
             publickey = argv[i+1];
             privatekey = argv[i+2];
         }
         else if(strcmp(argv[i], "-encrypt") == 0)
         {         
             mode = encrypt; 
-            if(argv[i+1] == NULL) { printUsage(); exit(1); }
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
             fileName = argv[i+1]; 
         }
         else if(strcmp(argv[i], "-decrypt") == 0)
         { 
             mode = decrypt; 
-            if(argv[i+1] == NULL) { printUsage(); exit(1); }
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+            fileName = argv[i+1]; 
+        }
+        else if(strcmp(argv[i], "-sign-encrypt") == 0)
+        { 
+            mode = sign_encrypt; 
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+            fileName = argv[i+1]; 
+        }
+        else if(strcmp(argv[i], "-decrypt-verify") == 0)
+        { 
+            mode = decrypt_verify; 
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+            fileName = argv[i+1]; 
+        }
+        else if(strcmp(argv[i], "-convert") == 0)
+        { 
+            mode = convert; 
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
             fileName = argv[i+1]; 
         }
+        else if(strcmp(argv[i], "-tune") == 0)
+        { 
+            mode = tune; 
+            if(argv[i+1] != NULL && argv[i+1][0] != '-') tunefile = argv[i+1];
+        }
+        else if(strcmp(argv[i], "-audit") == 0)
+        { 
+            mode = audit; 
+            //The keys run up to the next option
+            for(file_count = 0; argv[i+1+file_count] != NULL && argv[i+1+file_count][0] != '-'; file_count++);
+            if(file_count == 0) { printUsage(); exit(RSA_EXIT_USAGE); }
+            files = &argv[i+1];
+        }
+        else if(strcmp(argv[i], "-encrypt-batch") == 0)
+        { 
+            mode = encrypt_batch; 
+            for(file_count = 0; argv[i+1+file_count] != NULL && argv[i+1+file_count][0] != '-'; file_count++);
+            files = &argv[i+1];
+        }
+        else if(strcmp(argv[i], "-serve") == 0)
+        { 
+            mode = serve; 
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+            socket_path = argv[i+1]; 
+            for(file_count = 0; argv[i+2+file_count] != NULL && argv[i+2+file_count][0] != '-'; file_count++);
+            if(file_count == 0) { printUsage(); exit(RSA_EXIT_USAGE); }
+            files = &argv[i+2];
+        }
+        else if(strcmp(argv[i], "-loadgen") == 0)
+        { 
+            mode = loadgen; 
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+            socket_path = argv[i+1]; 
+        }
+        else if(strcmp(argv[i], "-op") == 0)
+        {
+            if(argv[i+1] == NULL || server_op(argv[i+1]) < 0) { printUsage(); exit(RSA_EXIT_USAGE); }
+            op = server_op(argv[i+1]);  
+        }
+        else if(strcmp(argv[i], "-index") == 0)
+        {
+            if(argv[i+1] == NULL || atoi(argv[i+1]) < 0) { printUsage(); exit(RSA_EXIT_USAGE); }
+            key_index = atoi(argv[i+1]);  
+        }
+        else if(strcmp(argv[i], "-clients") == 0)
+        {
+            if(argv[i+1] == NULL || atoi(argv[i+1]) < 1) { printUsage(); exit(RSA_EXIT_USAGE); }
+            clients = atoi(argv[i+1]);  
+        }
+        else if(strcmp(argv[i], "-requests") == 0)
+        {
+            if(argv[i+1] == NULL || atoi(argv[i+1]) < 1) { printUsage(); exit(RSA_EXIT_USAGE); }
+            requests = atoi(argv[i+1]);  
+        }
+        else if(strcmp(argv[i], "-size") == 0)
+        {
+            if(argv[i+1] == NULL || atoi(argv[i+1]) < 1) { printUsage(); exit(RSA_EXIT_USAGE); }
+            size = atoi(argv[i+1]);  
+        }
+        else if(strcmp(argv[i], "-keypool") == 0)
+        { 
+            mode = keypool; 
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+            pool = argv[i+1]; 
+        }
+        else if(strcmp(argv[i], "-pool") == 0)
+        {
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+            pool = argv[i+1];  
+        }
+        else if(strcmp(argv[i], "-depth") == 0)
+        {
+            if(argv[i+1] == NULL || atoi(argv[i+1]) < 1) { printUsage(); exit(RSA_EXIT_USAGE); }
+            depth = atoi(argv[i+1]);  
+        }
+        else if(strcmp(argv[i], "-workers") == 0)
+        {
+            if(argv[i+1] == NULL || atoi(argv[i+1]) < 1) { printUsage(); exit(RSA_EXIT_USAGE); }
+            workers = atoi(argv[i+1]);  
+        }
+        else if(strcmp(argv[i], "-stats") == 0)
+        {
+            stats = 1;  
+        }
         else if(strcmp(argv[i], "-out") == 0)
         {
-            if(argv[i+1] == NULL) { printUsage(); exit(1); }
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
             fileOut = argv[i+1];  
         }
         else if(strcmp(argv[i], "-key") == 0)
         {
-            if(argv[i+1] == NULL) { printUsage(); exit(1); }
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
             key = argv[i+1];  
         }
+        else if(strcmp(argv[i], "-peer") == 0)
+        {
+            if(argv[i+1] == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+            peer = argv[i+1];  
+        }
+        else if(strcmp(argv[i], "-bits") == 0)
+        {
+            if(argv[i+1] == NULL || atoi(argv[i+1]) < LIBRSA_MIN_BITS) { printUsage(); exit(RSA_EXIT_USAGE); }
+            bits = atoi(argv[i+1]);  
+        }
         else if(strcmp(argv[i], "-raw") == 0)
         {
             raw = 1;  
         }
+        else if(strcmp(argv[i], "-text") == 0)
+        {
+            text = 1;  
+        }
+        else if(strcmp(argv[i], "-container") == 0)
+        {
+            container = 1;  
+        }
+        else if(strcmp(argv[i], "-compress") == 0)
+        {
+            container = 1; packing = CONTAINER_PACK_LZ;  
+        }
+        else if(strcmp(argv[i], "-noindex") == 0)
+        {
+            index = 0;  
+        }
+        else if(strcmp(argv[i], "-range") == 0)
+        {
+            if(argv[i+1] == NULL || sscanf(argv[i+1], "%d:%d", &offset, &range) != 2 || offset < 0 || range < 0) { printUsage(); exit(RSA_EXIT_USAGE); }
+        }
     }
 
     if(mode == genkeys)
     {
+        if(pool != NULL && keypool_claim(pool, bits, publickey, privatekey, text) == 1)
+            return 0;
+        ctx = librsa_new();
         #ifdef PROFILE
-        profile_begin(&p);
+        profile_scope_begin("genkeys");
         #endif
-        multiple_generate_keys(&rsa);
+        checkError(librsa_generate(ctx, bits));
         #ifdef PROFILE
-        profile_end(&p, PRINT_MILLISECONDS);
-        printf("milliseconds\n");
+        profile_scope_end();
         #endif
-        file_writekeys(&rsa, publickey, privatekey);
+        checkError(librsa_save_key(ctx, publickey, LIBRSA_PUBLIC, text));
+        checkError(librsa_save_key(ctx, privatekey, LIBRSA_PRIVATE, text));
+        librsa_free(ctx);
     }
-    else if(mode == encrypt)
+    else if(mode == encrypt || mode == decrypt)
     {
-        //Setup file to read from and read keys
-        file_init(&input, fileName, "r");
-        file_read_publickey(&rsa, key);
-        //Get text to encrypt
+        //Setup file to read from and read the key, as public to encrypt and private to decrypt
+        file_init(&input, fileName, (mode == encrypt) ? "r" : "rb");
+        ctx = librsa_new();
+        checkError(librsa_load_key(ctx, key, (mode == encrypt) ? LIBRSA_PUBLIC : LIBRSA_PRIVATE));
+        //Get text to transform, into a buffer of the size the library asks for
         readln = file_read(&input, &length_in);
-        //Encrypt text
+        if(mode == decrypt && container_detect(readln, length_in) == 1)
+        {
+            #ifdef PROFILE
+            profile_scope_begin("decrypt");
+            #endif
+            if(container_decrypt(ctx, readln, length_in, offset, range, workers, &writeln, &length_out) == 0) exit(RSA_EXIT_FAILED);
+            #ifdef PROFILE
+            profile_scope_end();
+            #endif
+            writeOutput(fileOut, writeln, length_out, raw == 0);
+            free(readln); free(writeln); librsa_free(ctx);
+            return 0;
+        }
+        if(range != -1)
+            { printf("-range needs a ciphertext container, written by encrypt -container!\r\n"); exit(RSA_EXIT_FAILED); }
+        if(mode == encrypt && container == 1)
+        {
+            #ifdef PROFILE
+            profile_scope_begin("encrypt");
+            #endif
+            if(container_encrypt(ctx, readln, length_in, index, packing, workers, &writeln, &length_out) == 0) exit(RSA_EXIT_FAILED);
+            #ifdef PROFILE
+            profile_scope_end();
+            #endif
+            writeOutput(fileOut, writeln, length_out, 0);
+            free(readln); free(writeln); librsa_free(ctx);
+            return 0;
+        }
+        checkError(librsa_output_size(ctx, (mode == encrypt) ? LIBRSA_ENCRYPT : LIBRSA_DECRYPT, length_in, &size_out));
+        if((writeln = (char *)malloc(size_out)) == NULL)
+            mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
         #ifdef PROFILE
-        profile_begin(&p);        
+        profile_scope_begin((mode == encrypt) ? "encrypt" : "decrypt");
         #endif
-        writeln = multiple_encrypt_message(&rsa, readln, length_in, &length_out); //use this length instead
+        checkError(librsa_process(ctx, (mode == encrypt) ? LIBRSA_ENCRYPT : LIBRSA_DECRYPT, readln, length_in, writeln, size_out, &length_out));
         #ifdef PROFILE
-        profile_end(&p, PRINT_MILLISECONDS);
-        printf("milliseconds\n");
+        profile_scope_end();
         #endif
-        //Setup file to write encrypted text to and write to file
-        file_init(&output, fileOut, "wb");
-        file_write(&output, writeln, length_out);            
+        writeOutput(fileOut, writeln, length_out, mode == decrypt && raw == 0);
         //Cleanup
-        free(readln); free(writeln); //Doesnt seem to want to free writeln!
-        file_close(&input); file_close(&output);
+        free(readln); free(writeln); librsa_free(ctx);
+        file_close(&input);
     }
-    else if(mode == decrypt)
+    else if(mode == sign_encrypt || mode == decrypt_verify)
     {
-        //Setup file to read from and read keys
-        file_init(&input, fileName, "rb");
-        file_read_privatekey(&rsa, key);
-        //Get text to decrypt
+        if(key == NULL || peer == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+        //Setup file to read from and read both keys once, our own private key and the peer's public key
+        file_init(&input, fileName, (mode == sign_encrypt) ? "r" : "rb");
+        ctx = librsa_new(); ctx_peer = librsa_new();
+        checkError(librsa_load_key(ctx, key, LIBRSA_PRIVATE));
+        checkError(librsa_load_key(ctx_peer, peer, LIBRSA_PUBLIC));
         readln = file_read(&input, &length_in);
-        //Decrypt text
+        if(mode == sign_encrypt)
+            checkError(librsa_sign_encrypt_size(ctx, ctx_peer, length_in, &size_out));
+        else
+            checkError(librsa_decrypt_verify_size(ctx, ctx_peer, length_in, &size_out));
+        if((writeln = (char *)malloc(size_out)) == NULL)
+            mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+        //Both steps in one pass, keeping the signature in memory
         #ifdef PROFILE
-        profile_begin(&p);
+        profile_scope_begin((mode == sign_encrypt) ? "sign-encrypt" : "decrypt-verify");
         #endif
-        writeln = multiple_decrypt_message(&rsa, readln, length_in, &length_out);
+        if(mode == sign_encrypt)
+            checkError(librsa_sign_encrypt(ctx, ctx_peer, readln, length_in, writeln, size_out, &length_out));
+        else
+            checkError(librsa_decrypt_verify(ctx, ctx_peer, readln, length_in, writeln, size_out, &length_out));
         #ifdef PROFILE
-        profile_end(&p, PRINT_MILLISECONDS);
-        printf("milliseconds\n");
+        profile_scope_end();
         #endif
-        //Setup file to write decrypted text to and write to file
-        if(raw == 1)
-        {
-            file_init(&output, fileOut, "wb");
-            file_write(&output, writeln, length_out);
-        }
-        else
-        {
-            file_init(&output, fileOut, "w");
-            file_writeln(&output, writeln, "");
-        }
-        
+        writeOutput(fileOut, writeln, length_out, mode == decrypt_verify && raw == 0);
         //Cleanup
-        free(readln); free(writeln);
-        file_close(&input); file_close(&output);
+        free(readln); free(writeln); librsa_free(ctx); librsa_free(ctx_peer);
+        file_close(&input);
+    }
+    else if(mode == convert)
+    {
+        if(fileOut == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+        checkError(librsa_convert_key(fileName, fileOut, text));
+    }
+    else if(mode == tune)
+    {
+        tune_run(tunefile);
+    }
+    else if(mode == audit)
+    {
+        audit_run(files, file_count);
+    }
+    else if(mode == keypool)
+    {
+        if(stats == 1)
+            keypool_stats(pool);
+        else
+            keypool_run(pool, bits, depth, workers);
+    }
+    else if(mode == encrypt_batch)
+    {
+        if(fileOut == NULL || key == NULL) { printUsage(); exit(RSA_EXIT_USAGE); }
+        if(file_count == 0) file_count = batch_manifest(stdin, &files);
+        ctx = librsa_new();
+        checkError(librsa_load_key(ctx, key, LIBRSA_PUBLIC));
+        if(batch_encrypt(ctx, files, file_count, fileOut, workers) > 0) exit(RSA_EXIT_FAILED);
+        librsa_free(ctx);
+    }
+    else if(mode == serve)
+    {
+        server_run(socket_path, files, file_count);
+    }
+    else if(mode == loadgen)
+    {
+        server_loadgen(socket_path, clients, requests, size, op, key_index);
     }
 
-    return 1;
+    return 0;
 }
 #else
 
@@ -174,7 +447,7 @@ int main(void)
     char *ciphertext, *recovered;
     multiple_rsa_t rsa;
     int length;
-    multiple_generate_keys(&rsa);
+    multiple_generate_keys(&rsa, MULTIPLE_DEFAULT_BITS);
     mp_print_n(5, rsa.p, rsa.q, rsa.e, rsa.d, rsa.n);
     
     /* Encrypt */
@@ -184,6 +457,6 @@ int main(void)
     recovered = multiple_decrypt_message(&rsa, ciphertext, length);
     printf("Recover: %s\r\n", recovered);
 
-    return 1;
+    return 0;
 }
 #endif
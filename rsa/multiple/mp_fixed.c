@@ -0,0 +1,118 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "mp_math.h"
+#include "mp_kernel.h"
+#include "mp_fixed.h"
+
+#ifdef MP_WORD64
+//Internal functions
+//The rows themselves still go through mp_word_kernel: a fully unrolled __int128 row was measured slower than the
+//ADX row, whose loop overhead is small next to the multiplies
+//acc = a*b, row by row. acc needs 2*len words
+static inline __attribute__((always_inline)) void fixed_multiply(u64_t *acc, u64_t *a, u64_t *b, int len)
+{
+    int i;
+    for(i = 0; i < len; i++) acc[i] = 0;
+    for(i = 0; i < len; i++)
+        acc[i + len] = mp_word_kernel.addmul_row(acc + i, a[i], b, len);
+}
+
+//acc = a^2. The products a[i]*a[j] with i < j are summed once, then doubled and the squares a[i]^2 added
+static inline __attribute__((always_inline)) void fixed_square(u64_t *acc, u64_t *a, int len)
+{
+    int i;
+    u64_t lo, hi, bit = 0;
+    unsigned __int128 c, p;
+    for(i = 0; i < 2*len; i++) acc[i] = 0;
+    for(i = 0; i < len - 1; i++)
+        acc[i + len] = mp_word_kernel.addmul_row(acc + 2*i + 1, a[i], a + i + 1, len - i - 1);
+    for(i = 0, c = 0; i < len; i++)
+    {
+        p = (unsigned __int128) a[i] * a[i];
+        lo = (acc[2*i] << 1) | bit; bit = acc[2*i] >> 63;
+        hi = (acc[2*i + 1] << 1) | bit; bit = acc[2*i + 1] >> 63;
+        c += (unsigned __int128) lo + (u64_t) p;
+        acc[2*i] = (u64_t) c; c >>= 64;
+        c += (unsigned __int128) hi + (u64_t) (p >> 64);
+        acc[2*i + 1] = (u64_t) c; c >>= 64;
+    }
+}
+
+//t = acc/W mod n, one word at a time. The carry out of each row is added straight into the word above it,
+//and whatever spills out of the top is kept in top rather than rippling further. acc must be < W*n
+static inline __attribute__((always_inline)) void fixed_reduce(u64_t *t, u64_t *acc, mp_mont_t *mont, int len)
+{
+    int i, j;
+    u64_t m, top = 0, borrow = 0, keep, u[MP_FIXED_MAX_WORDS], *n = mont->wn;
+    unsigned __int128 c;
+    for(i = 0; i < len; i++)
+    {
+        m = acc[i] * mont->wninv;
+        c = mp_word_kernel.addmul_row(acc + i, m, n, len);
+        c += (unsigned __int128) acc[i + len] + top;
+        acc[i + len] = (u64_t) c;
+        top = (u64_t) (c >> 64);
+    }
+    //Result is < 2n. Work out t - n and keep it unless it borrowed without a top word to borrow from
+    for(j = 0; j < len; j++)
+    {
+        c = (unsigned __int128) acc[len + j] - n[j] - borrow;
+        u[j] = (u64_t) c;
+        borrow = (u64_t) (c >> 64) & 1;
+    }
+    keep = (borrow > top) ? ~(u64_t) 0 : 0;
+    for(j = 0; j < len; j++)
+        t[j] = (acc[len + j] & keep) | (u[j] & ~keep);
+}
+
+//The product is built in scratch, which has room for the 2*N words, see modexp_word
+#define MP_FIXED(N) \
+    void mont_multiply_##N(u64_t *t, u64_t *a, u64_t *b, mp_mont_t *mont, u64_t *scratch) \
+    { \
+        fixed_multiply(scratch, a, b, N); \
+        fixed_reduce(t, scratch, mont, N); \
+    } \
+    void mont_square_##N(u64_t *t, u64_t *a, mp_mont_t *mont, u64_t *scratch) \
+    { \
+        fixed_square(scratch, a, N); \
+        fixed_reduce(t, scratch, mont, N); \
+    }
+
+MP_FIXED(8)
+MP_FIXED(16)
+MP_FIXED(32)
+MP_FIXED(64)
+#endif
+
+//External functions
+void mp_fixed_select(mp_mont_t *mont)
+{
+    mont->wmul = NULL;
+    mont->wsqr = NULL;
+    #ifdef MP_WORD64
+    switch(mont->wlen)
+    {
+        case 8: mont->wmul = mont_multiply_8; mont->wsqr = mont_square_8; break;
+        case 16: mont->wmul = mont_multiply_16; mont->wsqr = mont_square_16; break;
+        case 32: mont->wmul = mont_multiply_32; mont->wsqr = mont_square_32; break;
+        case 64: mont->wmul = mont_multiply_64; mont->wsqr = mont_square_64; break;
+    }
+    #endif
+}
@@ -0,0 +1,31 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP_FIXED_H
+#define MP_FIXED_H
+
+#include "mp_math.h"
+
+//Montgomery multiplication and squaring on 64 bit words, generated for the word lengths of common key sizes:
+//8, 16, 32 and 64 words cover the CRT primes and moduli of 1024, 2048 and 4096 bit keys. With the length a
+//constant the loops around the rows are unrolled, the scratch space lives on the stack, and squaring only
+//works out half the products
+#define MP_FIXED_MAX_WORDS 64
+
+void mp_fixed_select(mp_mont_t *mont); //points mont->wmul and mont->wsqr at the variant for mont->wlen, or NULL if there is none
+
+#endif
@@ -0,0 +1,577 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mp_math.h"
+#include "mp_kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNEL_X86
+#include <immintrin.h>
+#endif
+
+//Internal function prototypes
+void mac_row_scalar(u64_t *acc, int a, int *b, int len);
+void mac_block_scalar(u64_t *s, int *a, int *b, int len);
+void redc_row_scalar(u64_t *acc, int m, int *n, int len);
+int add_row_scalar(int *dst, int *a, int *b, int len);
+int sub_row_scalar(int *dst, int *a, int *b, int len);
+void submul_row_scalar(int *a, int q, int *b, int len);
+void mont_batch_scalar(int *t, int *a, int *b, int count, mp_mont_t *mont, int *scratch);
+void mont_slab(int *t, int *a, int *b, int count, int stride, mp_mont_t *mont, int *scratch);
+void mont_slab_reduce(int *t, int count, int stride, mp_mont_t *mont, int *scratch);
+#ifdef KERNEL_X86
+void mac_row_avx2(u64_t *acc, int a, int *b, int len);
+void mac_block_avx2(u64_t *s, int *a, int *b, int len);
+void redc_row_avx2(u64_t *acc, int m, int *n, int len);
+int add_row_avx2(int *dst, int *a, int *b, int len);
+int sub_row_avx2(int *dst, int *a, int *b, int len);
+void submul_row_avx2(int *a, int q, int *b, int len);
+void mont_batch_avx2(int *t, int *a, int *b, int count, mp_mont_t *mont, int *scratch);
+void mont_slab_avx2(int *t, int *a, int *b, int stride, mp_mont_t *mont, int *scratch);
+#endif
+#ifdef MP_WORD64
+u64_t addmul_row_int128(u64_t *acc, u64_t a, u64_t *b, int len);
+int add_row_int128(u64_t *dst, u64_t *a, u64_t *b, int len);
+int sub_row_int128(u64_t *dst, u64_t *a, u64_t *b, int len);
+#endif
+#if defined(MP_WORD64) && defined(KERNEL_X86)
+u64_t addmul_row_adx(u64_t *acc, u64_t a, u64_t *b, int len);
+int add_row_adx(u64_t *dst, u64_t *a, u64_t *b, int len);
+int sub_row_adx(u64_t *dst, u64_t *a, u64_t *b, int len);
+#endif
+
+mp_kernel_t mp_kernel_scalar = {"scalar", mac_row_scalar, mac_block_scalar, redc_row_scalar, add_row_scalar, sub_row_scalar, submul_row_scalar, mont_batch_scalar};
+#ifdef KERNEL_X86
+mp_kernel_t mp_kernel_avx2 = {"avx2", mac_row_avx2, mac_block_avx2, redc_row_avx2, add_row_avx2, sub_row_avx2, submul_row_avx2, mont_batch_avx2};
+#else
+mp_kernel_t mp_kernel_avx2 = {"avx2", NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+#endif
+mp_kernel_t mp_kernel = {"scalar", mac_row_scalar, mac_block_scalar, redc_row_scalar, add_row_scalar, sub_row_scalar, submul_row_scalar, mont_batch_scalar};
+mp_word_kernel_t mp_word_kernel_off = {"off", NULL, NULL, NULL};
+#ifdef MP_WORD64
+mp_word_kernel_t mp_word_kernel_int128 = {"int128", addmul_row_int128, add_row_int128, sub_row_int128};
+#else
+mp_word_kernel_t mp_word_kernel_int128 = {"int128", NULL, NULL, NULL};
+#endif
+#if defined(MP_WORD64) && defined(KERNEL_X86)
+mp_word_kernel_t mp_word_kernel_adx = {"adx", addmul_row_adx, add_row_adx, sub_row_adx};
+#else
+mp_word_kernel_t mp_word_kernel_adx = {"adx", NULL, NULL, NULL};
+#endif
+mp_word_kernel_t mp_word_kernel = {"off", NULL, NULL, NULL};
+
+//External functions
+void mp_kernel_init(void)
+{
+    if(mp_kernel_supported(&mp_kernel_avx2))
+        mp_kernel = mp_kernel_avx2;
+    else
+        mp_kernel = mp_kernel_scalar;
+    if(mp_word_kernel_supported(&mp_word_kernel_adx))
+        mp_word_kernel = mp_word_kernel_adx;
+    else if(mp_word_kernel_supported(&mp_word_kernel_int128))
+        mp_word_kernel = mp_word_kernel_int128;
+    else
+        mp_word_kernel = mp_word_kernel_off;
+}
+
+int mp_kernel_supported(mp_kernel_t *kernel)
+{
+    if(kernel->mac_row == NULL)
+        return 0;
+    #ifdef KERNEL_X86
+    if(kernel == &mp_kernel_avx2)
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    #endif
+    return 1;
+}
+
+int mp_word_kernel_supported(mp_word_kernel_t *kernel)
+{
+    if(kernel->addmul_row == NULL)
+        return (kernel == &mp_word_kernel_off) ? 1 : 0;
+    #ifdef KERNEL_X86
+    if(kernel == &mp_word_kernel_adx)
+    {
+        __builtin_cpu_init();
+        return (__builtin_cpu_supports("adx") && __builtin_cpu_supports("bmi2")) ? 1 : 0;
+    }
+    #endif
+    return 1;
+}
+
+int mp_kernel_select(const char *name)
+{
+    mp_kernel_t *kernel = NULL;
+    mp_word_kernel_t *word = NULL;
+    if(strcmp(name, mp_word_kernel_off.name) == 0) word = &mp_word_kernel_off;
+    else if(strcmp(name, mp_word_kernel_int128.name) == 0) word = &mp_word_kernel_int128;
+    else if(strcmp(name, mp_word_kernel_adx.name) == 0) word = &mp_word_kernel_adx;
+    if(word != NULL)
+    {
+        if(mp_word_kernel_supported(word) == 0)
+            return 0;
+        mp_word_kernel = *word;
+        return 1;
+    }
+    if(strcmp(name, mp_kernel_scalar.name) == 0) kernel = &mp_kernel_scalar;
+    else if(strcmp(name, mp_kernel_avx2.name) == 0) kernel = &mp_kernel_avx2;
+    if(kernel == NULL || mp_kernel_supported(kernel) == 0)
+        return 0;
+    mp_kernel = *kernel;
+    return 1;
+}
+
+//Internal functions
+//Montgomery multiplication of a slab of up to MONT_SLAB numbers, t = a*b/R mod n. The numbers are stored
+//limb-sliced: limb i of number k is element [i*stride + k], so every inner loop runs over the numbers. The product
+//and the reduction are worked out a column at a time (Comba's method), so each column sum is only split into a
+//limb and a carry once it is done. t gets len + 1 limbs and is < 2n, mont_slab_reduce finishes it off
+void mont_slab(int *t, int *a, int *b, int count, int stride, mp_mont_t *mont, int *scratch)
+{
+    int i, k, col, lo, hi, len = mont->len, ninv = mont->ninv;
+    int *n = mont->n->value, *ai, *bj, *mi, *m = scratch, nj;
+    u64_t s[MONT_SLAB];
+    for(k = 0; k < count; k++) s[k] = 0;
+    for(col = 0; col < 2*len; col++)
+    {
+        lo = (col < len) ? 0 : col - len + 1;
+        hi = (col < len) ? col : len - 1;
+        for(i = lo; i <= hi; i++)
+        {
+            ai = a + i*stride; bj = b + (col - i)*stride;
+            for(k = 0; k < count; k++)
+                s[k] += (u64_t) ai[k] * bj[k];
+        }
+        //Add the multiples of n already chosen, then pick the next one so this column becomes zero
+        for(i = lo; i < ((col < len) ? col : len); i++)
+        {
+            mi = m + i*MONT_SLAB; nj = n[col - i];
+            for(k = 0; k < count; k++)
+                s[k] += (u64_t) mi[k] * nj;
+        }
+        if(col < len)
+        {
+            mi = m + col*MONT_SLAB;
+            for(k = 0; k < count; k++)
+            {
+                mi[k] = ((int) (s[k] & RADIX_MASK) * ninv) & RADIX_MASK;
+                s[k] += (u64_t) mi[k] * n[0];
+            }
+        }
+        else
+        {
+            for(k = 0; k < count; k++)
+                t[(col - len)*stride + k] = (int) (s[k] & RADIX_MASK);
+        }
+        for(k = 0; k < count; k++) s[k] >>= RADIX_BITS;
+    }
+    for(k = 0; k < count; k++) t[len*stride + k] = (int) s[k];
+}
+
+//Subtract n from every number in the slab that is still >= n
+void mont_slab_reduce(int *t, int count, int stride, mp_mont_t *mont, int *scratch)
+{
+    int i, k, x, nj, len = mont->len, *n = mont->n->value, *u = scratch + len*MONT_SLAB;
+    int borrow[MONT_SLAB];
+    for(k = 0; k < count; k++) borrow[k] = 0;
+    for(i = 0; i <= len; i++)
+    {
+        nj = (i < len) ? n[i] : 0;
+        for(k = 0; k < count; k++)
+        {
+            x = t[i*stride + k] - nj - borrow[k];
+            u[i*MONT_SLAB + k] = x & RADIX_MASK;
+            borrow[k] = (x < 0) ? 1 : 0;
+        }
+    }
+    for(i = 0; i <= len; i++)
+        for(k = 0; k < count; k++)
+            t[i*stride + k] = (borrow[k] == 0) ? u[i*MONT_SLAB + k] : t[i*stride + k];
+}
+
+void mont_batch_scalar(int *t, int *a, int *b, int count, mp_mont_t *mont, int *scratch)
+{
+    int k, width;
+    for(k = 0; k < count; k += width)
+    {
+        width = (count - k < MONT_SLAB) ? count - k : MONT_SLAB;
+        mont_slab(t + k, a + k, b + k, width, count, mont, scratch);
+        mont_slab_reduce(t + k, width, count, mont, scratch);
+    }
+}
+
+void mac_row_scalar(u64_t *acc, int a, int *b, int len)
+{
+    int j;
+    for(j = 0; j < len; j++)
+        acc[j] += (u64_t) a * b[j];
+}
+
+void mac_block_scalar(u64_t *s, int *a, int *b, int len)
+{
+    int j, k;
+    for(j = 0; j < len; j++)
+        for(k = 0; k < MAC_BLOCK; k++)
+            s[k] += (u64_t) a[j] * b[k - j];
+}
+
+void redc_row_scalar(u64_t *acc, int m, int *n, int len)
+{
+    mac_row_scalar(acc, m, n, len);
+    acc[1] += acc[0] >> RADIX_BITS;
+}
+
+int add_row_scalar(int *dst, int *a, int *b, int len)
+{
+    int j, c = 0;
+    for(j = 0; j < len; j++)
+    {
+        c += a[j] + b[j];
+        dst[j] = c & RADIX_MASK;
+        c >>= RADIX_BITS;
+    }
+    return c;
+}
+
+int sub_row_scalar(int *dst, int *a, int *b, int len)
+{
+    int j, c = 0;
+    for(j = 0; j < len; j++)
+    {
+        c = a[j] - b[j] - c;
+        dst[j] = c & RADIX_MASK;
+        c = (c < 0) ? 1 : 0;
+    }
+    return c;
+}
+
+void submul_row_scalar(int *a, int q, int *b, int len)
+{
+    int j;
+    for(j = 0; j < len; j++)
+        a[j] -= q * b[j];
+}
+
+#ifdef KERNEL_X86
+__attribute__((target("avx2")))
+void mont_batch_avx2(int *t, int *a, int *b, int count, mp_mont_t *mont, int *scratch)
+{
+    int k, width;
+    for(k = 0; k < count; k += width)
+    {
+        width = (count - k < MONT_SLAB) ? count - k : MONT_SLAB;
+        if(width == MONT_SLAB)
+            mont_slab_avx2(t + k, a + k, b + k, count, mont, scratch);
+        else
+            mont_slab(t + k, a + k, b + k, width, count, mont, scratch);
+        mont_slab_reduce(t + k, width, count, mont, scratch);
+    }
+}
+
+//mont_slab for a full slab of eight numbers. Each column sum lives in two registers of four 64 bit lanes
+__attribute__((target("avx2")))
+void mont_slab_avx2(int *t, int *a, int *b, int stride, mp_mont_t *mont, int *scratch)
+{
+    int i, k, col, lo, hi, len = mont->len;
+    int *n = mont->n->value, *ai, *bj, *mi, *m = scratch;
+    u64_t lanes[MONT_SLAB];
+    __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256(), m0, m1, nj;
+    __m256i mask = _mm256_set1_epi64x(RADIX_MASK), ninv = _mm256_set1_epi64x(mont->ninv);
+    for(col = 0; col < 2*len; col++)
+    {
+        lo = (col < len) ? 0 : col - len + 1;
+        hi = (col < len) ? col : len - 1;
+        for(i = lo; i <= hi; i++)
+        {
+            ai = a + i*stride; bj = b + (col - i)*stride;
+            s0 = _mm256_add_epi64(s0, _mm256_mul_epu32(_mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *) ai)),
+                _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *) bj))));
+            s1 = _mm256_add_epi64(s1, _mm256_mul_epu32(_mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *) (ai + 4))),
+                _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *) (bj + 4)))));
+        }
+        for(i = lo; i < ((col < len) ? col : len); i++)
+        {
+            mi = m + i*MONT_SLAB; nj = _mm256_set1_epi64x(n[col - i]);
+            s0 = _mm256_add_epi64(s0, _mm256_mul_epu32(_mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *) mi)), nj));
+            s1 = _mm256_add_epi64(s1, _mm256_mul_epu32(_mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *) (mi + 4))), nj));
+        }
+        if(col < len)
+        {
+            m0 = _mm256_and_si256(_mm256_mul_epu32(_mm256_and_si256(s0, mask), ninv), mask);
+            m1 = _mm256_and_si256(_mm256_mul_epu32(_mm256_and_si256(s1, mask), ninv), mask);
+            nj = _mm256_set1_epi64x(n[0]);
+            s0 = _mm256_add_epi64(s0, _mm256_mul_epu32(m0, nj));
+            s1 = _mm256_add_epi64(s1, _mm256_mul_epu32(m1, nj));
+            _mm256_storeu_si256((__m256i *) lanes, m0); _mm256_storeu_si256((__m256i *) (lanes + 4), m1);
+            mi = m + col*MONT_SLAB;
+            for(k = 0; k < MONT_SLAB; k++) mi[k] = (int) lanes[k];
+        }
+        else
+        {
+            _mm256_storeu_si256((__m256i *) lanes, _mm256_and_si256(s0, mask));
+            _mm256_storeu_si256((__m256i *) (lanes + 4), _mm256_and_si256(s1, mask));
+            for(k = 0; k < MONT_SLAB; k++) t[(col - len)*stride + k] = (int) lanes[k];
+        }
+        s0 = _mm256_srli_epi64(s0, RADIX_BITS); s1 = _mm256_srli_epi64(s1, RADIX_BITS);
+    }
+    _mm256_storeu_si256((__m256i *) lanes, s0); _mm256_storeu_si256((__m256i *) (lanes + 4), s1);
+    for(k = 0; k < MONT_SLAB; k++) t[len*stride + k] = (int) lanes[k];
+}
+
+//Four 64 bit accumulators per register, _mm256_mul_epu32 multiplies the low 32 bits of each lane
+__attribute__((target("avx2")))
+void mac_row_avx2(u64_t *acc, int a, int *b, int len)
+{
+    int j;
+    __m256i va = _mm256_set1_epi64x(a), vb0, vb1, vacc0, vacc1;
+    for(j = 0; j + 8 <= len; j += 8)
+    {
+        vb0 = _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *)(b + j)));
+        vb1 = _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *)(b + j + 4)));
+        vacc0 = _mm256_loadu_si256((__m256i *)(acc + j));
+        vacc1 = _mm256_loadu_si256((__m256i *)(acc + j + 4));
+        vacc0 = _mm256_add_epi64(vacc0, _mm256_mul_epu32(va, vb0));
+        vacc1 = _mm256_add_epi64(vacc1, _mm256_mul_epu32(va, vb1));
+        _mm256_storeu_si256((__m256i *)(acc + j), vacc0);
+        _mm256_storeu_si256((__m256i *)(acc + j + 4), vacc1);
+    }
+    for(; j < len; j++)
+        acc[j] += (u64_t) a * b[j];
+}
+
+//The eight column sums stay in two registers. Each limb of a is multiplied by the eight limbs of b that
+//line up with it, which are consecutive, so b is read forwards one limb further down each step
+__attribute__((target("avx2")))
+void mac_block_avx2(u64_t *s, int *a, int *b, int len)
+{
+    int j;
+    __m256i s0 = _mm256_loadu_si256((__m256i *) s), s1 = _mm256_loadu_si256((__m256i *)(s + 4)), va;
+    for(j = 0; j < len; j++)
+    {
+        va = _mm256_set1_epi64x(a[j]);
+        s0 = _mm256_add_epi64(s0, _mm256_mul_epu32(va, _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *)(b - j)))));
+        s1 = _mm256_add_epi64(s1, _mm256_mul_epu32(va, _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *)(b - j + 4)))));
+    }
+    _mm256_storeu_si256((__m256i *) s, s0);
+    _mm256_storeu_si256((__m256i *)(s + 4), s1);
+}
+
+__attribute__((target("avx2")))
+void redc_row_avx2(u64_t *acc, int m, int *n, int len)
+{
+    mac_row_avx2(acc, m, n, len);
+    acc[1] += acc[0] >> RADIX_BITS;
+}
+
+//Carries are resolved eight limbs at a time. A lane generates a carry if its sum is >= RADIX and passes one
+//on if its sum is RADIX - 1, so adding the generate mask (shifted up one lane) to the propagate mask ripples
+//every carry through the lanes in one integer addition
+__attribute__((target("avx2")))
+int add_row_avx2(int *dst, int *a, int *b, int len)
+{
+    int j;
+    unsigned int g, p, c, carry = 0;
+    __m256i s, vc;
+    __m256i top = _mm256_set1_epi32(RADIX - 1), mask = _mm256_set1_epi32(RADIX_MASK);
+    __m256i one = _mm256_set1_epi32(1), lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for(j = 0; j + 8 <= len; j += 8)
+    {
+        s = _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(a + j)), _mm256_loadu_si256((__m256i *)(b + j)));
+        g = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(s, top)));
+        p = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(s, top)));
+        c = (((g << 1) | carry) + p) ^ p; //bit i is the carry into lane i, bit 8 the carry out
+        carry = (c >> 8) & 1;
+        vc = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(c), lanes), one);
+        _mm256_storeu_si256((__m256i *)(dst + j), _mm256_and_si256(_mm256_add_epi32(s, vc), mask));
+    }
+    for(; j < len; j++)
+    {
+        carry += a[j] + b[j];
+        dst[j] = carry & RADIX_MASK;
+        carry >>= RADIX_BITS;
+    }
+    return carry;
+}
+
+//As add_row_avx2, a lane generates a borrow if its difference is negative and passes one on if it is zero
+__attribute__((target("avx2")))
+int sub_row_avx2(int *dst, int *a, int *b, int len)
+{
+    int j, d;
+    unsigned int g, p, c, borrow = 0;
+    __m256i s, vc;
+    __m256i zero = _mm256_setzero_si256(), mask = _mm256_set1_epi32(RADIX_MASK);
+    __m256i one = _mm256_set1_epi32(1), lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    for(j = 0; j + 8 <= len; j += 8)
+    {
+        s = _mm256_sub_epi32(_mm256_loadu_si256((__m256i *)(a + j)), _mm256_loadu_si256((__m256i *)(b + j)));
+        g = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(zero, s)));
+        p = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(s, zero)));
+        c = (((g << 1) | borrow) + p) ^ p; //bit i is the borrow into lane i, bit 8 the borrow out
+        borrow = (c >> 8) & 1;
+        vc = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(c), lanes), one);
+        _mm256_storeu_si256((__m256i *)(dst + j), _mm256_and_si256(_mm256_sub_epi32(s, vc), mask));
+    }
+    for(; j < len; j++)
+    {
+        d = a[j] - b[j] - (int) borrow;
+        dst[j] = d & RADIX_MASK;
+        borrow = (d < 0) ? 1 : 0;
+    }
+    return (int) borrow;
+}
+
+__attribute__((target("avx2")))
+void submul_row_avx2(int *a, int q, int *b, int len)
+{
+    int j;
+    __m256i vq = _mm256_set1_epi32(q), va;
+    for(j = 0; j + 8 <= len; j += 8)
+    {
+        va = _mm256_loadu_si256((__m256i *)(a + j));
+        va = _mm256_sub_epi32(va, _mm256_mullo_epi32(vq, _mm256_loadu_si256((__m256i *)(b + j))));
+        _mm256_storeu_si256((__m256i *)(a + j), va);
+    }
+    for(; j < len; j++)
+        a[j] -= q * b[j];
+}
+#endif
+
+#ifdef MP_WORD64
+u64_t addmul_row_int128(u64_t *acc, u64_t a, u64_t *b, int len)
+{
+    int j;
+    unsigned __int128 c = 0;
+    for(j = 0; j < len; j++)
+    {
+        c += (unsigned __int128) a * b[j] + acc[j];
+        acc[j] = (u64_t) c;
+        c >>= 64;
+    }
+    return (u64_t) c;
+}
+
+int add_row_int128(u64_t *dst, u64_t *a, u64_t *b, int len)
+{
+    int j;
+    unsigned __int128 c = 0;
+    for(j = 0; j < len; j++)
+    {
+        c += (unsigned __int128) a[j] + b[j];
+        dst[j] = (u64_t) c;
+        c >>= 64;
+    }
+    return (int) c;
+}
+
+int sub_row_int128(u64_t *dst, u64_t *a, u64_t *b, int len)
+{
+    int j;
+    unsigned __int128 c = 0;
+    for(j = 0; j < len; j++)
+    {
+        c = (unsigned __int128) a[j] - b[j] - c;
+        dst[j] = (u64_t) c;
+        c = (c >> 64) & 1;
+    }
+    return (int) c;
+}
+#endif
+
+#if defined(MP_WORD64) && defined(KERNEL_X86)
+//mulx leaves the flags alone, so the two halves of each product can go into two separate carry chains: adcx
+//adds the low half to the high half of the last product (carry flag) and adox adds that to acc (overflow flag).
+//Written with _mulx_u64/_addcarryx_u64, gcc saves and restores the carry flag between the two chains, so the
+//loop is in assembly. Only lea, mov and jrcxz, which leave the flags alone, are used between the additions
+__attribute__((target("adx,bmi2")))
+u64_t addmul_row_adx(u64_t *acc, u64_t a, u64_t *b, int len)
+{
+    unsigned long long hi, lo, t, n = (unsigned int) len >> 2, r = len & 3;
+    __asm__ volatile(
+        "xor %k[hi], %k[hi]\n\t" //hi = 0, clears both flags
+        "1:\n\t" //four words at a time
+        "jrcxz 2f\n\t"
+        "mulx (%[b]), %[lo], %[t]\n\t"
+        "adcx %[hi], %[lo]\n\t"
+        "adox (%[acc]), %[lo]\n\t"
+        "mov %[lo], (%[acc])\n\t"
+        "mulx 8(%[b]), %[lo], %[hi]\n\t"
+        "adcx %[t], %[lo]\n\t"
+        "adox 8(%[acc]), %[lo]\n\t"
+        "mov %[lo], 8(%[acc])\n\t"
+        "mulx 16(%[b]), %[lo], %[t]\n\t"
+        "adcx %[hi], %[lo]\n\t"
+        "adox 16(%[acc]), %[lo]\n\t"
+        "mov %[lo], 16(%[acc])\n\t"
+        "mulx 24(%[b]), %[lo], %[hi]\n\t"
+        "adcx %[t], %[lo]\n\t"
+        "adox 24(%[acc]), %[lo]\n\t"
+        "mov %[lo], 24(%[acc])\n\t"
+        "lea 32(%[b]), %[b]\n\t"
+        "lea 32(%[acc]), %[acc]\n\t"
+        "lea -1(%[n]), %[n]\n\t"
+        "jmp 1b\n\t"
+        "2:\n\t"
+        "mov %[r], %[n]\n\t"
+        "3:\n\t" //the rest one word at a time
+        "jrcxz 4f\n\t"
+        "mulx (%[b]), %[lo], %[t]\n\t"
+        "adcx %[hi], %[lo]\n\t"
+        "adox (%[acc]), %[lo]\n\t"
+        "mov %[lo], (%[acc])\n\t"
+        "mov %[t], %[hi]\n\t"
+        "lea 8(%[b]), %[b]\n\t"
+        "lea 8(%[acc]), %[acc]\n\t"
+        "lea -1(%[n]), %[n]\n\t"
+        "jmp 3b\n\t"
+        "4:\n\t"
+        "mov $0, %k[lo]\n\t" //fold both carries into the word out
+        "adcx %[lo], %[hi]\n\t"
+        "adox %[lo], %[hi]\n\t"
+        : [hi] "=&r" (hi), [lo] "=&r" (lo), [t] "=&r" (t), [acc] "+r" (acc), [b] "+r" (b), [n] "+c" (n)
+        : [r] "r" (r), "d" (a)
+        : "cc", "memory");
+    return hi; //the high half of a product is at most 2^64 - 2, so this cannot overflow
+}
+
+__attribute__((target("adx,bmi2")))
+int add_row_adx(u64_t *dst, u64_t *a, u64_t *b, int len)
+{
+    int j;
+    unsigned char c = 0;
+    for(j = 0; j < len; j++)
+        c = _addcarryx_u64(c, a[j], b[j], (unsigned long long *) &dst[j]);
+    return c;
+}
+
+__attribute__((target("adx,bmi2")))
+int sub_row_adx(u64_t *dst, u64_t *a, u64_t *b, int len)
+{
+    int j;
+    unsigned char c = 0;
+    for(j = 0; j < len; j++)
+        c = _subborrow_u64(c, a[j], b[j], (unsigned long long *) &dst[j]);
+    return c;
+}
+#endif
@@ -0,0 +1,63 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP_KERNEL_H
+#define MP_KERNEL_H
+
+#include "mp_math.h"
+
+#define MONT_SLAB 8 //numbers mont_batch works on at once, its scratch needs (2*len + 1)*MONT_SLAB elements
+#define MAC_BLOCK 8 //product columns mac_block works on at once
+
+//The inner limb loops of mp_math.c. Each set of kernels gives identical results, and the fastest
+//set the CPU supports is picked at startup by mp_kernel_init
+typedef struct
+{
+    const char *name;
+    void (*mac_row)(u64_t *acc, int a, int *b, int len); //acc[j] += a*b[j], carries are left in acc
+    void (*mac_block)(u64_t *s, int *a, int *b, int len); //s[k] += a[j]*b[k - j] for MAC_BLOCK columns k, see comba_multiply
+    void (*redc_row)(u64_t *acc, int m, int *n, int len); //acc[j] += m*n[j], then moves the carry out of acc[0] into acc[1]
+    int (*add_row)(int *dst, int *a, int *b, int len); //dst = a + b, returns the carry out
+    int (*sub_row)(int *dst, int *a, int *b, int len); //dst = a - b, returns the borrow out
+    void (*submul_row)(int *a, int q, int *b, int len); //a[j] -= q*b[j], borrows are left for the caller
+    void (*mont_batch)(int *t, int *a, int *b, int count, mp_mont_t *mont, int *scratch); //limb-sliced Montgomery multiplication, see mp_modexp_batch
+} mp_kernel_t;
+
+//The row loops of the 64 bit word Montgomery path (MP_WORD64). add_row/sub_row return the carry/borrow out.
+//A set with NULL rows turns the word path off, and mp_math.c falls back to the limb kernels above
+typedef struct
+{
+    const char *name;
+    u64_t (*addmul_row)(u64_t *acc, u64_t a, u64_t *b, int len); //acc[j] += a*b[j], returns the carry word out
+    int (*add_row)(u64_t *dst, u64_t *a, u64_t *b, int len);
+    int (*sub_row)(u64_t *dst, u64_t *a, u64_t *b, int len);
+} mp_word_kernel_t;
+
+extern mp_kernel_t mp_kernel; //The kernels in use, scalar until mp_kernel_init is called
+extern mp_kernel_t mp_kernel_scalar;
+extern mp_kernel_t mp_kernel_avx2;
+extern mp_word_kernel_t mp_word_kernel; //The word kernels in use, off until mp_kernel_init is called
+extern mp_word_kernel_t mp_word_kernel_off;
+extern mp_word_kernel_t mp_word_kernel_int128;
+extern mp_word_kernel_t mp_word_kernel_adx;
+
+void mp_kernel_init(void);
+int mp_kernel_supported(mp_kernel_t *kernel);
+int mp_word_kernel_supported(mp_word_kernel_t *kernel);
+int mp_kernel_select(const char *name); //name is a limb or word kernel set, returns 0 if unknown or not supported by this CPU
+
+#endif
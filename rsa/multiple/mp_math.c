@@ -22,29 +22,190 @@
 #include <math.h>
 
 #include "mp_math.h"
+#include "mp_kernel.h"
+#include "mp_fixed.h"
+#include "mp_ntt.h"
 
-void mp_init(mp_ptr n, int max_length, int zero)
+int mp_div_newton_len = DIV_NEWTON_LEN;
+int mp_ntt_len = NTT_LEN;
+mp_tunable_t mp_tunables[] = {{"div_newton_len", &mp_div_newton_len}, {"ntt_len", &mp_ntt_len}, {NULL, NULL}};
+
+//Internal function prototypes
+void comba_multiply(int *dst, int *a, int a_len, int *b, int b_len);
+void comba_square(int *dst, int *a, int len);
+void mont_multiply(int *t, int *a, int a_len, int *b, int b_len, mp_mont_t *mont, u64_t *acc);
+void mont_init_words(mp_mont_t *mont);
+void mont_multiply_word(u64_t *t, u64_t *a, u64_t *b, mp_mont_t *mont, u64_t *acc);
+void modexp_word(mp_ptr dst, mp_ptr x, mp_ptr e, mp_mont_t *mont);
+void limbs_to_words(u64_t *w, int wlen, int *v, int len);
+void words_to_limbs(int *v, int len, u64_t *w, int wlen);
+void divide_schoolbook(mp_ptr dst, mp_ptr a, mp_ptr b);
+void divide_newton(mp_ptr dst, mp_ptr a, mp_ptr b);
+void limbs_shift(mp_ptr dst, mp_ptr a, int k);
+void mp_reciprocal(mp_ptr x, mp_ptr a, int n);
+int *mp_alloc(int len);
+void mp_settle(mp_ptr n, int top);
+void mp_fail_exit(int error, const char *message);
+
+void (*mp_fail_handler)(int error, const char *message) = mp_fail_exit;
+
+typedef struct
+{
+    void (*cleanup)(void *);
+    void *arg;
+} mp_cleanup_t;
+
+__thread mp_cleanup_t mp_cleanups[MP_CLEANUPS];
+__thread int mp_cleanup_count = 0;
+
+#ifdef MP_COUNT
+mp_count_t mp_counts[MP_PHASES][MP_COUNTS];
+__thread int mp_count_phase = MP_PHASE_OTHER;
+const char *mp_count_names[MP_COUNTS] = {"mp_add", "mp_subtract", "mp_multiply", "mp_square", "mp_divide", "mp_mod",
+    "mp_mul_ui", "mp_divmod_ui", "mp_mod_ui", "mp_is_coprime", "mp_gcd", "mp_modexp", "mp_mont_multiply", "mp_modexp_mont",
+    "mp_J", "mp_init (heap)", "mp_grow (heap)"};
+const char *mp_phase_names[MP_PHASES] = {"other", "keygen", "encrypt", "decrypt"};
+
+//Prints every counter that was hit, then the limb products of each phase, as a table or as JSON
+void mp_count_dump(FILE *out, int json)
+{
+    int phase, op, first;
+    u64_t calls, work;
+    if(json == 1) fprintf(out, "{");
+    else fprintf(out, "%-8s %-18s %14s %18s\n", "phase", "op", "calls", "limb products");
+    for(phase = 0; phase < MP_PHASES; phase++)
+    {
+        if(json == 1) fprintf(out, "%s\n  \"%s\": {", (phase == 0) ? "" : ",", mp_phase_names[phase]);
+        for(op = 0, first = 1, calls = 0, work = 0; op < MP_COUNTS; op++)
+        {
+            if(mp_counts[phase][op].calls == 0) continue;
+            if(json == 1)
+                fprintf(out, "%s\n    \"%s\": {\"calls\": %llu, \"%s\": %llu}", (first == 1) ? "" : ",", mp_count_names[op],
+                    mp_counts[phase][op].calls, (op >= MP_COUNT_INIT_ALLOC) ? "bytes" : "limb_products", mp_counts[phase][op].work);
+            else
+                fprintf(out, "%-8s %-18s %14llu %18llu%s\n", mp_phase_names[phase], mp_count_names[op], mp_counts[phase][op].calls,
+                    mp_counts[phase][op].work, (op >= MP_COUNT_INIT_ALLOC) ? " bytes" : "");
+            if(op < MP_COUNT_INIT_ALLOC) { calls += mp_counts[phase][op].calls; work += mp_counts[phase][op].work; }
+            first = 0;
+        }
+        if(json == 1)
+            fprintf(out, "%s\n    \"total\": {\"calls\": %llu, \"limb_products\": %llu}\n  }", (first == 1) ? "" : ",", calls, work);
+        else if(calls > 0)
+            fprintf(out, "%-8s %-18s %14llu %18llu\n", mp_phase_names[phase], "total", calls, work);
+    }
+    if(json == 1) fprintf(out, "\n}\n");
+}
+
+//For atexit: dumps the counters to stderr, as JSON if RSA_COUNT is set to json
+void mp_count_report(void)
+{
+    const char *format = getenv("RSA_COUNT");
+    mp_count_dump(stderr, (format != NULL && strcmp(format, "json") == 0) ? 1 : 0);
+}
+#endif
+
+void mp_fail(int error, const char *format, ...)
+{
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    while(mp_cleanup_count > 0)
+    {
+        mp_cleanup_count--;
+        mp_cleanups[mp_cleanup_count].cleanup(mp_cleanups[mp_cleanup_count].arg);
+    }
+    mp_fail_handler(error, message);
+    exit(error); //in case the handler returned anyway
+}
+
+void mp_cleanup_push(void (*cleanup)(void *), void *arg)
+{
+    if(mp_cleanup_count == MP_CLEANUPS)
+        mp_fail(MP_ERR_MEMORY, "Too many cleanups: [%s, %d]\n", __FILE__, __LINE__);
+    mp_cleanups[mp_cleanup_count].cleanup = cleanup;
+    mp_cleanups[mp_cleanup_count].arg = arg;
+    mp_cleanup_count++;
+}
+
+void mp_cleanup_pop(void)
+{
+    if(mp_cleanup_count > 0) mp_cleanup_count--;
+}
+
+void mp_fail_exit(int error, const char *message)
+{
+    printf("%s", message);
+    exit(error);
+}
+
+//The storage always starts out cleared, as the limbs above len must be zero
+void mp_init(mp_ptr n, int max_length)
 {    
+    int i;
     n->max_len = max_length;
-    n->value = NULL;
-    if((n->value = (int *)malloc(n->max_len*sizeof(int))) == NULL)
-        { printf("malloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
     n->len = 0;
-    if(zero == 1)
-        mp_zero(n);
+    if(max_length <= MP_SMALL_LEN)
+    {
+        n->value = n->small;
+        for(i = 0; i < MP_SMALL_LEN; i++) n->value[i] = 0;
+    }
+    else
+    {
+        MP_COUNT_OP(MP_COUNT_INIT_ALLOC, max_length*sizeof(int));
+        n->value = mp_alloc(max_length);
+        for(i = 0; i < max_length; i++) n->value[i] = 0;
+    }
 }
 
 void mp_zero(mp_ptr n)
 {
     int i;
-    for(i = 0; i < n->max_len; i++)
+    for(i = 0; i < n->len; i++)
         n->value[i] = 0;
     n->len = 0;
 }
 
+//Heap storage for len limbs, rounded up to whole cache lines and aligned to one
+int *mp_alloc(int len)
+{
+    void *p = NULL;
+    size_t size = ((len*sizeof(int) + MP_ALIGN - 1) / MP_ALIGN) * MP_ALIGN;
+    if(posix_memalign(&p, MP_ALIGN, size) != 0)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    return (int *) p;
+}
+
+void mp_grow(mp_ptr n, int max_length)
+{
+    int i, *value;
+    if(max_length <= n->max_len) return;
+    if(max_length > MP_SMALL_LEN) //small is already cleared past max_len, so only the heap needs new storage
+    {
+        MP_COUNT_OP(MP_COUNT_GROW_ALLOC, max_length*sizeof(int));
+        value = mp_alloc(max_length);
+        for(i = 0; i < n->len; i++) value[i] = n->value[i];
+        for(; i < max_length; i++) value[i] = 0;
+        if(n->value != n->small) free(n->value);
+        n->value = value;
+    }
+    n->max_len = max_length;
+}
+
+//n was just written from limb 0 up to top. Clears whatever it held from there up to its old length, then
+//finds its new length
+void mp_settle(mp_ptr n, int top)
+{
+    int i;
+    for(i = top; i < n->len; i++) n->value[i] = 0;
+    n->len = top;
+    mp_length(n);
+}
+
 void mp_free(mp_ptr n)
 {
-    free(n->value);
+    if(n->value != n->small) free(n->value);
 }
 
 void mp_free_n(int num, ...)
@@ -57,7 +218,7 @@ void mp_free_n(int num, ...)
 void mp_swap(mp_ptr a, mp_ptr b)
 {
     mp_t tmp;
-    mp_init(tmp, a->max_len > b->max_len ? a->max_len : b->max_len, 0);
+    mp_init(tmp, a->max_len > b->max_len ? a->max_len : b->max_len);
     mp_assign(tmp, a);
     mp_assign(a, b);
     mp_assign(b, tmp);
@@ -69,14 +230,9 @@ void mp_char2numIO(mp_ptr dst, char *string)
     int i, j, len = ((int) strlen(string) + 1) / (MAX_LEN_RADIX + 1);
     if(dst->value == NULL) //need to setup
     {
-        mp_init(dst, len, 0);
-    }
-    if(dst->max_len < len) //reallocate
-    {
-        if((dst->value = (int *)realloc(dst->value, len*sizeof(int))) == NULL)
-            { printf("realloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
-        else dst->max_len = len;
+        mp_init(dst, len);
     }
+    mp_grow(dst, len);
     mp_zero(dst);
     for(i = 0, j = len-1; i < (int) strlen(string) && j >= 0; i += MAX_LEN_RADIX + 1, j--)
     {
@@ -85,6 +241,7 @@ void mp_char2numIO(mp_ptr dst, char *string)
         tmp[MAX_LEN_RADIX] = '\0';
         dst->value[j] = atoi(tmp);
     }
+    dst->len = len;
     mp_length(dst);
 }
 
@@ -93,7 +250,7 @@ char *mp_num2charIO(mp_ptr n)
     int i, j;
     char *string = NULL;
     if((string = (char *)malloc(n->max_len*(MAX_LEN_RADIX+1) + 1)) == NULL)
-        { printf("malloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
     for(i = n->max_len-1, j = 0; i >= 0; i--, j += MAX_LEN_RADIX + 1) //print out leading zeros as well, and print MSB first
     {
         if(i > 0)
@@ -124,21 +281,19 @@ void mp_print_n(int num, ...)
 void mp_assign(mp_ptr dst, mp_ptr src)
 {
     int i;
-    if(dst->max_len < src->len) //reallocate
-    {
-        if((dst->value = (int *)realloc(dst->value, src->len*sizeof(int))) == NULL)
-            { printf("realloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
-        else dst->max_len = src->len;
-    }
-    mp_zero(dst);
-    dst->len = src->len;
+    mp_grow(dst, src->len);
     for(i = 0; i < src->len; i++)
         dst->value[i] = src->value[i];
+    for(; i < dst->len; i++)
+        dst->value[i] = 0;
+    dst->len = src->len;
 }
 
-void mp_assign_s64(mp_ptr dst, s64_t src) //Note: does not check if dst is large enough!
+void mp_assign_s64(mp_ptr dst, s64_t src)
 {
     int i, tmp; s64_t cpy;
+    for(i = 0, cpy = src; cpy > 0; i++) cpy /= RADIX;
+    mp_grow(dst, i);
     mp_zero(dst); 
     cpy = src;
     i = 0;
@@ -165,10 +320,10 @@ int mp_is_even(mp_ptr n)
     else return 0;
 }
 
-int mp_length(mp_ptr n)
+int mp_length(mp_ptr n) //limbs above len are always zero, so the scan starts at len
 {
     int i;
-    for(i = n->max_len-1; i >= 0; i--) 
+    for(i = n->len-1; i >= 0; i--) 
         { if(n->value[i] != 0) break; }
     n->len = i+1;
     return n->len;
@@ -178,10 +333,13 @@ int mp_compare(mp_ptr a, mp_ptr b)
 {
     int i;
     int ret = 0;
+    int x, y;
     for(i = (a->len > b->len) ? a->len-1: b->len-1; i >= 0; i--)
     {
-        if(a->value[i] > b->value[i]) { ret = 1; break; }
-        else if(a->value[i] < b->value[i]) { ret = -1; break; }
+        x = (i < a->len) ? a->value[i] : 0; //the shorter one may not have storage out to the other's length
+        y = (i < b->len) ? b->value[i] : 0;
+        if(x > y) { ret = 1; break; }
+        else if(x < y) { ret = -1; break; }
     }
     return ret;
 }
@@ -197,119 +355,365 @@ void mp_increment(mp_ptr n, int increment)
         else if(j < 0) { n->value[i] = RADIX - abs(j); j = -1; }
         else { n->value[i] = j; j = 0; break; }
     }
-    if(j == 1) { n->value[i] = j; n->len++; }
+    if(j == 1) { mp_grow(n, n->len + 1); n->value[i] = j; n->len++; }
     else if(j == 0 && increment < 0 && n->value[n->len-1] == 0) n->len--;
 }
 
 void mp_add(mp_ptr dst, mp_ptr a, mp_ptr b)
 {
-    int i, j, res, len;
-    len = (a->len > b->len) ? a->len : b->len;
-    if(dst->max_len < len + 1) //reallocate
+    int i, j, len, common;
+    mp_ptr longer = (a->len > b->len) ? a : b;
+    len = longer->len;
+    MP_COUNT_OP(MP_COUNT_ADD, len);
+    common = (a->len > b->len) ? b->len : a->len;
+    mp_grow(dst, len + 1);
+    j = mp_kernel.add_row(dst->value, a->value, b->value, common);
+    for(i = common; i < len; i++)
     {
-        if((dst->value = (int *)realloc(dst->value, (len + 1)*sizeof(int))) == NULL)
-            { printf("realloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
-        else dst->max_len = len + 1;
+        j += longer->value[i];
+        dst->value[i] = j & RADIX_MASK;
+        j >>= RADIX_BITS;
     }
-    mp_zero(dst);
-    j = 0;
-    for(i = 0; i < len || (a->value[i] == 0 && b->value[i] == 0); i++)
+    dst->value[i] = j;
+    mp_settle(dst, len + 1);
+}
+
+void mp_subtract(mp_ptr dst, mp_ptr a, mp_ptr b) //NOTE: assumes a >= b
+{
+    int i, j, len;
+    len = a->len;
+    MP_COUNT_OP(MP_COUNT_SUBTRACT, len);
+    mp_grow(dst, len);
+    j = mp_kernel.sub_row(dst->value, a->value, b->value, b->len);
+    for(i = b->len; i < len; i++)
     {
-        j += a->value[i] + b->value[i];
-        if(j >= RADIX) { dst->value[i] = j - RADIX; j = 1; }
-        else { dst->value[i] = j; j = 0; }
+        j = a->value[i] - j;
+        dst->value[i] = j & RADIX_MASK;
+        j = (j < 0) ? 1 : 0;
     }
-    if(j != 0) dst->value[i] = j;
-    res = mp_length(dst);
+    mp_settle(dst, len);
 }
 
-void mp_multiply(mp_ptr dst, mp_ptr a, mp_ptr b)
+//Product scanning (Comba) multiplication, dst = a*b. The columns of the product are worked out MAC_BLOCK at a
+//time by the mac_block kernel, which keeps their sums in registers, and each column is split into a limb and a
+//carry once it is done. b must be padded with MAC_BLOCK zero limbs either side, as the kernel reads past its ends.
+//dst needs a_len + b_len limbs
+void comba_multiply(int *dst, int *a, int a_len, int *b, int b_len)
 {
-    int i,j, res;    
-    if((a->len+b->len) > dst->max_len) //reallocate
+    int k, col, lo, hi, len = a_len + b_len;
+    u64_t c = 0, s[MAC_BLOCK];
+    for(col = 0; col < len; col += MAC_BLOCK)
     {
-        if((dst->value = (int *)realloc(dst->value, (a->len + b->len)*sizeof(int))) == NULL)
-            { printf("realloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
-        else dst->max_len = a->len + b->len;
+        for(k = 0; k < MAC_BLOCK; k++) s[k] = 0;
+        lo = (col < b_len) ? 0 : col - b_len + 1;
+        hi = (col + MAC_BLOCK - 1 < a_len) ? col + MAC_BLOCK - 1 : a_len - 1;
+        if(hi >= lo)
+            mp_kernel.mac_block(s, a + lo, b + col - lo, hi - lo + 1);
+        for(k = 0; k < MAC_BLOCK && col + k < len; k++)
+        {
+            c += s[k];
+            dst[col + k] = (int) (c & RADIX_MASK);
+            c >>= RADIX_BITS;
+        }
     }
-    mp_zero(dst);
-    for(i = 0; i < a->len; i++) 
-    {  
-        for (j = 0; j < b->len; j++) 
+}
+
+//Comba squaring, dst = a^2. Each product a[i]*a[j] with i != j turns up twice in a column, so only the ones with
+//i < j are summed and the sum doubled. Products with i below every column of the block go through mac_block, the
+//few that only belong to some columns are added one at a time. a must be padded as b is in comba_multiply
+void comba_square(int *dst, int *a, int len)
+{
+    int i, k, col, lo, last, top;
+    u64_t c = 0, s[MAC_BLOCK];
+    for(col = 0; col < 2*len; col += MAC_BLOCK)
+    {
+        for(k = 0; k < MAC_BLOCK; k++) s[k] = 0;
+        lo = (col < len) ? 0 : col - len + 1;
+        last = (col + 1)/2 - 1; //the last i with i < col - i
+        if(last >= lo)
+            mp_kernel.mac_block(s, a + lo, a + col - lo, last - lo + 1);
+        top = (col + MAC_BLOCK)/2 - 1; //the last i with i < col + k - i for some column in the block
+        for(i = (last + 1 > lo) ? last + 1 : lo; i <= top && i < len; i++)
+            for(k = 0; k < MAC_BLOCK; k++)
+                if(2*i < col + k && col + k - i < len)
+                    s[k] += (u64_t) a[i] * a[col + k - i];
+        for(k = 0; k < MAC_BLOCK && col + k < 2*len; k++)
         {
-            dst->value[i+j+1] = dst->value[i+j+1] + (dst->value[i+j] + a->value[i] * b->value[j]) / RADIX;
-            dst->value[i+j] = (dst->value[i+j] + a->value[i] * b->value[j]) % RADIX;
+            c += 2*s[k];
+            if(((col + k) & 1) == 0)
+                c += (u64_t) a[(col + k)/2] * a[(col + k)/2];
+            dst[col + k] = (int) (c & RADIX_MASK);
+            c >>= RADIX_BITS;
         }
     }
-    res = mp_length(dst);
 }
 
-//Adapted from course notes
+void mp_multiply(mp_ptr dst, mp_ptr a, mp_ptr b)
+{
+    int i, len = a->len + b->len;
+    int *pad = NULL;
+    MP_COUNT_OP(MP_COUNT_MULTIPLY, (u64_t)a->len*b->len);
+    if(a->value == b->value && a->len == b->len)
+        { mp_square(dst, a); return; }
+    mp_grow(dst, len);
+    if(a->len == 0 || b->len == 0)
+        { mp_zero(dst); return; }
+    #ifdef MP_WORD64
+    if(a->len >= mp_ntt_len && b->len >= mp_ntt_len)
+        { mp_ntt_multiply(dst->value, a->value, a->len, b->value, b->len); mp_settle(dst, len); return; }
+    #endif
+    //Padded copies of a and b, which also lets dst be either of them
+    if((pad = (int *)calloc(len + 4*MAC_BLOCK, sizeof(int))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "calloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(i = 0; i < a->len; i++) pad[MAC_BLOCK + i] = a->value[i];
+    for(i = 0; i < b->len; i++) pad[3*MAC_BLOCK + a->len + i] = b->value[i];
+    comba_multiply(dst->value, pad + MAC_BLOCK, a->len, pad + 3*MAC_BLOCK + a->len, b->len);
+    free(pad);
+    mp_settle(dst, len);
+}
+
+void mp_square(mp_ptr dst, mp_ptr a)
+{
+    int i, len = 2*a->len;
+    int *pad = NULL;
+    MP_COUNT_OP(MP_COUNT_SQUARE, (u64_t)a->len*(a->len + 1)/2);
+    mp_grow(dst, len);
+    if(a->len == 0)
+        { mp_zero(dst); return; }
+    #ifdef MP_WORD64
+    if(a->len >= mp_ntt_len)
+        { mp_ntt_multiply(dst->value, a->value, a->len, a->value, a->len); mp_settle(dst, len); return; }
+    #endif
+    if((pad = (int *)calloc(a->len + 2*MAC_BLOCK, sizeof(int))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "calloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(i = 0; i < a->len; i++) pad[MAC_BLOCK + i] = a->value[i];
+    comba_square(dst->value, pad + MAC_BLOCK, a->len);
+    free(pad);
+    mp_settle(dst, len);
+}
+
 void mp_divide(mp_ptr dst, mp_ptr a, mp_ptr b)
 {
-    int i, j, q, x, res;
-    int a1[100];
     while(b->value[b->len-1] == 0) b->len--;
-    if(a->len == a->max_len) //reallocate
+    MP_COUNT_OP(MP_COUNT_DIVIDE, (a->len >= b->len) ? (u64_t)(a->len - b->len + 1)*b->len : 0);
+    if(b->len == 1)
+        mp_assign_s64(a, mp_divmod_ui(dst, a, b->value[0]));
+    else if(a->len < b->len)
+        mp_zero(dst);
+    else if(b->len >= mp_div_newton_len && a->len - b->len >= mp_div_newton_len / 2)
+        divide_newton(dst, a, b);
+    else
+        divide_schoolbook(dst, a, b);
+}
+
+//Knuth's Algorithm D. a and b are first scaled by d so the top limb of b is at least RADIX/2, which keeps each
+//quotient limb guessed from the top limbs at most one too large. dst = a / b, a becomes the remainder
+void divide_schoolbook(mp_ptr dst, mp_ptr a, mp_ptr b)
+{
+    int i, j, c, q, r, x, d, n = b->len, m = a->len - b->len;
+    int *u, *v;
+    mp_t an, bn;
+    d = RADIX / (b->value[n-1] + 1);
+    mp_init(an, a->len + 1); mp_mul_ui(an, a, d);
+    mp_init(bn, n); mp_mul_ui(bn, b, d);
+    u = an->value; v = bn->value;
+    mp_grow(dst, m + 1);
+    mp_zero(dst);
+    for(j = m; j >= 0; j--)
+    {
+        x = RADIX*u[j + n] + u[j + n - 1];
+        q = x / v[n-1]; r = x % v[n-1];
+        while(q >= RADIX || q*v[n-2] > RADIX*r + u[j + n - 2])
+        {
+            q--; r += v[n-1];
+            if(r >= RADIX) break;
+        }
+        //u -= q*v from limb j, the borrows left by the kernel are then carried up (>> rounds down)
+        mp_kernel.submul_row(u + j, q, v, n);
+        for(i = 0, c = 0; i < n; i++)
+        {
+            c += u[j + i];
+            u[j + i] = c & RADIX_MASK;
+            c >>= RADIX_BITS;
+        }
+        u[j + n] += c;
+        if(u[j + n] < 0) //q was one too large, add v back
+        {
+            q--;
+            for(i = 0, c = 0; i < n; i++)
+            {
+                c += u[j + i] + v[i];
+                u[j + i] = c & RADIX_MASK;
+                c >>= RADIX_BITS;
+            }
+            u[j + n] += c;
+        }
+        dst->value[j] = q;
+    }
+    an->len = n; mp_length(an); //everything above the remainder has been cleared
+    mp_divmod_ui(a, an, d);
+    mp_settle(dst, m + 1);
+    mp_free_n(2, an, bn);
+}
+
+//dst = a / R^k for k > 0 limbs, or a*R^-k for k < 0
+void limbs_shift(mp_ptr dst, mp_ptr a, int k)
+{
+    int i, len = a->len - k;
+    if(len <= 0) { mp_zero(dst); return; }
+    mp_grow(dst, len);
+    if(k > 0)
+        for(i = 0; i < len; i++) dst->value[i] = a->value[i + k];
+    else
     {
-        if((a->value = (int *)realloc(a->value, (a->max_len + 1)*sizeof(int))) == NULL)
-            { printf("realloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
-        else a->max_len += 1;
+        for(i = len - 1; i >= -k; i--) dst->value[i] = a->value[i + k];
+        for(; i >= 0; i--) dst->value[i] = 0;
     }
-    a->value[a->len] = 0; 
-    a->len++;
-    if(dst->max_len < a->len) //reallocate
+    mp_settle(dst, len);
+}
+
+//Approximate reciprocal of an n limb a with RADIX^n/2 <= a < RADIX^n, x such that a*x < RADIX^(2n) <= a*(x + 2).
+//Newton's iteration, refining the reciprocal of the top half of a (Brent and Zimmermann, Modern Computer
+//Arithmetic, algorithm 3.5). The cost is a few multiplications of the size of a
+void mp_reciprocal(mp_ptr x, mp_ptr a, int n)
+{
+    int l, h;
+    mp_t ah, xh, t, u, w;
+    if(n <= 2)
     {
-        if((dst->value = (int *)realloc(dst->value, a->len*sizeof(int))) == NULL)
-            { printf("realloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
-        else dst->max_len = a->len;
+        u64_t v = (u64_t) a->value[0] + ((n == 2) ? (u64_t) a->value[1] << RADIX_BITS : 0);
+        mp_assign_s64(x, (((u64_t) 1 << (2*n*RADIX_BITS)) - 1) / v);
+        return;
     }
+    l = (n - 1)/2; h = n - l;
+    mp_init(ah, h); mp_init(xh, h + 1);
+    mp_init(t, n + h + 2); mp_init(u, n + h + 2);
+    mp_init(w, n + h + 1);
+    limbs_shift(ah, a, l);
+    mp_reciprocal(xh, ah, h);
+    mp_multiply(t, a, xh);
+    w->value[n + h] = 1; w->len = n + h + 1;
+    while(mp_compare(t, w) >= 0)
+        { mp_increment(xh, -1); mp_subtract(t, t, a); }
+    mp_subtract(t, w, t);
+    limbs_shift(t, t, l);
+    mp_multiply(u, t, xh);
+    limbs_shift(u, u, 2*h - l);
+    limbs_shift(x, xh, -l);
+    mp_add(x, x, u);
+    mp_free_n(5, ah, xh, t, u, w);
+}
+
+//Division by a reciprocal, for long divisors. b is shifted up so its top bit is set and its reciprocal x found once.
+//a is then divided n limbs at a time from the top: with the remainder so far r < b, c = r*R^n + the next n limbs is
+//below R^(2n), and q = (c/R^(n-1))*x/R^(n+1) falls short of c/b by only a few, which are added back one at a time.
+//dst = a / b, a becomes the remainder
+void divide_newton(mp_ptr dst, mp_ptr a, mp_ptr b)
+{
+    int i, k, s, n = b->len, blocks;
+    mp_t an, bn, x, r, c, q, t;
+    for(s = 0; (b->value[n-1] << s) < RADIX/2; s++);
+    mp_init(an, a->len + 1); mp_mul_ui(an, a, 1 << s);
+    mp_init(bn, n); mp_mul_ui(bn, b, 1 << s);
+    mp_init(x, n + 1); mp_reciprocal(x, bn, n);
+    blocks = (an->len + n - 1) / n;
+    mp_init(r, n); mp_init(c, 2*n); mp_init(q, n + 2); mp_init(t, 2*n + 2);
+    mp_grow(dst, blocks*n);
     mp_zero(dst);
-    for(j = a->len - b->len - 1; j >= 0; j--) 
+    for(k = blocks - 1; k >= 0; k--)
     {
-        x = RADIX * a->value[j + b->len] + a->value[j + b->len-1];   //     when a1[j+i] is negative, d = -a1[j+i] deficit  
-        a->value[j + b->len-1] = x;            //     ..-d....-2r...-r....0....r.......
-        a->value[j + b->len] = 0;              //     |  | |    |    |    |    |
-        q = x / b->value[b->len - 1] + 1; //Guess q
-        do
-        {
-            for(i = b->len - 1; i >= 0; i--) a1[j+i] = a->value[j+i];
-            q--; // if q is too large, decrease it by 1
-            for(i = b->len - 1; i >= 0; i--) a1[j+i] = a1[j+i] - q*b->value[i];
-            for(i = 0; i <= b->len - 2;i++) // Try to subtract q*b from a
-            { 
-                if(a1[j+i] < 0)
-                {
-                    a1[j+i+1] = a1[j+i+1] - (RADIX-1 - a1[i+j])/RADIX; //borrow from left
-                    a1[j+i] = a1[j+i] + ((RADIX-1 - a1[i+j])/RADIX)*RADIX; //remaining at i+j
-                }
-            }
-        } while(a1[j+b->len - 1] < 0);
-        dst->value[j] = q;
-        for(i = b->len - 1; i >= 0; i--) a->value[j+i] = a1[j+i];
+        limbs_shift(c, r, -n);
+        for(i = 0; i < n && k*n + i < an->len; i++) c->value[i] = an->value[k*n + i];
+        c->len = (r->len > 0) ? n + r->len : n; mp_length(c);
+        limbs_shift(t, c, n - 1);
+        mp_multiply(q, t, x);
+        limbs_shift(q, q, n + 1);
+        mp_multiply(t, q, bn);
+        mp_subtract(r, c, t);
+        while(mp_compare(r, bn) >= 0)
+            { mp_subtract(r, r, bn); mp_increment(q, 1); }
+        for(i = 0; i < q->len; i++) dst->value[k*n + i] = q->value[i];
     }
-    res = mp_length(a); //update length of remainder
-    res = mp_length(dst);
+    mp_divmod_ui(a, r, 1 << s);
+    mp_settle(dst, blocks*n);
+    mp_free_n(7, an, bn, x, r, c, q, t);
 }
 
 void mp_mod(mp_ptr dst, mp_ptr a, mp_ptr b)
 {
     mp_t tmp;
-    mp_init(tmp, a->max_len, 0);
+    MP_COUNT_OP(MP_COUNT_MOD, 0);
+    mp_init(tmp, a->max_len);
     mp_assign(tmp, a);
     mp_divide(dst, tmp, b);
     mp_assign(dst, tmp);
     mp_free(tmp);
 }
 
+//The word operand routines below take a single pass over the limbs of a, and need no temporary mp_t for b
+void mp_mul_ui(mp_ptr dst, mp_ptr a, unsigned int b)
+{
+    int i, extra, len = a->len;
+    unsigned int x;
+    u64_t c = 0;
+    MP_COUNT_OP(MP_COUNT_MUL_UI, len);
+    for(extra = 0, x = b; x > 0; x >>= RADIX_BITS) extra++;
+    mp_grow(dst, len + extra);
+    for(i = 0; i < len; i++)
+    {
+        c += (u64_t) a->value[i] * b;
+        dst->value[i] = (int) (c & RADIX_MASK);
+        c >>= RADIX_BITS;
+    }
+    for(; c > 0; i++)
+    {
+        dst->value[i] = (int) (c & RADIX_MASK);
+        c >>= RADIX_BITS;
+    }
+    mp_settle(dst, i);
+}
+
+unsigned int mp_divmod_ui(mp_ptr dst, mp_ptr a, unsigned int b)
+{
+    int i, len = a->len;
+    u64_t r = 0;
+    MP_COUNT_OP(MP_COUNT_DIVMOD_UI, len);
+    mp_grow(dst, len);
+    for(i = len - 1; i >= 0; i--)
+    {
+        r = (r << RADIX_BITS) | a->value[i];
+        dst->value[i] = (int) (r / b);
+        r %= b;
+    }
+    mp_settle(dst, len);
+    return (unsigned int) r;
+}
+
+unsigned int mp_mod_ui(mp_ptr a, unsigned int b)
+{
+    int i;
+    u64_t r = 0;
+    MP_COUNT_OP(MP_COUNT_MOD_UI, a->len);
+    for(i = a->len - 1; i >= 0; i--)
+        r = ((r << RADIX_BITS) | a->value[i]) % b;
+    return (unsigned int) r;
+}
+
 int mp_is_coprime(mp_ptr a, mp_ptr b) //finds if gcd(a, b) == 1
 {
     int ret = 0;
     int max_len = (a->max_len > b->max_len) ? a->max_len : b->max_len;
     mp_t q, w0, w1;
-    mp_init(q, max_len, 0); 
-    mp_init(w0, max_len, 0); mp_assign(w0, a);
-    mp_init(w1, max_len, 0); mp_assign(w1, b);
+    MP_COUNT_OP(MP_COUNT_COPRIME, 0);
+    if(b->len == 1) //after the first step, Euclid's algorithm runs on plain integers
+    {
+        unsigned int x = b->value[0], y = mp_mod_ui(a, b->value[0]), r;
+        while(y != 0) { r = x % y; x = y; y = r; }
+        return (x == 1) ? 1 : 0;
+    }
+    mp_init(q, max_len); 
+    mp_init(w0, max_len); mp_assign(w0, a);
+    mp_init(w1, max_len); mp_assign(w1, b);
     while(w1->len > 0 && !(w1->len == 1 && w1->value[0] == 1))
         { mp_divide(q, w0, w1); mp_swap(w0, w1); }
     if(w1->value[0] == 1) ret = 1;
@@ -317,33 +721,56 @@ int mp_is_coprime(mp_ptr a, mp_ptr b) //finds if gcd(a, b) == 1
     return ret;
 }
 
+void mp_gcd(mp_ptr dst, mp_ptr a, mp_ptr b)
+{
+    int max_len = (a->max_len > b->max_len) ? a->max_len : b->max_len;
+    mp_t q, w0, w1;
+    MP_COUNT_OP(MP_COUNT_GCD, 0);
+    mp_init(q, max_len);
+    mp_init(w0, max_len); mp_assign(w0, a);
+    mp_init(w1, max_len); mp_assign(w1, b);
+    while(w1->len > 0)
+        { mp_divide(q, w0, w1); mp_swap(w0, w1); }
+    mp_assign(dst, w0);
+    mp_free_n(3, q, w0, w1);
+}
+
 void mp_modexp(mp_ptr dst, mp_ptr x, mp_ptr e, mp_ptr n)
 {
     int i, m, b_len; int *b = NULL; 
+    MP_COUNT_OP(MP_COUNT_MODEXP, 0);
+    MP_PROFILE_BEGIN("mp_modexp");
+    if(n->len > 0 && mp_is_even(n) == 0) //odd modulus, use Montgomery reduction instead of division
+    {
+        mp_mont_t mont;
+        mp_mont_init(&mont, n);
+        mp_modexp_mont(dst, x, e, &mont);
+        mp_mont_free(&mont);
+        MP_PROFILE_END();
+        return;
+    }
     mp_t e_cpy, tmp1, tmp2;
-    mp_init(e_cpy, dst->max_len, 0); mp_assign(e_cpy, e);
-    mp_init(tmp1, dst->max_len, 0); 
-    mp_init(tmp2, dst->max_len, 0); mp_assign_s64(tmp2, 2);
+    mp_init(e_cpy, dst->max_len); mp_assign(e_cpy, e);
+    mp_init(tmp1, dst->max_len); 
+    mp_init(tmp2, dst->max_len);
 
     i = 0;
     //Allocate memory
-    b_len = (int) (log10((float) RADIX) / log10(2.0)) * dst->max_len + 10; //should be long enough!
+    b_len = RADIX_BITS * e->len + 1; //one entry per bit of e
     if((b = (int *)malloc(b_len*sizeof(int))) == NULL)
-        { printf("malloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
     while(e_cpy->len > 0) // fast way of checking that e > 0
     {
         if(mp_is_even(e_cpy) == 1) b[i] = 0; 
         else b[i] = 1;
-        mp_divide(tmp1, e_cpy, tmp2);
-        mp_assign(e_cpy, tmp1);
+        mp_divmod_ui(e_cpy, e_cpy, 2);
         i++;
     }
     m = i - 1;
     mp_assign_s64(dst, 1);
     for(i = m; i >= 0; i--)
     {
-        mp_assign(tmp1, dst);        
-        mp_multiply(tmp2, tmp1, dst);
+        mp_square(tmp2, dst);
         mp_mod(dst, tmp2, n);
         if(b[i]==1)
         {
@@ -354,65 +781,471 @@ void mp_modexp(mp_ptr dst, mp_ptr x, mp_ptr e, mp_ptr n)
     }
     mp_free_n(3, e_cpy, tmp1, tmp2);
     free(b);
+    MP_PROFILE_END();
 }
 
-int _J(mp_ptr a, mp_ptr n)
+void mp_mont_init(mp_mont_t *mont, mp_ptr n)
 {
-    if(a->len == 0) //fast way to check if a == 0
-        return 0;
-    else if(a->len == 1 && a->value[0] == 1) //fast way to check if a == 1
-        return 1;
-    else if(mp_is_even(a))
-    {
-        int sign, max_len;
-        mp_t tmp1, tmp2, tmp3;
-        max_len = (a->max_len > n->max_len) ? a->max_len : n->max_len;
-        mp_init(tmp1, max_len, 0); mp_assign(tmp1, n);
-        mp_init(tmp2, max_len, 0); mp_assign_s64(tmp2, 8);
-        mp_init(tmp3, max_len, 0); 
-        /* Find sign */
-        mp_multiply(tmp3, tmp1, n);
-        mp_increment(tmp3, -1);        
-        mp_divide(tmp1, tmp3, tmp2);
-        sign = (mp_is_even(tmp1) == 1) ? 1 : -1;
-        /* Find a/2 */
-        mp_assign_s64(tmp1, 2);
-        mp_assign(tmp2, a);
-        mp_divide(a, tmp2, tmp1);
-        mp_free_n(3, tmp1, tmp2, tmp3);
-        return _J(a, n)*sign;
+    int i, inv, len;
+    mp_t r;
+    len = mp_length(n);
+    //Newton iteration for 1/n mod RADIX, each step doubles the number of correct bits (n*n = 1 mod 8 for odd n)
+    inv = n->value[0];
+    for(i = 0; i < 3; i++)
+        inv = (inv * ((2 - n->value[0] * inv) & RADIX_MASK)) & RADIX_MASK;
+    //R^2 mod n, by dividing RADIX^(2*len) by n once
+    mp_init(r, 2*len + 1);
+    r->value[2*len] = 1;
+    r->len = 2*len + 1;
+    mp_init(mont->rr, len);
+    mp_mod(mont->rr, r, n);
+    mp_free(r);
+    mp_init(mont->n, len); mp_assign(mont->n, n);
+    mont->ninv = (RADIX - inv) & RADIX_MASK;
+    mont->len = len;
+    mont_init_words(mont);
+}
+
+//Sets up the context from values stored with a key, skipping the division for R^2 mod n
+void mp_mont_init_precomputed(mp_mont_t *mont, mp_ptr n, mp_ptr rr, int ninv)
+{
+    mont->len = mp_length(n);
+    mp_init(mont->n, mont->len); mp_assign(mont->n, n);
+    mp_init(mont->rr, mont->len); mp_assign(mont->rr, rr);
+    mont->ninv = ninv;
+    mont_init_words(mont);
+}
+
+void mp_mont_free(mp_mont_t *mont)
+{
+    mp_free_n(2, mont->n, mont->rr);
+    free(mont->wn);
+}
+
+//Packs len 14 bit limbs into wlen 64 bit words. The number must fit in wlen words
+void limbs_to_words(u64_t *w, int wlen, int *v, int len)
+{
+    int i, bit;
+    for(i = 0; i < wlen; i++) w[i] = 0;
+    for(i = 0; i < len; i++)
+    {
+        bit = i*RADIX_BITS;
+        w[bit / 64] |= (u64_t) v[i] << (bit % 64);
+        if(bit % 64 > 64 - RADIX_BITS) //limb straddles two words
+            w[bit / 64 + 1] |= (u64_t) v[i] >> (64 - bit % 64);
+    }
+}
+
+void words_to_limbs(int *v, int len, u64_t *w, int wlen)
+{
+    int i, bit;
+    u64_t x;
+    for(i = 0; i < len; i++)
+    {
+        bit = i*RADIX_BITS;
+        x = (bit / 64 < wlen) ? w[bit / 64] >> (bit % 64) : 0;
+        if(bit % 64 > 64 - RADIX_BITS && bit / 64 + 1 < wlen)
+            x |= w[bit / 64 + 1] << (64 - bit % 64);
+        v[i] = (int) (x & RADIX_MASK);
+    }
+}
+
+//Sets up the 64 bit word form of the context. n is packed into as few words as hold it, so a 2048 bit key gets
+//32 words and the fixed width code in mp_fixed.c can be used. R and W are both powers of two, so W^2 mod n comes
+//from R^2 mod n by halving (adding n first when odd) or doubling (subtracting n when it overflows) it mod n
+void mont_init_words(mp_mont_t *mont)
+{
+    #ifdef MP_WORD64
+    int i, j, bits, wlen, shift;
+    u64_t inv, n0, over, borrow, *u = NULL;
+    unsigned __int128 c;
+    for(bits = mont->len*RADIX_BITS; bits > 0 && ((mont->n->value[(bits - 1) / RADIX_BITS] >> ((bits - 1) % RADIX_BITS)) & 1) == 0; bits--);
+    wlen = (bits + 63) / 64;
+    shift = 2*(64*wlen - mont->len*RADIX_BITS); //W^2 = R^2*2^shift
+    if((mont->wn = (u64_t *)malloc(3*wlen*sizeof(u64_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    mont->wrr = mont->wn + wlen; u = mont->wrr + wlen;
+    mont->wlen = wlen;
+    limbs_to_words(mont->wn, wlen, mont->n->value, mont->len);
+    limbs_to_words(mont->wrr, wlen, mont->rr->value, mont->rr->len);
+    for(i = 0; i < -shift; i++) //halve
+    {
+        c = 0;
+        if(mont->wrr[0] & 1)
+            for(j = 0; j < wlen; j++)
+            {
+                c += (unsigned __int128) mont->wrr[j] + mont->wn[j];
+                mont->wrr[j] = (u64_t) c;
+                c >>= 64;
+            }
+        for(j = 0; j < wlen - 1; j++)
+            mont->wrr[j] = (mont->wrr[j] >> 1) | (mont->wrr[j + 1] << 63);
+        mont->wrr[wlen - 1] = (mont->wrr[wlen - 1] >> 1) | ((u64_t) c << 63);
+    }
+    for(i = 0; i < shift; i++) //double
+    {
+        over = mont->wrr[wlen - 1] >> 63;
+        for(j = wlen - 1; j > 0; j--)
+            mont->wrr[j] = (mont->wrr[j] << 1) | (mont->wrr[j - 1] >> 63);
+        mont->wrr[0] <<= 1;
+        for(j = 0, borrow = 0; j < wlen; j++)
+        {
+            c = (unsigned __int128) mont->wrr[j] - mont->wn[j] - borrow;
+            u[j] = (u64_t) c;
+            borrow = (u64_t) (c >> 64) & 1;
+        }
+        if(over == 1 || borrow == 0)
+            for(j = 0; j < wlen; j++) mont->wrr[j] = u[j];
+    }
+    //Newton iteration for 1/n mod 2^64, 3 correct bits to start with and doubling each step
+    n0 = mont->wn[0]; inv = n0;
+    for(i = 0; i < 5; i++)
+        inv *= 2 - n0*inv;
+    mont->wninv = -inv;
+    #else
+    mont->wn = mont->wrr = NULL;
+    mont->wninv = 0;
+    mont->wlen = 0;
+    #endif
+    mp_fixed_select(mont);
+}
+
+//Montgomery multiplication, t = a*b/R mod n. Requires a*b < R*n, i.e. a < R and b < n. The product is
+//accumulated in 64 bits, reduced one limb at a time, and carries are only resolved at the end.
+//t needs len + 1 limbs, acc needs 2*len + 2 elements of scratch space
+void mont_multiply(int *t, int *a, int a_len, int *b, int b_len, mp_mont_t *mont, u64_t *acc)
+{
+    int i, m, len = mont->len, *u;
+    int *n = mont->n->value;
+    u64_t c;
+    for(i = 0; i < 2*len + 2; i++) acc[i] = 0;
+    for(i = 0; i < a_len; i++)
+        mp_kernel.mac_row(acc + i, a[i], b, b_len);
+    //Add m*n so the lowest limb becomes zero, one limb at a time
+    for(i = 0; i < len; i++)
+    {
+        m = ((int) (acc[i] & RADIX_MASK) * mont->ninv) & RADIX_MASK;
+        mp_kernel.redc_row(acc + i, m, n, len);
+    }
+    for(i = 0, c = 0; i <= len; i++)
+    {
+        c += acc[len + i];
+        t[i] = (int) (c & RADIX_MASK);
+        c >>= RADIX_BITS;
+    }
+    //Result is < 2n, subtract n once if needed. The scratch space is free to hold t - n
+    u = (int *) acc;
+    u[len] = t[len] - mp_kernel.sub_row(u, t, n, len);
+    if(u[len] >= 0)
+        for(i = 0; i <= len; i++) t[i] = u[i];
+}
+
+void mp_mont_multiply(mp_ptr dst, mp_ptr a, mp_ptr b, mp_mont_t *mont)
+{
+    int i, *t = NULL;
+    u64_t *acc = NULL;
+    MP_COUNT_OP(MP_COUNT_MONT_MULTIPLY, 2*(u64_t)mont->len*mont->len);
+    if((t = (int *)malloc((mont->len + 2)*sizeof(int))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    if((acc = (u64_t *)malloc((2*mont->len + 2)*sizeof(u64_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    mont_multiply(t, a->value, a->len, b->value, b->len, mont, acc);
+    mp_grow(dst, mont->len);
+    for(i = 0; i < mont->len; i++)
+        dst->value[i] = t[i];
+    mp_settle(dst, mont->len);
+    free(t); free(acc);
+}
+
+//Montgomery multiplication on 64 bit words, t = a*b/W mod n. Requires a < W and b < n. The full product goes
+//into acc first, then is reduced one word at a time. t needs wlen words, acc needs 2*wlen + 1
+void mont_multiply_word(u64_t *t, u64_t *a, u64_t *b, mp_mont_t *mont, u64_t *acc)
+{
+    int i, j, len = mont->wlen;
+    u64_t m, c, *n = mont->wn;
+    for(i = 0; i < 2*len + 1; i++) acc[i] = 0;
+    for(i = 0; i < len; i++)
+        acc[i + len] = mp_word_kernel.addmul_row(acc + i, a[i], b, len);
+    for(i = 0; i < len; i++)
+    {
+        m = acc[i] * mont->wninv;
+        c = mp_word_kernel.addmul_row(acc + i, m, n, len);
+        for(j = i + len; c != 0; j++) //carry the word out upwards
+        {
+            acc[j] += c;
+            c = (acc[j] < c) ? 1 : 0;
+        }
+    }
+    //Result is < 2n, subtract n once if needed
+    if(mp_word_kernel.sub_row(t, acc + len, n, len) == 1 && acc[2*len] == 0)
+        for(i = 0; i < len; i++) t[i] = acc[len + i];
+}
+
+//mp_modexp_mont on 64 bit words. x is packed into words, exponentiated with the fixed width code if there is a
+//variant for the length of n or else the word kernels, and unpacked again
+void modexp_word(mp_ptr dst, mp_ptr x, mp_ptr e, mp_mont_t *mont)
+{
+    int i, j, bit, len = mont->len, wlen = mont->wlen;
+    u64_t *buffer = NULL, *t, *acc, *xm, *one, *scratch;
+    mp_t x_red;
+    if((buffer = (u64_t *)malloc((6*wlen + 1)*sizeof(u64_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    t = buffer; acc = t + wlen; xm = acc + wlen; one = xm + wlen; scratch = one + wlen;
+    //Convert x into Montgomery form, x*W mod n. x only has to be < W, not < n
+    for(i = x->len*RADIX_BITS; i > 0 && ((x->value[(i - 1) / RADIX_BITS] >> ((i - 1) % RADIX_BITS)) & 1) == 0; i--);
+    if(i > 64*wlen)
+    {
+        mp_init(x_red, len); mp_mod(x_red, x, mont->n);
+        limbs_to_words(t, wlen, x_red->value, x_red->len);
+        mp_free(x_red);
+    }
+    else
+        limbs_to_words(t, wlen, x->value, x->len);
+    for(i = 0; i < wlen; i++) one[i] = (i == 0) ? 1 : 0;
+    mont_multiply_word(xm, t, mont->wrr, mont, scratch);
+    //acc = 1 in Montgomery form, W mod n
+    mont_multiply_word(acc, one, mont->wrr, mont, scratch);
+    for(i = e->len*RADIX_BITS - 1; i >= 0 && ((e->value[i / RADIX_BITS] >> (i % RADIX_BITS)) & 1) == 0; i--); //skip leading zeros
+    for(; i >= 0; i--)
+    {
+        bit = (e->value[i / RADIX_BITS] >> (i % RADIX_BITS)) & 1;
+        if(mont->wsqr != NULL)
+            mont->wsqr(t, acc, mont, scratch);
+        else
+            mont_multiply_word(t, acc, acc, mont, scratch);
+        for(j = 0; j < wlen; j++) acc[j] = t[j];
+        if(bit == 1)
+        {
+            if(mont->wmul != NULL)
+                mont->wmul(t, acc, xm, mont, scratch);
+            else
+                mont_multiply_word(t, acc, xm, mont, scratch);
+            for(j = 0; j < wlen; j++) acc[j] = t[j];
+        }
+    }
+    //Convert out of Montgomery form
+    mont_multiply_word(t, acc, one, mont, scratch);
+    mp_grow(dst, len);
+    words_to_limbs(dst->value, len, t, wlen);
+    mp_settle(dst, len);
+    free(buffer);
+}
+
+//Same square and multiply schedule as mp_modexp, but every reduction is a Montgomery
+//multiplication, and the bits of e are read straight from its limbs. Runs on 64 bit words
+//when the word kernels are available
+void mp_modexp_mont(mp_ptr dst, mp_ptr x, mp_ptr e, mp_mont_t *mont)
+{
+    int i, j, bit, len = mont->len;
+    int *t = NULL, *acc = NULL, *xm = NULL, one = 1;
+    u64_t *scratch = NULL;
+    mp_t x_red;
+    MP_COUNT_OP(MP_COUNT_MODEXP_MONT, 2*(u64_t)e->len*RADIX_BITS*len*len);
+    MP_PROFILE_BEGIN("mp_modexp_mont");
+    if(mont->wn != NULL && mp_word_kernel.addmul_row != NULL)
+        { modexp_word(dst, x, e, mont); MP_PROFILE_END(); return; }
+    if((t = (int *)malloc(3*(len + 2)*sizeof(int))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    if((scratch = (u64_t *)malloc((2*len + 2)*sizeof(u64_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    acc = t + (len + 2); xm = acc + (len + 2);
+    //Convert x into Montgomery form, x*R mod n. x only has to be < R, not < n
+    if(x->len > len)
+    {
+        mp_init(x_red, len); mp_mod(x_red, x, mont->n);
+        mont_multiply(t, x_red->value, x_red->len, mont->rr->value, mont->rr->len, mont, scratch);
+        mp_free(x_red);
     }
     else
+        mont_multiply(t, x->value, x->len, mont->rr->value, mont->rr->len, mont, scratch);
+    for(i = 0; i < len; i++) xm[i] = t[i];
+    //acc = 1 in Montgomery form, R mod n
+    mont_multiply(t, &one, 1, mont->rr->value, mont->rr->len, mont, scratch);
+    for(i = 0; i < len; i++) acc[i] = t[i];
+    for(i = e->len*RADIX_BITS - 1; i >= 0 && ((e->value[i / RADIX_BITS] >> (i % RADIX_BITS)) & 1) == 0; i--); //skip leading zeros
+    for(; i >= 0; i--)
+    {
+        bit = (e->value[i / RADIX_BITS] >> (i % RADIX_BITS)) & 1;
+        mont_multiply(t, acc, len, acc, len, mont, scratch);
+        for(j = 0; j < len; j++) acc[j] = t[j];
+        if(bit == 1)
+        {
+            mont_multiply(t, acc, len, xm, len, mont, scratch);
+            for(j = 0; j < len; j++) acc[j] = t[j];
+        }
+    }
+    //Convert out of Montgomery form
+    mont_multiply(t, acc, len, &one, 1, mont, scratch);
+    mp_grow(dst, len);
+    for(i = 0; i < len; i++)
+        dst->value[i] = t[i];
+    mp_settle(dst, len);
+    free(t); free(scratch);
+    MP_PROFILE_END();
+}
+
+//Batched version of mp_modexp_mont. Every number shares the exponent and modulus, so they all follow
+//the same square and multiply schedule in lockstep through the mont_batch kernel. A 64 bit word does
+//the work of more than four limbs, so when the word kernels are available each number goes through
+//them on its own instead
+void mp_modexp_batch(mp_ptr *dst, mp_ptr *x, int count, mp_ptr e, mp_mont_t *mont)
+{
+    int i, j, k, bit, len = mont->len, size = (len + 2)*count;
+    int *buffer = NULL, *t, *acc, *xm, *rr, *scratch;
+    mp_t x_red;
+    MP_COUNT_OPS(MP_COUNT_MODEXP_MONT, count, 2*(u64_t)count*e->len*RADIX_BITS*len*len);
+    if(mont->wn != NULL && mp_word_kernel.addmul_row != NULL)
+    {
+        for(k = 0; k < count; k++) //each block timed on its own, for the latency histogram
+        {
+            MP_PROFILE_BEGIN("mp_modexp_batch block");
+            modexp_word(dst[k], x[k], e, mont);
+            MP_PROFILE_END();
+        }
+        return;
+    }
+    MP_PROFILE_BEGIN("mp_modexp_batch");
+    if((buffer = (int *)malloc((4*size + (2*len + 1)*MONT_SLAB)*sizeof(int))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    t = buffer; acc = t + size; xm = acc + size; rr = xm + size; scratch = rr + size;
+    //Slice the numbers and R^2 mod n into limb-major order. x only has to be < R, not < n
+    mp_init(x_red, len);
+    for(k = 0; k < count; k++)
+    {
+        mp_ptr xk = x[k];
+        if(xk->len > len) { mp_mod(x_red, xk, mont->n); xk = x_red; }
+        for(i = 0; i < len; i++)
+        {
+            acc[i*count + k] = (i < xk->len) ? xk->value[i] : 0;
+            rr[i*count + k] = (i < mont->rr->len) ? mont->rr->value[i] : 0;
+        }
+    }
+    mp_free(x_red);
+    //Convert into Montgomery form, xm = x*R mod n
+    mp_kernel.mont_batch(xm, acc, rr, count, mont, scratch);
+    //acc = 1 in Montgomery form, R mod n
+    for(i = 0; i < len*count; i++) t[i] = (i < count) ? 1 : 0;
+    mp_kernel.mont_batch(acc, t, rr, count, mont, scratch);
+    for(i = e->len*RADIX_BITS - 1; i >= 0 && ((e->value[i / RADIX_BITS] >> (i % RADIX_BITS)) & 1) == 0; i--); //skip leading zeros
+    for(; i >= 0; i--)
+    {
+        bit = (e->value[i / RADIX_BITS] >> (i % RADIX_BITS)) & 1;
+        mp_kernel.mont_batch(t, acc, acc, count, mont, scratch);
+        for(j = 0; j < len*count; j++) acc[j] = t[j];
+        if(bit == 1)
+        {
+            mp_kernel.mont_batch(t, acc, xm, count, mont, scratch);
+            for(j = 0; j < len*count; j++) acc[j] = t[j];
+        }
+    }
+    //Convert out of Montgomery form, multiplying by 1
+    for(i = 0; i < len*count; i++) rr[i] = (i < count) ? 1 : 0;
+    mp_kernel.mont_batch(t, acc, rr, count, mont, scratch);
+    for(k = 0; k < count; k++)
     {
-        int sign, max_len;
-        mp_t tmp1, tmp2, tmp3;
-        max_len = (a->max_len > n->max_len) ? a->max_len : n->max_len;
-        mp_init(tmp1, max_len, 0); mp_assign(tmp1, a);
-        mp_init(tmp2, max_len, 0); mp_assign(tmp2, n);
-        mp_init(tmp3, max_len, 0); 
-        /* Find sign */
-        mp_increment(tmp1, -1);
-        mp_increment(tmp2, -1);
-        mp_multiply(tmp3, tmp1, tmp2);
-        mp_assign_s64(tmp2, 4);
-        mp_divide(tmp1, tmp3, tmp2);
-        sign = (mp_is_even(tmp1) == 1) ? 1 : -1;
-        /* Find n%a */
-        mp_assign(tmp1, a);
-        mp_assign(tmp2, n);
-        mp_mod(n, tmp2, tmp1);
-        mp_free_n(3, tmp1, tmp2, tmp3);
-        return _J(n, a)*sign;
+        mp_grow(dst[k], len);
+        for(i = 0; i < len; i++)
+            dst[k]->value[i] = t[i*count + k];
+        mp_settle(dst[k], len);
     }
+    free(buffer);
+    MP_PROFILE_END();
 }
 
+//Jacobi symbol (a/n) for odd n, by the binary algorithm. Factors of two are shifted out of a, then the smaller
+//of the two is taken from the larger, swapping them first if need be. Each step reads the residues mod 8 it needs
+//for the sign from the low limbs. The work is done on a scratch pair on the stack, so nothing is allocated
 int mp_J(mp_ptr a, mp_ptr n)
 {
-    mp_t a_cpy, n_cpy;
-    int result;
-    mp_init(a_cpy, a->max_len, 0); mp_assign(a_cpy, a);
-    mp_init(n_cpy, n->max_len, 0); mp_assign(n_cpy, n);
-    result = _J(a_cpy, n_cpy);
-    mp_free_n(2, a_cpy, n_cpy);
-    return result;
+    int i, k, q, s, x_len, y_len, t_len, b, sign = 1;
+    int len = ((a->len > n->len) ? a->len : n->len) + 1;
+    int x_buf[len], y_buf[len], *x = x_buf, *y = y_buf, *t;
+    MP_COUNT_OP(MP_COUNT_JACOBI, len);
+    for(i = 0; i < a->len; i++) x[i] = a->value[i];
+    for(i = 0; i < n->len; i++) y[i] = n->value[i];
+    x_len = a->len; y_len = n->len;
+    while(x_len > 0 && x[x_len-1] == 0) x_len--;
+    while(y_len > 0 && y[y_len-1] == 0) y_len--;
+    while(x_len > 0)
+    {
+        //Shift out the factors of two, an odd number of them flips the sign when n is 3 or 5 mod 8
+        for(k = 0; ((x[k / RADIX_BITS] >> (k % RADIX_BITS)) & 1) == 0; k++);
+        if(k > 0)
+        {
+            q = k / RADIX_BITS; s = k % RADIX_BITS;
+            for(i = 0; i + q < x_len; i++)
+                x[i] = ((x[i + q] >> s) | ((i + q + 1 < x_len) ? x[i + q + 1] << (RADIX_BITS - s) : 0)) & RADIX_MASK;
+            x_len -= q;
+            while(x_len > 0 && x[x_len-1] == 0) x_len--;
+            if((k & 1) == 1 && ((y[0] & 7) == 3 || (y[0] & 7) == 5)) sign = -sign;
+        }
+        //Keep x the larger. Swapping flips the sign when both are 3 mod 4
+        for(i = (x_len > y_len) ? x_len-1 : y_len-1; i >= 0; i--)
+        {
+            b = ((i < x_len) ? x[i] : 0) - ((i < y_len) ? y[i] : 0);
+            if(b != 0) break;
+        }
+        if(i < 0) break; //x == y, so (a/n) = 0 unless both are 1
+        if(b < 0)
+        {
+            t = x; x = y; y = t;
+            t_len = x_len; x_len = y_len; y_len = t_len;
+            if((x[0] & 3) == 3 && (y[0] & 3) == 3) sign = -sign;
+        }
+        //Both are odd, so x - y is even and goes round again
+        b = mp_kernel.sub_row(x, x, y, y_len);
+        for(i = y_len; b != 0 && i < x_len; i++)
+        {
+            x[i] -= b;
+            b = (x[i] < 0) ? 1 : 0;
+            x[i] &= RADIX_MASK;
+        }
+        while(x_len > 0 && x[x_len-1] == 0) x_len--;
+    }
+    return (y_len == 1 && y[0] == 1) ? sign : 0;
+}
+
+const char *mp_tune_path(void)
+{
+    const char *path = getenv("RSA_TUNE");
+    return (path != NULL) ? path : MP_TUNE_FILE;
+}
+
+//The profile is a "name value" line per setting, and lines starting with '#' are comments. kernel and
+//word_kernel name kernel sets, everything else is one of mp_tunables. Unknown names, kernels this CPU does
+//not support and values below 1 are skipped, so the defaults stand in for them
+int mp_tune_load(const char *path)
+{
+    FILE *file;
+    char line[256], name[64], value[64];
+    int i, v;
+    if((file = fopen(path, "r")) == NULL)
+        return 0;
+    while(fgets(line, sizeof(line), file) != NULL)
+    {
+        if(line[0] == '#' || sscanf(line, "%63s %63s", name, value) != 2)
+            continue;
+        if(strcmp(name, "kernel") == 0 || strcmp(name, "word_kernel") == 0)
+            { mp_kernel_select(value); continue; }
+        for(i = 0; mp_tunables[i].name != NULL; i++)
+            if(strcmp(name, mp_tunables[i].name) == 0 && (v = atoi(value)) > 0)
+                *mp_tunables[i].value = v;
+    }
+    fclose(file);
+    return 1;
+}
+
+int mp_tune_save(const char *path)
+{
+    FILE *file;
+    int i;
+    if((file = fopen(path, "w")) == NULL)
+        return 0;
+    fprintf(file, "# Tuning profile written by rsa -tune, read at startup\n");
+    fprintf(file, "kernel %s\n", mp_kernel.name);
+    fprintf(file, "word_kernel %s\n", mp_word_kernel.name);
+    for(i = 0; mp_tunables[i].name != NULL; i++)
+        fprintf(file, "%s %d\n", mp_tunables[i].name, *mp_tunables[i].value);
+    fclose(file);
+    return 1;
 }
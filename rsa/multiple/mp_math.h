@@ -19,21 +19,141 @@
 #define MP_MATH_H
 
 #define RADIX            16384 //2^14, i.e pack two 7 bit chars into one RADIX number
+#define RADIX_BITS       14 //log2(RADIX)
+#define RADIX_MASK       (RADIX - 1)
 #define MAX_LEN_RADIX    5 //a 5 digit decimal number can represent any single RADIX number
+#define MP_SMALL_LEN     8 //numbers of up to this many limbs live inside mp_struct, without a heap allocation
+#define MP_ALIGN         64 //larger numbers get heap storage aligned to a cache line
+#define DIV_NEWTON_LEN   256 //default for mp_div_newton_len
+#define NTT_LEN          3584 //default for mp_ntt_len
+#define MP_TUNE_FILE     "rsa.tune" //tuning profile read at startup, unless RSA_TUNE names another
 
 typedef struct 
 {
-    int *value; //Dynamically allocated. Least significant val is stored in element[0]
+    int *value; //Points at small, or at aligned heap storage. Least significant val is stored in element[0]
     int max_len;
-    int len;
+    int len; //Every limb from len up to max_len is kept zero, so len only ever has to be brought down by mp_length
+    int small[MP_SMALL_LEN];
 } mp_struct;
 
 typedef mp_struct mp_t[1];
 typedef mp_struct *mp_ptr;
 typedef long long int s64_t;
+typedef unsigned long long int u64_t;
 
-void mp_init(mp_ptr n, int max_length, int zero);
-void mp_zero(mp_ptr n);
+#ifdef __SIZEOF_INT128__
+#define MP_WORD64 //the compiler has a 128 bit type, so Montgomery multiplication can also run on 64 bit words
+#endif
+
+typedef struct mp_mont_s
+{
+    mp_t n; //The modulus, must be odd
+    mp_t rr; //R^2 mod n, where R = RADIX^len
+    int ninv; //-1/n mod RADIX
+    int len; //Number of limbs in n
+    u64_t *wn; //n in 64 bit words, NULL when the word path is not compiled in
+    u64_t *wrr; //W^2 mod n in 64 bit words, where W = 2^(64*wlen)
+    u64_t wninv; //-1/n mod 2^64
+    int wlen; //Number of words in n
+    void (*wmul)(u64_t *t, u64_t *a, u64_t *b, struct mp_mont_s *mont, u64_t *scratch); //Fixed width t = a*b/W mod n, see mp_fixed.c. scratch needs 2*wlen words
+    void (*wsqr)(u64_t *t, u64_t *a, struct mp_mont_s *mont, u64_t *scratch); //Fixed width t = a*a/W mod n, both NULL if none fits n
+} mp_mont_t;
+
+extern int mp_div_newton_len; //divisors of at least this many limbs are divided by Newton reciprocal, see mp_divide
+extern int mp_ntt_len; //products with both operands at least this many limbs go through mp_ntt_multiply (MP_WORD64 only)
+
+//A threshold that can be set from the tuning profile, see mp_tune_load
+typedef struct
+{
+    const char *name;
+    int *value;
+} mp_tunable_t;
+
+extern mp_tunable_t mp_tunables[]; //ends with a NULL name
+
+#define MP_ERR_MEMORY       1 //an allocation failed
+#define MP_ERR_FILE         2 //a file could not be opened
+#define MP_ERR_KEY          3 //a key file is truncated, tampered with or of an unknown version
+#define MP_CLEANUPS         8 //cleanups a thread can have registered at once
+
+//Called wherever the code cannot carry on. The default prints the message and exits with the error as the status.
+//librsa sets its own, which takes its library call back out with an error code instead. A handler must not return
+extern void (*mp_fail_handler)(int error, const char *message);
+
+void mp_fail(int error, const char *format, ...); //runs the cleanups, formats the message and hands it to mp_fail_handler
+//Code that holds a file or memory across calls that can fail registers a cleanup for it, which mp_fail runs before
+//the handler, newest first. Pop it again, without running it, once the resource is handed on or released
+void mp_cleanup_push(void (*cleanup)(void *), void *arg);
+void mp_cleanup_pop(void);
+
+//Op counting, compiled in with -DMP_COUNT (make count) and compiled out to nothing otherwise. Each primitive counts
+//its calls and an estimate of the limb products it does, under the phase the calling thread is in. Primitives built
+//on others count those too, e.g. mp_mod also counts an mp_divide. The allocations count bytes instead
+#define MP_COUNT_ADD            0
+#define MP_COUNT_SUBTRACT       1
+#define MP_COUNT_MULTIPLY       2
+#define MP_COUNT_SQUARE         3
+#define MP_COUNT_DIVIDE         4
+#define MP_COUNT_MOD            5
+#define MP_COUNT_MUL_UI         6
+#define MP_COUNT_DIVMOD_UI      7
+#define MP_COUNT_MOD_UI         8
+#define MP_COUNT_COPRIME        9
+#define MP_COUNT_GCD            10
+#define MP_COUNT_MODEXP         11
+#define MP_COUNT_MONT_MULTIPLY  12
+#define MP_COUNT_MODEXP_MONT    13 //mp_modexp_mont and each number of mp_modexp_batch
+#define MP_COUNT_JACOBI         14
+#define MP_COUNT_INIT_ALLOC     15 //mp_init of a number too large for its small storage
+#define MP_COUNT_GROW_ALLOC     16 //mp_grow past the small storage
+#define MP_COUNTS               17
+#define MP_PHASE_OTHER          0 //key loading, tuning and anything else outside the phases below
+#define MP_PHASE_KEYGEN         1
+#define MP_PHASE_ENCRYPT        2
+#define MP_PHASE_DECRYPT        3
+#define MP_PHASES               4
+
+#ifdef MP_COUNT
+#include <stdio.h>
+
+typedef struct
+{
+    u64_t calls;
+    u64_t work; //limb products, or bytes for the allocations
+} mp_count_t;
+
+extern mp_count_t mp_counts[MP_PHASES][MP_COUNTS];
+extern __thread int mp_count_phase;
+
+//Relaxed atomics, as the server, batch and container code call the primitives from several threads
+#define MP_COUNT_OPS(op, n, amount) do { \
+        __atomic_fetch_add(&mp_counts[mp_count_phase][op].calls, (u64_t)(n), __ATOMIC_RELAXED); \
+        __atomic_fetch_add(&mp_counts[mp_count_phase][op].work, (u64_t)(amount), __ATOMIC_RELAXED); \
+    } while(0)
+#define MP_PHASE_BEGIN(phase)   int mp_phase_saved = mp_count_phase; mp_count_phase = (phase)
+#define MP_PHASE_END()          (mp_count_phase = mp_phase_saved)
+
+void mp_count_dump(FILE *out, int json);
+void mp_count_report(void); //for atexit, dumps to stderr, as JSON if $RSA_COUNT is json
+#else
+#define MP_COUNT_OPS(op, n, amount)     ((void) 0)
+#define MP_PHASE_BEGIN(phase)           ((void) 0)
+#define MP_PHASE_END()                  ((void) 0)
+#endif
+#define MP_COUNT_OP(op, amount) MP_COUNT_OPS(op, 1, amount)
+
+//Named profiler scopes around the exponentiations, see profile.h. Off unless built with make profile
+#ifdef MP_PROFILE
+#include "profile.h"
+#define MP_PROFILE_BEGIN(name)  profile_scope_begin(name)
+#define MP_PROFILE_END()        profile_scope_end()
+#else
+#define MP_PROFILE_BEGIN(name)  ((void) 0)
+#define MP_PROFILE_END()        ((void) 0)
+#endif
+void mp_init(mp_ptr n, int max_length);
+void mp_zero(mp_ptr n); //only clears the limbs below len, the rest are already zero
+void mp_grow(mp_ptr n, int max_length); //makes room for max_length limbs, keeping the value
 void mp_free(mp_ptr n);
 void mp_free_n(int num, ...);
 void mp_swap(mp_ptr a, mp_ptr b);
@@ -49,11 +169,26 @@ int mp_length(mp_ptr n);
 int mp_compare(mp_ptr a, mp_ptr b);
 void mp_increment(mp_ptr n, int increment); //has bugs when going from < 0 to > 0
 void mp_add(mp_ptr dst, mp_ptr a, mp_ptr b);
+void mp_subtract(mp_ptr dst, mp_ptr a, mp_ptr b); //NOTE: assumes a >= b
 void mp_multiply(mp_ptr dst, mp_ptr a, mp_ptr b);
+void mp_square(mp_ptr dst, mp_ptr a); //dst = a*a, about half the work of mp_multiply
 void mp_divide(mp_ptr dst, mp_ptr a, mp_ptr b); //NOTE: a is changed to the remainder! // dst = a / b, remainder is put in a
 void mp_mod(mp_ptr dst, mp_ptr a, mp_ptr b);
+void mp_mul_ui(mp_ptr dst, mp_ptr a, unsigned int b); //dst = a*b, dst can be a
+unsigned int mp_divmod_ui(mp_ptr dst, mp_ptr a, unsigned int b); //dst = a / b, returns a mod b. Unlike mp_divide, a is left alone
+unsigned int mp_mod_ui(mp_ptr a, unsigned int b); //returns a mod b
 int mp_is_coprime(mp_ptr a, mp_ptr b); //finds if gcd(a, b) = 1
+void mp_gcd(mp_ptr dst, mp_ptr a, mp_ptr b); //dst = gcd(a, b)
 void mp_modexp(mp_ptr dst, mp_ptr x, mp_ptr e, mp_ptr n);
+void mp_mont_init(mp_mont_t *mont, mp_ptr n); //n must be odd
+void mp_mont_init_precomputed(mp_mont_t *mont, mp_ptr n, mp_ptr rr, int ninv);
+void mp_mont_free(mp_mont_t *mont);
+void mp_mont_multiply(mp_ptr dst, mp_ptr a, mp_ptr b, mp_mont_t *mont); //dst = a*b/R mod n
+void mp_modexp_mont(mp_ptr dst, mp_ptr x, mp_ptr e, mp_mont_t *mont);
+void mp_modexp_batch(mp_ptr *dst, mp_ptr *x, int count, mp_ptr e, mp_mont_t *mont); //dst[k] = x[k]^e mod n for count numbers at once
 int mp_J(mp_ptr a, mp_ptr n);
+const char *mp_tune_path(void);
+int mp_tune_load(const char *path); //returns 0 if there is no profile, in which case the defaults stay
+int mp_tune_save(const char *path); //returns 0 if the profile could not be written
 
 #endif
@@ -0,0 +1,150 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "mp_math.h"
+#include "mp_ntt.h"
+
+#ifdef MP_WORD64
+#define NTT_P           0xFFFFFFFF00000001ULL //2^64 - 2^32 + 1
+#define NTT_EPSILON     0xFFFFFFFFULL //2^64 mod p
+#define NTT_GENERATOR   7 //generates the multiplicative group mod p
+
+//Internal function prototypes
+u64_t ntt_power(u64_t x, u64_t e);
+void ntt_roots(u64_t *roots, int n, u64_t w);
+void ntt_forward(u64_t *a, int n, u64_t *roots);
+void ntt_inverse(u64_t *a, int n, u64_t *roots);
+
+//Internal functions
+static inline u64_t ntt_add(u64_t a, u64_t b)
+{
+    u64_t s = a + b;
+    if(s < a || s >= NTT_P) s -= NTT_P;
+    return s;
+}
+
+static inline u64_t ntt_sub(u64_t a, u64_t b)
+{
+    return (a >= b) ? a - b : a - b + NTT_P;
+}
+
+//x*y mod p. With x*y = hi*2^64 + lo and 2^64 = 2^32 - 1, 2^96 = -1 mod p, the top 32 bits of hi are subtracted
+//from lo and the bottom 32 bits of hi times 2^32 - 1 are added, wrapping round by 2^32 - 1 whenever a step does
+static inline u64_t ntt_mul(u64_t x, u64_t y)
+{
+    unsigned __int128 z = (unsigned __int128) x * y;
+    u64_t lo = (u64_t) z, hi = (u64_t) (z >> 64), hh = hi >> 32, hl = hi & NTT_EPSILON, t, u;
+    t = lo - hh;
+    if(lo < hh) t -= NTT_EPSILON;
+    u = hl * NTT_EPSILON;
+    t += u;
+    if(t < u) t += NTT_EPSILON;
+    return (t >= NTT_P) ? t - NTT_P : t;
+}
+
+u64_t ntt_power(u64_t x, u64_t e)
+{
+    u64_t r = 1;
+    for(; e > 0; e >>= 1, x = ntt_mul(x, x))
+        if(e & 1) r = ntt_mul(r, x);
+    return r;
+}
+
+//roots[j] = w^j for j < n/2
+void ntt_roots(u64_t *roots, int n, u64_t w)
+{
+    int j;
+    roots[0] = 1;
+    for(j = 1; j < n/2; j++) roots[j] = ntt_mul(roots[j - 1], w);
+}
+
+//Decimation in frequency, natural order in and bit reversed order out
+void ntt_forward(u64_t *a, int n, u64_t *roots)
+{
+    int i, j, len, half, step;
+    u64_t u, v;
+    for(len = n; len >= 2; len >>= 1)
+    {
+        half = len/2; step = n/len;
+        for(i = 0; i < n; i += len)
+            for(j = 0; j < half; j++)
+            {
+                u = a[i + j]; v = a[i + j + half];
+                a[i + j] = ntt_add(u, v);
+                a[i + j + half] = ntt_mul(ntt_sub(u, v), roots[j*step]);
+            }
+    }
+}
+
+//Decimation in time, bit reversed order in and natural order out. With the inverse roots this undoes
+//ntt_forward, apart from a factor of n
+void ntt_inverse(u64_t *a, int n, u64_t *roots)
+{
+    int i, j, len, half, step;
+    u64_t u, v;
+    for(len = 2; len <= n; len <<= 1)
+    {
+        half = len/2; step = n/len;
+        for(i = 0; i < n; i += len)
+            for(j = 0; j < half; j++)
+            {
+                u = a[i + j]; v = ntt_mul(a[i + j + half], roots[j*step]);
+                a[i + j] = ntt_add(u, v);
+                a[i + j + half] = ntt_sub(u, v);
+            }
+    }
+}
+
+//External functions
+//The transforms are zero padded out to a power of two of at least a_len + b_len points. A square only needs
+//the one forward transform
+void mp_ntt_multiply(int *dst, int *a, int a_len, int *b, int b_len)
+{
+    int i, n, len = a_len + b_len, square = (a == b && a_len == b_len);
+    u64_t w, n_inv, c, *buffer = NULL, *fa, *fb, *roots, *iroots;
+    for(n = 2; n < len; n <<= 1);
+    if((buffer = (u64_t *)malloc(3*n*sizeof(u64_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    fa = buffer; fb = fa + n; roots = fb + n; iroots = roots + n/2;
+    w = ntt_power(NTT_GENERATOR, (NTT_P - 1) / n); //a primitive n-th root of unity
+    ntt_roots(roots, n, w);
+    ntt_roots(iroots, n, ntt_power(w, NTT_P - 2));
+    for(i = 0; i < n; i++) fa[i] = (i < a_len) ? (u64_t) a[i] : 0;
+    ntt_forward(fa, n, roots);
+    if(square)
+        fb = fa;
+    else
+    {
+        for(i = 0; i < n; i++) fb[i] = (i < b_len) ? (u64_t) b[i] : 0;
+        ntt_forward(fb, n, roots);
+    }
+    for(i = 0; i < n; i++) fa[i] = ntt_mul(fa[i], fb[i]);
+    ntt_inverse(fa, n, iroots);
+    //Each coefficient is now n times a column sum, which is below p, so carrying it up gives the product
+    n_inv = ntt_power(n, NTT_P - 2);
+    for(i = 0, c = 0; i < len; i++)
+    {
+        c += ntt_mul(fa[i], n_inv);
+        dst[i] = (int) (c & RADIX_MASK);
+        c >>= RADIX_BITS;
+    }
+    free(buffer);
+}
+#endif
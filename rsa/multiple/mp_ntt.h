@@ -0,0 +1,28 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP_NTT_H
+#define MP_NTT_H
+
+#include "mp_math.h"
+
+//Multiplication by number theoretic transform, for operands of thousands of limbs. The limbs are used as they are
+//as coefficients mod the prime p = 2^64 - 2^32 + 1, which holds every column sum of a product of up to 2^35 limbs
+//and has roots of unity for transforms of up to 2^32 points. Needs the 128 bit type, so only exists with MP_WORD64
+void mp_ntt_multiply(int *dst, int *a, int a_len, int *b, int b_len); //dst = a*b, dst needs a_len + b_len limbs and can be a or b
+
+#endif
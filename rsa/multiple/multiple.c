@@ -20,35 +20,46 @@
 #include <string.h>
 #include <time.h>
 #include <math.h> 
+#include <unistd.h>
 #include "multiple.h"
 
 #define MAX_CHAR            128 //7 bit representation
-#define LENGTH_DECIMAL      50 //i.e. a decimal number with 50 digits
-#define LENGTH              ((LENGTH_DECIMAL / ((int) log10((float) RADIX))))
+
+unsigned int small_primes[] = {3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67,
+    71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131, 137, 139, 149, 151, 157,
+    163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223, 227, 229, 233, 239, 241, 251}; //odd primes below 256, for trial division
 
 //Internal function prototypes
-void random_number(mp_ptr dst, int max_len, int seed);
+int random_seed(void);
+void random_number(mp_ptr dst, int max_len, unsigned int *state);
+int has_small_factor(mp_ptr n);
 void char2num(mp_ptr dst, char *string, int *index, int max_index, int numChar);
 void num2char(mp_ptr n, char *string, int *index, int numChar);
+void rsa_transform(multiple_rsa_t *rsa, int private, mp_ptr *dst, mp_ptr *x, int count);
+char *encrypt_blocks(multiple_rsa_t *rsa, int private, char *message, int length_in, int *length_out);
+char *decrypt_blocks(multiple_rsa_t *rsa, int private, char *ciphertext, int length_in, int *length_out);
 
 //External functions
-void multiple_generate_keys(multiple_rsa_t *rsa)
+void multiple_generate_keys(multiple_rsa_t *rsa, int bits)
 {
-    mp_t phi, tmp1, tmp2, i;
-    //Generate prime numbers p and q. They must be different!
-    mp_init(rsa->p, LENGTH, 0); random_prime(rsa->p, (int)time(NULL), 100);
-    mp_init(rsa->q, LENGTH, 0); random_prime(rsa->q, rand() % rsa->p->value[0], 100);
+    mp_t phi, tmp1, tmp2;
+    unsigned int k;
+    int length = (bits/2 + RADIX_BITS - 1) / RADIX_BITS + 1; //limbs per prime, plus one spare for the search to step into
+    MP_PHASE_BEGIN(MP_PHASE_KEYGEN);
+    //Generate prime numbers p and q, each half the bits of n. They must be different!
+    mp_init(rsa->p, length); random_prime(rsa->p, bits/2, random_seed(), 100);
+    mp_init(rsa->q, length); random_prime(rsa->q, bits - bits/2, random_seed(), 100);
     while(mp_compare(rsa->q, rsa->p) == 0)
-        random_prime(rsa->q, rand() % 100, 100);
+        random_prime(rsa->q, bits - bits/2, random_seed(), 100);
 
     //Calculate the modulus, n
-    mp_init(rsa->n, 2*LENGTH, 0); 
+    mp_init(rsa->n, 2*length); 
     mp_multiply(rsa->n, rsa->p, rsa->q);
 
     rsa->numChar = 2*(rsa->n->len - 1);
 
     //Find the totients of product
-    mp_init(phi, 2*LENGTH, 0);
+    mp_init(phi, 2*length);
     mp_increment(rsa->p, -1);
     mp_increment(rsa->q, -1);
     mp_multiply(phi, rsa->p, rsa->q);
@@ -56,88 +67,262 @@ void multiple_generate_keys(multiple_rsa_t *rsa)
     mp_increment(rsa->q, 1); //Restore original prime
 
     //Find exponent e, which is part of the public key
-    mp_init(tmp1, 2*LENGTH, 0);
+    mp_init(tmp1, 2*length);
     mp_assign_s64(tmp1, 15); //Some initial value
     while(mp_is_coprime(phi, tmp1) != 1)
         mp_increment(tmp1, 2);
-    mp_init(rsa->e, tmp1->len, 0); mp_assign(rsa->e, tmp1);
+    mp_init(rsa->e, tmp1->len); mp_assign(rsa->e, tmp1);
 
-    //Find exponent d, which is part of the private key
-    mp_init(i, 2*LENGTH, 0);
-    mp_init(tmp2, 2*LENGTH, 0);
-    mp_assign_s64(i, 0);
+    //Find exponent d, which is part of the private key, as (k*phi + 1)/e for the first k that divides evenly.
+    //phi cannot share a factor with every odd number below RADIX, so e is a single limb
+    mp_init(tmp2, 2*length);
+    k = 0;
     do
     {        
-        mp_increment(i, 1);
-        mp_multiply(tmp1, i, phi);
+        k++;
+        mp_mul_ui(tmp1, phi, k);
         mp_increment(tmp1, 1);        
-        mp_mod(tmp2, tmp1, rsa->e);
-    } while(tmp2->len > 0);    //fast way of checking if tmp2 != 0
-    mp_divide(tmp2, tmp1, rsa->e);
-    mp_init(rsa->d, tmp2->len, 0); 
+    } while(mp_mod_ui(tmp1, rsa->e->value[0]) != 0);
+    mp_divmod_ui(tmp2, tmp1, rsa->e->value[0]);
+    mp_init(rsa->d, tmp2->len); 
     mp_assign(rsa->d, tmp2);
 
-    mp_free_n(4, phi, tmp1, tmp2, i);
+    mp_free_n(3, phi, tmp1, tmp2);
+
+    multiple_precompute(rsa, 1);
+    MP_PHASE_END();
 }
 
-char *multiple_encrypt_message(multiple_rsa_t *rsa, char *message, int length_in, int *length_out)
+void multiple_empty(multiple_rsa_t *rsa)
 {
-    int index1, index2;
-    char *ciphertext = NULL;
-    //Allocate memory
-    if((ciphertext = (char *)malloc(2*length_in)) == NULL) //Not actually 2xlength_in, but needs to be bigger than length_in due to "rsa->numChar + 1" in num2char hack
-        { printf("malloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
-    rsa->numChar = 2*(rsa->n->len - 1);
-    index1 = 0; index2 = 0;
-    while(index1 < length_in) //encode terminating character as well??
+    mp_mont_t *monts[3] = {&rsa->mont_n, &rsa->mont_p, &rsa->mont_q};
+    int i;
+    mp_init(rsa->p, 1); mp_init(rsa->q, 1); mp_init(rsa->n, 1); mp_init(rsa->e, 1);
+    mp_init(rsa->d, 1); mp_init(rsa->dp, 1); mp_init(rsa->dq, 1); mp_init(rsa->qinv, 1);
+    for(i = 0; i < 3; i++)
     {
-        mp_t m, c; mp_init(m, rsa->n->max_len, 1); mp_init(c, rsa->n->max_len, 1);
-        //Turn characters into integer
-        char2num(m, message, &index1, length_in, rsa->numChar);
-        //Encrypt integer
-        mp_modexp(c, m, rsa->e, rsa->n);
-        //Convert integer to ciphertext
-        num2char(c, ciphertext, &index2, rsa->numChar + 1);
-        mp_free_n(2, m, c);
-    } 
-    *length_out = index2;
-    return ciphertext;
+        mp_init(monts[i]->n, 1); mp_init(monts[i]->rr, 1);
+        monts[i]->wn = NULL;
+    }
+    rsa->crt = 0;
 }
 
-char *multiple_decrypt_message(multiple_rsa_t *rsa, char *ciphertext, int length_in, int *length_out)
+void multiple_free(multiple_rsa_t *rsa)
 {
-    int index1, index2;
-    char *message = NULL;
-    //Allocate memory
-    if((message = (char *)malloc(length_in)) == NULL)
-        { printf("malloc failed: [%s, %d]\n", __FILE__, __LINE__); exit(0); }
+    mp_free_n(8, rsa->p, rsa->q, rsa->n, rsa->e, rsa->d, rsa->dp, rsa->dq, rsa->qinv);
+    mp_mont_free(&rsa->mont_n); mp_mont_free(&rsa->mont_p); mp_mont_free(&rsa->mont_q);
+    multiple_empty(rsa);
+}
+
+void multiple_cleanup(void *rsa)
+{
+    multiple_free((multiple_rsa_t *) rsa);
+}
+
+//Works out everything that only depends on the key, so it can be stored alongside it.
+//If crt is set, p, q and d must be valid
+void multiple_precompute(multiple_rsa_t *rsa, int crt)
+{
+    int top;
+    mp_t tmp;
+    mp_length(rsa->n);
     rsa->numChar = 2*(rsa->n->len - 1);
-    index1 = 0; index2 = 0;
-    while(index1 < length_in)
+    for(top = rsa->n->value[rsa->n->len-1], rsa->bits = (rsa->n->len-1)*RADIX_BITS; top > 0; top >>= 1)
+        rsa->bits++;
+    mp_mont_init(&rsa->mont_n, rsa->n);
+    rsa->crt = crt;
+    if(crt == 1)
     {
-        mp_t m, c; mp_init(m, rsa->n->max_len, 1); mp_init(c, rsa->n->max_len, 1);
-        //Turn characters into integer
-        char2num(c, ciphertext, &index1, length_in, rsa->numChar + 1);
-        //Decrypt integer        
-        mp_modexp(m, c, rsa->d, rsa->n);
-        //Convert integer to message
-        num2char(m, message, &index2, rsa->numChar);
-        mp_free_n(2, c, m);
-    };
-    *length_out = index2;
+        mp_init(tmp, rsa->n->max_len);
+        //dp = d mod (p-1), dq = d mod (q-1)
+        mp_assign(tmp, rsa->p); mp_increment(tmp, -1);
+        mp_init(rsa->dp, rsa->p->len); mp_mod(rsa->dp, rsa->d, tmp);
+        mp_assign(tmp, rsa->q); mp_increment(tmp, -1);
+        mp_init(rsa->dq, rsa->q->len); mp_mod(rsa->dq, rsa->d, tmp);
+        //qinv = q^(p-2) mod p, as p is prime
+        mp_mont_init(&rsa->mont_p, rsa->p);
+        mp_mont_init(&rsa->mont_q, rsa->q);
+        mp_assign(tmp, rsa->p); mp_increment(tmp, -2);
+        mp_init(rsa->qinv, rsa->p->len); mp_modexp_mont(rsa->qinv, rsa->q, tmp, &rsa->mont_p);
+        mp_free(tmp);
+    }
+}
+
+char *multiple_encrypt_message(multiple_rsa_t *rsa, char *message, int length_in, int *length_out)
+{
+    return encrypt_blocks(rsa, 0, message, length_in, length_out);
+}
+
+char *multiple_decrypt_message(multiple_rsa_t *rsa, char *ciphertext, int length_in, int *length_out)
+{
+    return decrypt_blocks(rsa, 1, ciphertext, length_in, length_out);
+}
+
+//Signs the message with the signer's private key, then encrypts the signature with the
+//recipient's public key. Same result as "-encrypt -key D" followed by "-encrypt -key E",
+//but the intermediate signature never leaves memory
+char *multiple_sign_encrypt_message(multiple_rsa_t *signer, multiple_rsa_t *recipient, char *message, int length_in, int *length_out)
+{
+    int length_sig;
+    char *signature, *ciphertext;
+    signature = encrypt_blocks(signer, 1, message, length_in, &length_sig);
+    ciphertext = encrypt_blocks(recipient, 0, signature, length_sig, length_out);
+    free(signature);
+    return ciphertext;
+}
+
+//Reverses multiple_sign_encrypt_message: decrypts with the recipient's private key, then
+//recovers the message from the signature with the signer's public key
+char *multiple_decrypt_verify_message(multiple_rsa_t *recipient, multiple_rsa_t *signer, char *ciphertext, int length_in, int *length_out)
+{
+    int length_sig;
+    char *signature, *message;
+    signature = decrypt_blocks(recipient, 1, ciphertext, length_in, &length_sig);
+    message = decrypt_blocks(signer, 0, signature, length_sig, length_out);
+    free(signature);
     return message;
 }
 
+//Block level access to the transform, for callers gathering the blocks of several messages into one batch.
+//A block holds numChar chars of a message, or numChar + 2 chars of a ciphertext
+int multiple_block_chars(multiple_rsa_t *rsa, int ciphertext)
+{
+    return (ciphertext == 1) ? rsa->numChar + 2 : rsa->numChar;
+}
+
+//Turns the next block of text, starting at *index, into a number
+void multiple_text2block(multiple_rsa_t *rsa, int ciphertext, mp_ptr dst, char *text, int *index, int length)
+{
+    char2num(dst, text, index, length, (ciphertext == 1) ? rsa->numChar + 1 : rsa->numChar);
+}
+
+//Writes a block out at *index, as ciphertext or as message chars
+void multiple_block2text(multiple_rsa_t *rsa, int ciphertext, mp_ptr n, char *text, int *index)
+{
+    num2char(n, text, index, (ciphertext == 1) ? rsa->numChar + 1 : rsa->numChar);
+}
+
+void multiple_transform(multiple_rsa_t *rsa, int private, mp_ptr *dst, mp_ptr *x, int count)
+{
+    rsa_transform(rsa, private, dst, x, count);
+}
+
+//Chars written by multiple_transform_text for length chars of text, not counting the terminating zero
+int multiple_text_size(multiple_rsa_t *rsa, int ciphertext, int length)
+{
+    int blocks = (length + multiple_block_chars(rsa, ciphertext) - 1) / multiple_block_chars(rsa, ciphertext);
+    return blocks*multiple_block_chars(rsa, !ciphertext);
+}
+
+//Transforms a message into a ciphertext, or a ciphertext into a message if ciphertext is set, a batch of blocks at
+//a time. out needs multiple_text_size + 1 chars, as it is terminated so a message can be written with file_writeln.
+//Returns the chars written
+int multiple_transform_text(multiple_rsa_t *rsa, int private, int ciphertext, char *text, int length, char *out)
+{
+    int index1 = 0, index2 = 0, k, count;
+    mp_t x[MULTIPLE_BATCH], y[MULTIPLE_BATCH];
+    mp_ptr x_ptr[MULTIPLE_BATCH], y_ptr[MULTIPLE_BATCH];
+    for(k = 0; k < MULTIPLE_BATCH; k++)
+    {
+        mp_init(x[k], rsa->n->max_len); x_ptr[k] = x[k];
+        mp_init(y[k], rsa->n->max_len); y_ptr[k] = y[k];
+    }
+    while(index1 < length)
+    {
+        //Turn characters into integers, a batch of blocks at a time
+        for(count = 0; count < MULTIPLE_BATCH && index1 < length; count++)
+            multiple_text2block(rsa, ciphertext, x[count], text, &index1, length);
+        rsa_transform(rsa, private, y_ptr, x_ptr, count);
+        //Convert integers back to characters
+        for(k = 0; k < count; k++)
+            multiple_block2text(rsa, !ciphertext, y[k], out, &index2);
+    }
+    for(k = 0; k < MULTIPLE_BATCH; k++)
+        mp_free_n(2, x[k], y[k]);
+    out[index2] = '\0';
+    return index2;
+}
+
 //Internal functions
-void random_number(mp_ptr dst, int max_len, int seed)
+//dst[k] = x[k]^d mod n if private is set, otherwise dst[k] = x[k]^e mod n, for up to MULTIPLE_BATCH blocks at once
+void rsa_transform(multiple_rsa_t *rsa, int private, mp_ptr *dst, mp_ptr *x, int count)
+{
+    int k;
+    MP_PHASE_BEGIN((private == 0) ? MP_PHASE_ENCRYPT : MP_PHASE_DECRYPT); //signing counts as decrypting, verifying as encrypting
+    if(private == 0)
+        mp_modexp_batch(dst, x, count, rsa->e, &rsa->mont_n);
+    else if(rsa->crt == 0)
+        mp_modexp_batch(dst, x, count, rsa->d, &rsa->mont_n);
+    else
+    {
+        //m1 = x^dp mod p, m2 = x^dq mod q, h = qinv*(m1 - m2) mod p, dst = m2 + h*q
+        mp_t m1[MULTIPLE_BATCH], m2[MULTIPLE_BATCH], h, tmp;
+        mp_ptr m1_ptr[MULTIPLE_BATCH], m2_ptr[MULTIPLE_BATCH];
+        for(k = 0; k < count; k++)
+        {
+            mp_init(m1[k], rsa->n->max_len); m1_ptr[k] = m1[k];
+            mp_init(m2[k], rsa->n->max_len); m2_ptr[k] = m2[k];
+        }
+        mp_init(h, rsa->n->max_len); mp_init(tmp, rsa->n->max_len + 1);
+        mp_modexp_batch(m1_ptr, x, count, rsa->dp, &rsa->mont_p);
+        mp_modexp_batch(m2_ptr, x, count, rsa->dq, &rsa->mont_q);
+        for(k = 0; k < count; k++)
+        {
+            mp_mod(tmp, m2[k], rsa->p);
+            if(mp_compare(m1[k], tmp) < 0) { mp_add(h, m1[k], rsa->p); mp_assign(m1[k], h); }
+            mp_subtract(h, m1[k], tmp);
+            mp_multiply(tmp, h, rsa->qinv);
+            mp_mod(h, tmp, rsa->p);
+            mp_multiply(tmp, h, rsa->q);
+            mp_add(dst[k], tmp, m2[k]);
+            mp_free_n(2, m1[k], m2[k]);
+        }
+        mp_free_n(2, h, tmp);
+    }
+    MP_PHASE_END();
+}
+
+char *encrypt_blocks(multiple_rsa_t *rsa, int private, char *message, int length_in, int *length_out)
+{
+    char *ciphertext = NULL;
+    //Each block of numChar chars becomes numChar + 2 chars due to "numChar + 1" in num2char hack
+    if((ciphertext = (char *)malloc(multiple_text_size(rsa, 0, length_in) + 1)) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    *length_out = multiple_transform_text(rsa, private, 0, message, length_in, ciphertext);
+    return ciphertext;
+}
+
+char *decrypt_blocks(multiple_rsa_t *rsa, int private, char *ciphertext, int length_in, int *length_out)
+{
+    char *message = NULL;
+    if((message = (char *)malloc(multiple_text_size(rsa, 1, length_in) + 1)) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    *length_out = multiple_transform_text(rsa, private, 1, ciphertext, length_in, message);
+    return message;
+}
+
+//Seed for the first prime of a key. time(NULL) alone gives the same key to every process generating in the same
+//second, so it is only the fallback when /dev/urandom cannot be read
+int random_seed(void)
+{
+    unsigned int seed;
+    FILE *urandom = fopen("/dev/urandom", "rb");
+    if(urandom == NULL || fread(&seed, sizeof(seed), 1, urandom) != 1)
+        seed = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16);
+    if(urandom != NULL) fclose(urandom);
+    return (int)(seed & 0x7fffffff);
+}
+
+//Random number of up to max_len limbs. The generator state is the caller's rather than that of rand(), so keys
+//can be generated on several threads at once
+void random_number(mp_ptr dst, int max_len, unsigned int *state)
 {
     int n;
-    srand(seed);
     mp_zero(dst);
     max_len = (dst->max_len < max_len) ? dst->max_len : max_len; //make sure dst->max_len > max_len
     while(dst->len < max_len)
     {
-        n = rand()%RADIX;
+        n = rand_r(state)%RADIX;
         while(n > 0 && dst->len < max_len) 
         {
             dst->value[dst->len++] = n % RADIX;
@@ -148,36 +333,52 @@ void random_number(mp_ptr dst, int max_len, int seed)
     if(dst->len == 0) dst->value[dst->len++] = 1; //dont want generate a zero valued random number
 }
 
-void random_prime(mp_ptr dst, int seed, int iterations)
+//Trial division by the odd primes below 256, which rules out most candidates before the first modexp.
+//Returns 1 if one of them divides n and n is not that prime itself
+int has_small_factor(mp_ptr n)
 {
-    int i, primality, x;
-    random_number(dst, dst->max_len, seed);
+    int i;
+    for(i = 0; i < (int)(sizeof(small_primes)/sizeof(small_primes[0])); i++)
+        if(mp_mod_ui(n, small_primes[i]) == 0)
+            return (n->len == 1 && n->value[0] == (int) small_primes[i]) ? 0 : 1;
+    return 0;
+}
+
+//Finds a prime of the given number of bits. dst must have room for at least bits/RADIX_BITS + 2 limbs
+void random_prime(mp_ptr dst, int bits, int seed, int iterations)
+{
+    int i, primality, x, len, top;
+    unsigned int state = (unsigned int)seed, witness;
+    len = (bits + RADIX_BITS - 1) / RADIX_BITS;
+    top = (bits - 1) % RADIX_BITS; //position of the most significant bit in the top limb
+    random_number(dst, len, &state);
+    //Clear anything above the top bit, then set the top two bits so that a product of two primes has exactly twice the bits
+    dst->value[len-1] &= (1 << (top + 1)) - 1;
+    dst->value[len-1] |= 1 << top;
+    if(top > 0) dst->value[len-1] |= 1 << (top - 1);
+    else if(len > 1) dst->value[len-2] |= 1 << (RADIX_BITS - 1);
+    dst->len = len;
     if(mp_is_even(dst) == 1) mp_increment(dst, 1); //Make random number odd
     do
     {        
-        primality = 1; //Suppose n is prime tentatively
-        for(i = 0; i < iterations; i++)
+        primality = (has_small_factor(dst) == 1) ? 0 : 1; //Suppose n is prime tentatively, unless a small prime divides it
+        for(i = 0; i < iterations && primality == 1; i++)
         {
             mp_t a; int len;
-            mp_init(a, dst->max_len, 0);
-            do
-            {
-                len = rand() % dst->len;
-            } while(len == 0); //ensure dont create a zero length random number!
-            random_number(a, len, i);
+            mp_init(a, dst->max_len);
+            len = (dst->len > 1) ? 1 + rand_r(&state) % (dst->len - 1) : 1; //a shorter witness, but never zero length
+            witness = (unsigned int)i;
+            random_number(a, len, &witness);
             x = mp_J(a, dst);
             if(x != 0) //check for primality
             {
                 mp_t tmp1, tmp2, tmp3;
-                mp_init(tmp1, dst->max_len, 0);
-                mp_init(tmp2, dst->max_len, 0);
-                mp_init(tmp3, dst->max_len, 0);
+                mp_init(tmp1, dst->max_len);
+                mp_init(tmp2, dst->max_len);
+                mp_init(tmp3, dst->max_len);
                 mp_assign(tmp1, dst);
                 mp_increment(tmp1, -1);
-                mp_assign_s64(tmp2, 2);
-                mp_divide(tmp3, tmp1, tmp2);
-                mp_assign(tmp1, dst); //Do again to restore tmp1
-                mp_increment(tmp1, -1); //Do again to restore tmp1
+                mp_divmod_ui(tmp3, tmp1, 2);
                 mp_modexp(tmp2, a, tmp3, dst);
                 if(! ((mp_compare(tmp2, tmp1) == 0 && x == -1) || (x == 1 && (tmp2->len == 1 && tmp2->value[0] == 1))) ) //if x != y
                     { primality = 0; mp_free_n(3, tmp1, tmp2, tmp3); break; }
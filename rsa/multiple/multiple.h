@@ -27,12 +27,35 @@ typedef struct
     mp_t n; //The modulus, part of the public and private keys
     mp_t e; //The exponent, part of the public key
     mp_t d; //The exponent, part of the private key, is meant to be kept secret
+    mp_t dp; //d mod (p-1), only valid if crt == 1
+    mp_t dq; //d mod (q-1), only valid if crt == 1
+    mp_t qinv; //1/q mod p, only valid if crt == 1
     int numChar; //The number of chars that can be packed.
+    int bits; //The bit length of n
+    int crt; //Set if p, q, dp, dq and qinv are known, so decryption can use the Chinese remainder theorem
+    mp_mont_t mont_n; //Montgomery reduction constants for n
+    mp_mont_t mont_p; //Montgomery reduction constants for p, only valid if crt == 1
+    mp_mont_t mont_q; //Montgomery reduction constants for q, only valid if crt == 1
 } multiple_rsa_t;
 
-void random_prime(mp_ptr dst, int seed, int iterations);
-void multiple_generate_keys(multiple_rsa_t *rsa);
+#define MULTIPLE_DEFAULT_BITS   336 //Bits in n, the same as the old fixed size of two 168 bit primes
+#define MULTIPLE_BATCH          16 //blocks exponentiated together by mp_modexp_batch
+
+void random_prime(mp_ptr dst, int bits, int seed, int iterations);
+void multiple_generate_keys(multiple_rsa_t *rsa, int bits);
+void multiple_precompute(multiple_rsa_t *rsa, int crt);
+void multiple_empty(multiple_rsa_t *rsa); //sets every number to an empty one, so multiple_free is safe however far a load gets
+void multiple_free(multiple_rsa_t *rsa); //frees every number, rsa must have been emptied before it was filled
+void multiple_cleanup(void *rsa); //multiple_free, for mp_cleanup_push
 char *multiple_encrypt_message(multiple_rsa_t *rsa, char *message, int length_in, int *length_out);
 char *multiple_decrypt_message(multiple_rsa_t *rsa, char *ciphertext, int length_in, int *length_out);
+char *multiple_sign_encrypt_message(multiple_rsa_t *signer, multiple_rsa_t *recipient, char *message, int length_in, int *length_out);
+char *multiple_decrypt_verify_message(multiple_rsa_t *recipient, multiple_rsa_t *signer, char *ciphertext, int length_in, int *length_out);
+int multiple_block_chars(multiple_rsa_t *rsa, int ciphertext); //chars in a block of message or of ciphertext
+void multiple_text2block(multiple_rsa_t *rsa, int ciphertext, mp_ptr dst, char *text, int *index, int length);
+void multiple_block2text(multiple_rsa_t *rsa, int ciphertext, mp_ptr n, char *text, int *index);
+void multiple_transform(multiple_rsa_t *rsa, int private, mp_ptr *dst, mp_ptr *x, int count); //up to MULTIPLE_BATCH blocks
+int multiple_text_size(multiple_rsa_t *rsa, int ciphertext, int length);
+int multiple_transform_text(multiple_rsa_t *rsa, int private, int ciphertext, char *text, int length, char *out);
 
 #endif
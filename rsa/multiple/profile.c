@@ -16,31 +16,287 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+#include "mp_math.h"
 #include "profile.h"
 
+typedef struct
+{
+    const char *name;
+    unsigned long long count, total, max;
+    unsigned long long counters[PROFILE_NUM_COUNTERS];
+    unsigned long long histogram[PROFILE_BUCKETS];
+} profile_scope_t;
+
+//A finished scope, for the trace
+typedef struct
+{
+    const char *name;
+    unsigned long long start, duration;
+    unsigned long long counters[PROFILE_NUM_COUNTERS];
+    int tid, depth;
+} profile_event_t;
+
+//The scopes open on one thread
+typedef struct
+{
+    const char *name[PROFILE_MAX_DEPTH];
+    unsigned long long start[PROFILE_MAX_DEPTH];
+    unsigned long long counters[PROFILE_MAX_DEPTH][PROFILE_NUM_COUNTERS];
+    int depth, tid, fd; //fd leads the thread's counter group, -1 until it is opened and -2 if that failed
+} profile_stack_t;
+
+const char *profile_counter_names[PROFILE_NUM_COUNTERS] = {"cycles", "instructions", "cache_misses"};
+int profile_on = 0, profile_mode = 0; //profile_mode holds the flags given to profile_init that could be met
+unsigned long long profile_origin = 0;
+profile_scope_t profile_scopes[PROFILE_MAX_SCOPES];
+int profile_scope_count = 0;
+profile_event_t *profile_events = NULL;
+int profile_event_count = 0;
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread profile_stack_t profile_stack = {{NULL}, {0}, {{0}}, 0, 0, -1};
+
+//Internal function prototypes
+int profile_bucket(unsigned long long ns);
+unsigned long long profile_bucket_top(int bucket);
+unsigned long long profile_percentile(profile_scope_t *scope, double fraction);
+int profile_counters_open(void);
+void profile_counters_read(unsigned long long *values);
+profile_scope_t *profile_scope_find(const char *name);
+
+//External functions
+unsigned long long profile_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (unsigned long long)t.tv_sec*1000000000ULL + t.tv_nsec;
+}
+
 void profile_begin(profile_t *p)
 {
-    gettimeofday(&(p->start), NULL);
+    clock_gettime(CLOCK_MONOTONIC, &(p->start));
 }
 
+//Each unit is worked out from the whole interval, seconds and nanoseconds together
 void profile_end(profile_t *p, profile_print_t print)
 {
-    gettimeofday(&(p->end), NULL);
-    
+    long long ns;
+    clock_gettime(CLOCK_MONOTONIC, &(p->end));
+    ns = (long long)(p->end.tv_sec - p->start.tv_sec)*1000000000LL + (p->end.tv_nsec - p->start.tv_nsec);
     if(print == PRINT_SECONDS)
+        printf("%lld ", ns / 1000000000LL);
+    else if(print == PRINT_MILLISECONDS)
+        printf("%lld ", (ns + 500000) / 1000000);
+    else //PRINT_MICROSECONDS
+        printf("%lld ", (ns + 500) / 1000);
+}
+
+void profile_init(int flags)
+{
+    pthread_mutex_lock(&profile_lock);
+    profile_mode = flags;
+    profile_origin = profile_now();
+    if((flags & PROFILE_TRACE) != 0 && profile_events == NULL &&
+        (profile_events = (profile_event_t *)malloc(PROFILE_MAX_EVENTS*sizeof(profile_event_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    pthread_mutex_unlock(&profile_lock);
+    if((flags & PROFILE_COUNTERS) != 0 && profile_counters_open() == 0)
+        profile_mode &= ~PROFILE_COUNTERS;
+    profile_on = 1;
+}
+
+int profile_flags(void)
+{
+    return profile_mode;
+}
+
+void profile_scope_begin(const char *name)
+{
+    profile_stack_t *s = &profile_stack;
+    if(profile_on == 0) return;
+    if(s->depth >= PROFILE_MAX_DEPTH) { s->depth++; return; } //too deep to keep, but still has to be ended
+    s->name[s->depth] = name;
+    if((profile_mode & PROFILE_COUNTERS) != 0 && (s->fd >= 0 || (s->fd == -1 && profile_counters_open() == 1)))
+        profile_counters_read(s->counters[s->depth]);
+    s->start[s->depth] = profile_now();
+    s->depth++;
+}
+
+void profile_scope_end(void)
+{
+    profile_stack_t *s = &profile_stack;
+    profile_scope_t *scope;
+    unsigned long long end, ns, counters[PROFILE_NUM_COUNTERS] = {0};
+    int i;
+    if(profile_on == 0 || s->depth == 0) return;
+    end = profile_now();
+    if(--s->depth >= PROFILE_MAX_DEPTH) return;
+    ns = end - s->start[s->depth];
+    if((profile_mode & PROFILE_COUNTERS) != 0 && s->fd >= 0)
     {
-        printf("%ld ", p->end.tv_sec  - p->start.tv_sec);
+        profile_counters_read(counters);
+        for(i = 0; i < PROFILE_NUM_COUNTERS; i++) counters[i] -= s->counters[s->depth][i];
     }
-    else if(print == PRINT_MILLISECONDS)
+    pthread_mutex_lock(&profile_lock);
+    if((scope = profile_scope_find(s->name[s->depth])) != NULL)
     {
-        long seconds, useconds, mseconds;
-        seconds  = p->end.tv_sec - p->start.tv_sec;
-            useconds = p->end.tv_usec - p->start.tv_usec;
-            mseconds = ((seconds) * 1000 + useconds/1000.0) + 0.5;
-        printf("%ld ", mseconds);
+        scope->count++;
+        scope->total += ns;
+        if(ns > scope->max) scope->max = ns;
+        scope->histogram[profile_bucket(ns)]++;
+        for(i = 0; i < PROFILE_NUM_COUNTERS; i++) scope->counters[i] += counters[i];
     }
-    else //PRINT_MICROSECONDS
+    if(profile_events != NULL && profile_event_count < PROFILE_MAX_EVENTS)
     {
-        printf("%ld ", p->end.tv_usec - p->start.tv_usec);
+        profile_event_t *e = &profile_events[profile_event_count++];
+        if(s->tid == 0) s->tid = (int)syscall(SYS_gettid);
+        e->name = s->name[s->depth];
+        e->start = s->start[s->depth] - profile_origin;
+        e->duration = ns;
+        e->tid = s->tid;
+        e->depth = s->depth;
+        for(i = 0; i < PROFILE_NUM_COUNTERS; i++) e->counters[i] = counters[i];
     }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+void profile_report(FILE *out)
+{
+    int i, j;
+    profile_scope_t *scope;
+    pthread_mutex_lock(&profile_lock);
+    fprintf(out, "%-24s %10s %14s %12s %12s %12s %12s", "scope", "count", "total (ms)", "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+    if((profile_mode & PROFILE_COUNTERS) != 0)
+        fprintf(out, " %16s %16s %16s", "cycles", "instructions", "cache misses");
+    fprintf(out, "\n");
+    for(i = 0; i < profile_scope_count; i++)
+    {
+        scope = &profile_scopes[i];
+        fprintf(out, "%-24s %10llu %14.3f %12.3f %12.3f %12.3f %12.3f", scope->name, scope->count, scope->total / 1e6,
+            profile_percentile(scope, 0.5) / 1e3, profile_percentile(scope, 0.9) / 1e3, profile_percentile(scope, 0.99) / 1e3,
+            scope->max / 1e3);
+        if((profile_mode & PROFILE_COUNTERS) != 0)
+            for(j = 0; j < PROFILE_NUM_COUNTERS; j++) fprintf(out, " %16llu", scope->counters[j]);
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+//Complete ("X") events, in microseconds from profile_init, which chrome://tracing and Perfetto lay out by thread
+//and nest by time
+int profile_trace_write(const char *path)
+{
+    int i, j;
+    FILE *out;
+    profile_event_t *e;
+    if((out = fopen(path, "w")) == NULL) return 0;
+    pthread_mutex_lock(&profile_lock);
+    fprintf(out, "{\"traceEvents\": [");
+    for(i = 0; i < profile_event_count; i++)
+    {
+        e = &profile_events[i];
+        fprintf(out, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d",
+            (i == 0) ? "" : ",", e->name, e->start / 1e3, e->duration / 1e3, (int)getpid(), e->tid);
+        if((profile_mode & PROFILE_COUNTERS) != 0)
+            for(j = 0; j < PROFILE_NUM_COUNTERS; j++)
+                fprintf(out, "%s\"%s\": %llu%s", (j == 0) ? ", \"args\": {" : ", ", profile_counter_names[j], e->counters[j],
+                    (j == PROFILE_NUM_COUNTERS - 1) ? "}" : "");
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n], \"displayTimeUnit\": \"ns\"}\n");
+    pthread_mutex_unlock(&profile_lock);
+    fclose(out);
+    return 1;
+}
+
+//Internal functions
+//Values below 8 get a bucket each, then every power of two is split into 8
+int profile_bucket(unsigned long long ns)
+{
+    int e;
+    if(ns < 8) return (int)ns;
+    e = 63 - __builtin_clzll(ns);
+    return (e - 2)*8 + (int)((ns >> (e - 3)) & 7);
+}
+
+unsigned long long profile_bucket_top(int bucket)
+{
+    int e = bucket / 8 + 2;
+    if(bucket < 8) return (unsigned long long)bucket;
+    return ((unsigned long long)(8 + bucket % 8 + 1) << (e - 3)) - 1;
+}
+
+//The top of the bucket the percentile falls in, but never more than the largest value seen
+unsigned long long profile_percentile(profile_scope_t *scope, double fraction)
+{
+    int i;
+    unsigned long long seen = 0, rank = (unsigned long long)(fraction*scope->count + 0.5);
+    if(rank < 1) rank = 1;
+    for(i = 0; i < PROFILE_BUCKETS; i++)
+        if((seen += scope->histogram[i]) >= rank)
+            return (profile_bucket_top(i) < scope->max) ? profile_bucket_top(i) : scope->max;
+    return scope->max;
+}
+
+//Opens cycles, instructions and cache misses as one group for the calling thread. Returns 0 if the kernel does not
+//allow it, as under a strict perf_event_paranoid or in a container
+int profile_counters_open(void)
+{
+    #ifdef __linux__
+    int i, fd;
+    unsigned long long configs[PROFILE_NUM_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+    struct perf_event_attr attr;
+    for(i = 0; i < PROFILE_NUM_COUNTERS; i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, (i == 0) ? -1 : profile_stack.fd, 0);
+        if(fd < 0)
+        {
+            if(profile_stack.fd >= 0) close(profile_stack.fd);
+            profile_stack.fd = -2;
+            return 0;
+        }
+        if(i == 0) profile_stack.fd = fd;
+    }
+    ioctl(profile_stack.fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return 1;
+    #else
+    profile_stack.fd = -2;
+    return 0;
+    #endif
+}
+
+void profile_counters_read(unsigned long long *values)
+{
+    int i;
+    unsigned long long group[1 + PROFILE_NUM_COUNTERS] = {0};
+    if(read(profile_stack.fd, group, sizeof(group)) != (ssize_t)sizeof(group)) return;
+    for(i = 0; i < PROFILE_NUM_COUNTERS; i++) values[i] = group[1 + i];
+}
+
+//Called with profile_lock held. Names are usually literals, so the pointer is compared before the string
+profile_scope_t *profile_scope_find(const char *name)
+{
+    int i;
+    for(i = 0; i < profile_scope_count; i++)
+        if(profile_scopes[i].name == name || strcmp(profile_scopes[i].name, name) == 0)
+            return &profile_scopes[i];
+    if(profile_scope_count == PROFILE_MAX_SCOPES) return NULL;
+    memset(&profile_scopes[profile_scope_count], 0, sizeof(profile_scope_t));
+    profile_scopes[profile_scope_count].name = name;
+    return &profile_scopes[profile_scope_count++];
 }
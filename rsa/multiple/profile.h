@@ -18,17 +18,37 @@
 #ifndef PROFILE_H
 #define PROFILE_H
 
-#include <sys/time.h>
+#include <stdio.h>
+#include <time.h>
+
+#define PROFILE_TRACE       1 //keep every scope, for profile_trace_write
+#define PROFILE_COUNTERS    2 //read cycles, instructions and cache misses around every scope with perf_event_open
+#define PROFILE_MAX_SCOPES  64 //scope names, each with its own histogram
+#define PROFILE_MAX_DEPTH   32 //scopes open at once on a thread
+#define PROFILE_MAX_EVENTS  (1 << 20) //scopes kept for the trace, later ones only go into the histograms
+#define PROFILE_BUCKETS     496 //8 buckets per power of two of nanoseconds, so a percentile is within 12.5%
+#define PROFILE_NUM_COUNTERS 3
 
 typedef struct 
 {
-    struct timeval start;
-    struct timeval end;
+    struct timespec start;
+    struct timespec end;
 } profile_t;
 
 typedef enum {PRINT_SECONDS, PRINT_MILLISECONDS, PRINT_MICROSECONDS} profile_print_t;
 
+//A single interval, printed on its own
 void profile_begin(profile_t *p);
 void profile_end(profile_t *p, profile_print_t print);
 
+//Named scopes, which nest and may be open on several threads at once. Each name gets a latency histogram, and with
+//PROFILE_TRACE every scope is also kept for a Chrome trace-event file. name must outlive the profile, e.g. a literal
+void profile_init(int flags);
+int profile_flags(void); //the flags given to profile_init, less PROFILE_COUNTERS if perf_event_open is not allowed
+void profile_scope_begin(const char *name);
+void profile_scope_end(void);
+void profile_report(FILE *out); //count, total, p50/p90/p99/max and counters per scope name
+int profile_trace_write(const char *path); //returns 0 if the file could not be written
+unsigned long long profile_now(void); //nanoseconds on the monotonic clock
+
 #endif
@@ -0,0 +1,418 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "mp_math.h"
+#include "multiple.h"
+#include "file.h"
+#include "server.h"
+
+//A request waiting for its blocks to go through a batch. next is the first block not yet handed to a batch, and
+//done counts the blocks back from one
+typedef struct server_job_s
+{
+    multiple_rsa_t *rsa;
+    mp_t *in;
+    mp_t *out;
+    int count;
+    int next;
+    int done;
+    pthread_cond_t ready;
+    struct server_job_s *link;
+} server_job_t;
+
+typedef struct
+{
+    multiple_rsa_t *keys;
+    int key_count;
+    pthread_mutex_t lock; //guards the queue and the next/done counts of the jobs on it
+    pthread_cond_t work;
+    server_job_t *queue;
+} server_t;
+
+typedef struct
+{
+    server_t *server;
+    int fd;
+} server_connection_t;
+
+typedef struct
+{
+    char *path;
+    int op;
+    int key;
+    char *payload;
+    int length;
+    int requests;
+    double *latency; //one per request
+    int failed;
+} server_client_t;
+
+char *server_op_names[] = {"encrypt", "decrypt", "sign", "verify"};
+
+//Internal function prototypes
+double server_now(void);
+int server_threads(void);
+int server_read(int fd, void *buffer, int length);
+int server_write(int fd, void *buffer, int length);
+void *server_batcher(void *arg);
+void *server_connection(void *arg);
+char *server_process(server_t *server, multiple_rsa_t *rsa, int ciphertext, char *text, int length, int *length_out);
+int server_connect(char *path);
+int server_call(int fd, int op, int key, char *text, int length, server_response_t *response, char **reply);
+void *server_client(void *arg);
+int server_compare(const void *a, const void *b);
+
+//External functions
+int server_run(char *path, char **keyfiles, int count)
+{
+    int i, fd, client, threads = server_threads();
+    struct sockaddr_un addr;
+    server_t server;
+    server_connection_t *connection;
+    pthread_t id;
+    pthread_attr_t attr;
+    //Every key is read as a private key, so whichever exponent its file holds is d, with CRT if the file has it
+    if((server.keys = (multiple_rsa_t *)malloc(count*sizeof(multiple_rsa_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(i = 0; i < count; i++)
+        file_read_privatekey(&server.keys[i], keyfiles[i]);
+    server.key_count = count;
+    server.queue = NULL;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.work, NULL);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path))
+        { printf("Socket path '%s' is too long!\r\n", path); return 0; }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
+        { printf("Could not listen on '%s'!\r\n", path); return 0; }
+    signal(SIGPIPE, SIG_IGN); //a client going away is seen as a failed write instead
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for(i = 0; i < threads; i++)
+        if(pthread_create(&id, &attr, server_batcher, &server) != 0)
+            mp_fail(MP_ERR_MEMORY, "pthread_create failed: [%s, %d]\n", __FILE__, __LINE__);
+    printf("Serving %d keys on '%s' with %d batch threads.\r\n", count, path, threads);
+    fflush(stdout);
+    for(;;)
+    {
+        if((client = accept(fd, NULL, NULL)) < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+        if((connection = (server_connection_t *)malloc(sizeof(server_connection_t))) == NULL)
+            mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+        connection->server = &server; connection->fd = client;
+        if(pthread_create(&id, &attr, server_connection, connection) != 0)
+            mp_fail(MP_ERR_MEMORY, "pthread_create failed: [%s, %d]\n", __FILE__, __LINE__);
+    }
+    close(fd);
+    return 0;
+}
+
+int server_loadgen(char *path, int clients, int requests, int size, int op, int key)
+{
+    int i, fd, failed = 0, done;
+    char *text, *reply;
+    double start, elapsed, *latency;
+    server_client_t *client;
+    server_response_t response;
+    pthread_t *id;
+    if((text = (char *)malloc(size + 1)) == NULL || (latency = (double *)malloc(requests*sizeof(double))) == NULL ||
+        (client = (server_client_t *)malloc(clients*sizeof(server_client_t))) == NULL || (id = (pthread_t *)malloc(clients*sizeof(pthread_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    srand(1);
+    for(i = 0; i < size; i++) text[i] = 'a' + rand() % 26;
+    if((fd = server_connect(path)) < 0)
+        { printf("Could not connect to '%s'!\r\n", path); return 0; }
+    //Decrypting and verifying are sent text the server encrypted with the same key, so it has the shape of a ciphertext
+    if(op == SERVER_DECRYPT || op == SERVER_VERIFY)
+    {
+        if(server_call(fd, SERVER_ENCRYPT, key, text, size, &response, &reply) == 0 || response.status != SERVER_OK)
+            { printf("The server could not encrypt the load with key %d!\r\n", key); close(fd); return 0; }
+        free(text); text = reply; size = response.length;
+    }
+    close(fd);
+    for(i = 0, done = 0; i < clients; i++)
+    {
+        client[i].path = path; client[i].op = op; client[i].key = key;
+        client[i].payload = text; client[i].length = size;
+        client[i].requests = requests / clients + ((i < requests % clients) ? 1 : 0);
+        client[i].latency = latency + done;
+        client[i].failed = 0;
+        done += client[i].requests;
+    }
+    start = server_now();
+    for(i = 0; i < clients; i++)
+        if(pthread_create(&id[i], NULL, server_client, &client[i]) != 0)
+            mp_fail(MP_ERR_MEMORY, "pthread_create failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(i = 0; i < clients; i++)
+        { pthread_join(id[i], NULL); failed += client[i].failed; }
+    elapsed = server_now() - start;
+    qsort(latency, requests, sizeof(double), server_compare);
+    printf("%d %s requests of %d bytes from %d clients in %.3f seconds, %d failed\r\n",
+        requests, server_op_names[op], size, clients, elapsed, failed);
+    printf("%.1f requests/s, p50 %.3f ms, p99 %.3f ms, max %.3f ms\r\n", requests / elapsed,
+        latency[(requests - 1) * 50 / 100] * 1000, latency[(requests - 1) * 99 / 100] * 1000, latency[requests - 1] * 1000);
+    free(text); free(latency); free(client); free(id);
+    return (failed == 0) ? 1 : 0;
+}
+
+int server_op(const char *name)
+{
+    int op;
+    for(op = SERVER_ENCRYPT; op <= SERVER_VERIFY; op++)
+        if(strcmp(name, server_op_names[op]) == 0) return op;
+    return -1;
+}
+
+//Internal functions
+double server_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int server_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cpus < 1) ? 1 : (int)cpus;
+}
+
+//Reads or writes all of length bytes, returns 0 if the other end went away first
+int server_read(int fd, void *buffer, int length)
+{
+    int n;
+    char *ptr = (char *)buffer;
+    while(length > 0)
+    {
+        if((n = read(fd, ptr, length)) <= 0)
+        {
+            if(n < 0 && errno == EINTR) continue;
+            return 0;
+        }
+        ptr += n; length -= n;
+    }
+    return 1;
+}
+
+int server_write(int fd, void *buffer, int length)
+{
+    int n;
+    char *ptr = (char *)buffer;
+    while(length > 0)
+    {
+        if((n = write(fd, ptr, length)) <= 0)
+        {
+            if(n < 0 && errno == EINTR) continue;
+            return 0;
+        }
+        ptr += n; length -= n;
+    }
+    return 1;
+}
+
+//Takes up to MULTIPLE_BATCH blocks from the queued requests on the key of the oldest one, oldest first, so the
+//blocks of short requests arriving together share a batch rather than each paying for their own
+void *server_batcher(void *arg)
+{
+    server_t *server = (server_t *)arg;
+    server_job_t *job, **prev, *slot[MULTIPLE_BATCH];
+    mp_ptr x[MULTIPLE_BATCH], dst[MULTIPLE_BATCH];
+    multiple_rsa_t *rsa;
+    int k, count;
+    for(;;)
+    {
+        pthread_mutex_lock(&server->lock);
+        while(server->queue == NULL)
+            pthread_cond_wait(&server->work, &server->lock);
+        rsa = server->queue->rsa;
+        for(prev = &server->queue, count = 0; *prev != NULL && count < MULTIPLE_BATCH; )
+        {
+            job = *prev;
+            if(job->rsa != rsa) { prev = &job->link; continue; }
+            for(; job->next < job->count && count < MULTIPLE_BATCH; job->next++, count++)
+            {
+                slot[count] = job;
+                x[count] = job->in[job->next];
+                dst[count] = job->out[job->next];
+            }
+            if(job->next == job->count) *prev = job->link; //every block handed out, off the queue
+            else prev = &job->link;
+        }
+        pthread_mutex_unlock(&server->lock);
+        multiple_transform(rsa, 1, dst, x, count);
+        pthread_mutex_lock(&server->lock);
+        for(k = 0; k < count; k++)
+            if(++slot[k]->done == slot[k]->count)
+                pthread_cond_signal(&slot[k]->ready);
+        pthread_mutex_unlock(&server->lock);
+    }
+    return NULL;
+}
+
+void *server_connection(void *arg)
+{
+    server_connection_t *connection = (server_connection_t *)arg;
+    server_t *server = connection->server;
+    int fd = connection->fd;
+    server_request_t request;
+    server_response_t response;
+    char *text, *reply;
+    free(connection);
+    while(server_read(fd, &request, sizeof(request)) == 1)
+    {
+        response.status = SERVER_OK; response.length = 0; reply = NULL;
+        //A length that cannot be read past leaves the connection out of step, so it is closed after the error
+        if(request.length < 0 || request.length > SERVER_MAX_LENGTH)
+        {
+            response.status = SERVER_TOO_LONG;
+            server_write(fd, &response, sizeof(response));
+            break;
+        }
+        if((text = (char *)malloc(request.length + 1)) == NULL)
+            mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+        if(server_read(fd, text, request.length) == 0) { free(text); break; }
+        if(request.op < SERVER_ENCRYPT || request.op > SERVER_VERIFY)
+            response.status = SERVER_BAD_OP;
+        else if(request.key < 0 || request.key >= server->key_count)
+            response.status = SERVER_BAD_KEY;
+        else
+            reply = server_process(server, &server->keys[request.key], request.op == SERVER_DECRYPT || request.op == SERVER_VERIFY,
+                text, request.length, &response.length);
+        free(text);
+        if(server_write(fd, &response, sizeof(response)) == 0 || server_write(fd, reply, response.length) == 0)
+            { free(reply); break; }
+        free(reply);
+    }
+    close(fd);
+    return NULL;
+}
+
+//Same blocks as encrypt_blocks and decrypt_blocks in multiple.c, but the transform is left to the batchers
+char *server_process(server_t *server, multiple_rsa_t *rsa, int ciphertext, char *text, int length, int *length_out)
+{
+    int k, index;
+    char *reply;
+    server_job_t job, **tail;
+    job.count = (length + multiple_block_chars(rsa, ciphertext) - 1) / multiple_block_chars(rsa, ciphertext);
+    if((reply = (char *)malloc(job.count*multiple_block_chars(rsa, !ciphertext) + 1)) == NULL ||
+        (job.in = (mp_t *)malloc((job.count + 1)*sizeof(mp_t))) == NULL || (job.out = (mp_t *)malloc((job.count + 1)*sizeof(mp_t))) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    for(k = 0, index = 0; k < job.count; k++)
+    {
+        mp_init(job.in[k], rsa->n->max_len);
+        mp_init(job.out[k], rsa->n->max_len);
+        multiple_text2block(rsa, ciphertext, job.in[k], text, &index, length);
+    }
+    job.rsa = rsa; job.next = 0; job.done = 0; job.link = NULL;
+    pthread_cond_init(&job.ready, NULL);
+    if(job.count > 0)
+    {
+        pthread_mutex_lock(&server->lock);
+        for(tail = &server->queue; *tail != NULL; tail = &(*tail)->link);
+        *tail = &job;
+        pthread_cond_broadcast(&server->work);
+        while(job.done < job.count)
+            pthread_cond_wait(&job.ready, &server->lock);
+        pthread_mutex_unlock(&server->lock);
+    }
+    pthread_cond_destroy(&job.ready);
+    for(k = 0, index = 0; k < job.count; k++)
+    {
+        multiple_block2text(rsa, !ciphertext, job.out[k], reply, &index);
+        mp_free_n(2, job.in[k], job.out[k]);
+    }
+    free(job.in); free(job.out);
+    reply[index] = '\0';
+    *length_out = index;
+    return reply;
+}
+
+int server_connect(char *path)
+{
+    int fd;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) return -1;
+    strcpy(addr.sun_path, path);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) { close(fd); return -1; }
+    return fd;
+}
+
+//Sends one request and waits for its response. reply is malloced, returns 0 if the connection failed
+int server_call(int fd, int op, int key, char *text, int length, server_response_t *response, char **reply)
+{
+    server_request_t request;
+    request.op = op; request.key = key; request.length = length;
+    *reply = NULL;
+    if(server_write(fd, &request, sizeof(request)) == 0 || server_write(fd, text, length) == 0) return 0;
+    if(server_read(fd, response, sizeof(*response)) == 0 || response->length < 0) return 0;
+    if((*reply = (char *)malloc(response->length + 1)) == NULL)
+        mp_fail(MP_ERR_MEMORY, "malloc failed: [%s, %d]\n", __FILE__, __LINE__);
+    if(server_read(fd, *reply, response->length) == 0) { free(*reply); *reply = NULL; return 0; }
+    (*reply)[response->length] = '\0';
+    return 1;
+}
+
+//One loadgen connection, sending its requests one after the other
+void *server_client(void *arg)
+{
+    server_client_t *client = (server_client_t *)arg;
+    server_response_t response;
+    char *reply;
+    double start;
+    int i, fd;
+    if((fd = server_connect(client->path)) < 0)
+    {
+        client->failed = client->requests;
+        for(i = 0; i < client->requests; i++) client->latency[i] = 0;
+        return NULL;
+    }
+    for(i = 0; i < client->requests; i++)
+    {
+        start = server_now();
+        if(server_call(fd, client->op, client->key, client->payload, client->length, &response, &reply) == 0 || response.status != SERVER_OK)
+            client->failed++;
+        client->latency[i] = server_now() - start;
+        free(reply);
+    }
+    close(fd);
+    return NULL;
+}
+
+int server_compare(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
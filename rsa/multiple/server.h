@@ -0,0 +1,57 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+//Requests and responses on the socket are a header of native ints followed by length bytes of text
+typedef struct
+{
+    int op; //one of SERVER_ENCRYPT .. SERVER_VERIFY
+    int key; //index of the key, in the order the keys were given to rsa -serve
+    int length;
+} server_request_t;
+
+typedef struct
+{
+    int status; //SERVER_OK or one of the errors below
+    int length;
+} server_response_t;
+
+//As with -encrypt and -decrypt on the command line, the key decides what an op means: encrypting with a private
+//key signs, and decrypting with a public key verifies. SERVER_SIGN and SERVER_VERIFY name those two uses
+#define SERVER_ENCRYPT      0
+#define SERVER_DECRYPT      1
+#define SERVER_SIGN         2
+#define SERVER_VERIFY       3
+
+#define SERVER_OK           0
+#define SERVER_BAD_OP       1
+#define SERVER_BAD_KEY      2
+#define SERVER_TOO_LONG     3
+
+#define SERVER_MAX_LENGTH   (16 << 20) //longest text a request may carry
+
+//Loads the keys once and serves requests on the Unix socket at path until killed. The blocks of concurrent
+//requests on the same key are gathered into shared batches of up to MULTIPLE_BATCH blocks
+int server_run(char *path, char **keyfiles, int count);
+//Sends requests of size bytes from clients connections at once, and prints the requests per second and the
+//p50/p99 latency. Returns 0 if the server could not be reached or failed a request
+int server_loadgen(char *path, int clients, int requests, int size, int op, int key);
+int server_op(const char *name); //SERVER_ENCRYPT .. SERVER_VERIFY by name, -1 if there is none
+
+#endif
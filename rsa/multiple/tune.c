@@ -0,0 +1,182 @@
+/*
+ *  Copyright (C) 2010, Robert Tang <opensource@robotang.co.nz>
+ *
+ *  This is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public Licence
+ *  along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "mp_math.h"
+#include "mp_kernel.h"
+#include "tune.h"
+
+#define TUNE_BATCH          16 //numbers exponentiated together when timing the kernels, as in rsa_transform
+#define TUNE_BITS           1024 //modulus the kernels are timed on
+#define TUNE_RUNS           3 //every time is the best of this many runs
+#define TUNE_OFF            (1 << 30) //a threshold no operand reaches
+
+int tune_ntt_lens[] = {1024, 1536, 2048, 3072, 4096, 6144, 8192};
+int tune_div_lens[] = {64, 128, 256, 512, 1024};
+
+//Internal function prototypes
+double tune_now(void);
+void tune_random(mp_ptr n, int len);
+double tune_modexp(int len);
+double tune_multiply(int len);
+double tune_divide(int len);
+void tune_threshold(const char *name, int *threshold, int *lens, int count, double (*time)(int));
+
+//External functions
+int tune_run(const char *path)
+{
+    int i, best;
+    double t, t_best;
+    mp_kernel_t *kernels[] = {&mp_kernel_scalar, &mp_kernel_avx2};
+    mp_word_kernel_t *words[] = {&mp_word_kernel_off, &mp_word_kernel_int128, &mp_word_kernel_adx};
+    int len = (TUNE_BITS + RADIX_BITS - 1) / RADIX_BITS;
+    srand(1);
+    //Limb kernels, with the word path off so they are the ones doing the work
+    mp_word_kernel = mp_word_kernel_off;
+    for(i = 0, best = 0, t_best = 0; i < (int)(sizeof(kernels)/sizeof(kernels[0])); i++)
+    {
+        if(mp_kernel_supported(kernels[i]) == 0) continue;
+        mp_kernel = *kernels[i];
+        t = tune_modexp(len);
+        printf("kernel %-8s %10.3f ms per %d bit modexp\n", kernels[i]->name, t*1000, TUNE_BITS);
+        if(t_best == 0 || t < t_best) { t_best = t; best = i; }
+    }
+    mp_kernel = *kernels[best];
+    for(i = 0, best = 0, t_best = 0; i < (int)(sizeof(words)/sizeof(words[0])); i++)
+    {
+        if(mp_word_kernel_supported(words[i]) == 0) continue;
+        mp_word_kernel = *words[i];
+        t = tune_modexp(len);
+        printf("word_kernel %-8s %5.3f ms per %d bit modexp\n", words[i]->name, t*1000, TUNE_BITS);
+        if(t_best == 0 || t < t_best) { t_best = t; best = i; }
+    }
+    mp_word_kernel = *words[best];
+    //Newton division is built on mp_multiply, so the NTT threshold goes first
+    tune_threshold("ntt_len", &mp_ntt_len, tune_ntt_lens, sizeof(tune_ntt_lens)/sizeof(tune_ntt_lens[0]), tune_multiply);
+    tune_threshold("div_newton_len", &mp_div_newton_len, tune_div_lens, sizeof(tune_div_lens)/sizeof(tune_div_lens[0]), tune_divide);
+    if(mp_tune_save(path) == 0)
+        { printf("Could not write the tuning profile '%s'!\r\n", path); return 0; }
+    printf("kernel %s, word_kernel %s, ntt_len %d, div_newton_len %d written to %s\r\n",
+        mp_kernel.name, mp_word_kernel.name, mp_ntt_len, mp_div_newton_len, path);
+    return 1;
+}
+
+//Internal functions
+double tune_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//Random odd number of exactly len limbs
+void tune_random(mp_ptr n, int len)
+{
+    int i;
+    mp_init(n, len);
+    for(i = 0; i < len; i++) n->value[i] = rand() % RADIX;
+    n->value[0] |= 1; n->value[len-1] |= 1;
+    n->len = len;
+}
+
+//Seconds per modexp of a batch of TUNE_BATCH numbers, with the kernels in use
+double tune_modexp(int len)
+{
+    int k, run;
+    double t0, t, t_best = 0;
+    mp_t n, e, x[TUNE_BATCH], y[TUNE_BATCH];
+    mp_ptr x_ptr[TUNE_BATCH], y_ptr[TUNE_BATCH];
+    mp_mont_t mont;
+    tune_random(n, len); tune_random(e, len - 1);
+    mp_mont_init(&mont, n);
+    for(k = 0; k < TUNE_BATCH; k++)
+    {
+        tune_random(x[k], len - 1); x_ptr[k] = x[k];
+        mp_init(y[k], len); y_ptr[k] = y[k];
+    }
+    for(run = 0; run < TUNE_RUNS; run++)
+    {
+        t0 = tune_now();
+        mp_modexp_batch(y_ptr, x_ptr, TUNE_BATCH, e, &mont);
+        t = (tune_now() - t0) / TUNE_BATCH;
+        if(run == 0 || t < t_best) t_best = t;
+    }
+    for(k = 0; k < TUNE_BATCH; k++) mp_free_n(2, x[k], y[k]);
+    mp_free_n(2, n, e);
+    mp_mont_free(&mont);
+    return t_best;
+}
+
+//Seconds per len by len limb mp_multiply
+double tune_multiply(int len)
+{
+    int run;
+    double t0, t, t_best = 0;
+    mp_t a, b, c;
+    tune_random(a, len); tune_random(b, len);
+    mp_init(c, 2*len);
+    for(run = 0; run < TUNE_RUNS; run++)
+    {
+        t0 = tune_now();
+        mp_multiply(c, a, b);
+        t = tune_now() - t0;
+        if(run == 0 || t < t_best) t_best = t;
+    }
+    mp_free_n(3, a, b, c);
+    return t_best;
+}
+
+//Seconds per mp_divide of 2*len by len limbs
+double tune_divide(int len)
+{
+    int run;
+    double t0, t, t_best = 0;
+    mp_t a, b, q, r;
+    tune_random(a, 2*len); tune_random(b, len);
+    mp_init(q, len + 1); mp_init(r, 2*len);
+    for(run = 0; run < TUNE_RUNS; run++)
+    {
+        mp_assign(r, a);
+        t0 = tune_now();
+        mp_divide(q, r, b);
+        t = tune_now() - t0;
+        if(run == 0 || t < t_best) t_best = t;
+    }
+    mp_free_n(4, a, b, q, r);
+    return t_best;
+}
+
+//Times each length with the threshold out of reach and then with it at 1, and sets it to the shortest length
+//from which the second way is faster all the way up. If it never is, the threshold is put past the longest length
+void tune_threshold(const char *name, int *threshold, int *lens, int count, double (*time)(int))
+{
+    int i, from = 2*lens[count-1];
+    double t_off, t_on;
+    for(i = 0; i < count; i++)
+    {
+        *threshold = TUNE_OFF;
+        t_off = time(lens[i]);
+        *threshold = 1;
+        t_on = time(lens[i]);
+        printf("%s %6d limbs %10.3f ms %10.3f ms\n", name, lens[i], t_off*1000, t_on*1000);
+        if(t_on < t_off && from > lens[i]) from = lens[i];
+        else if(t_on >= t_off) from = 2*lens[count-1];
+    }
+    *threshold = from;
+}
@@ -35,7 +35,7 @@ void printUsage(void)
     printf("Note: you need to generate keys before encryption can be done.\r\n");
 }
 
-typedef enum {genkeys, encrypt, decrypt} mode_t;
+typedef enum {genkeys, encrypt, decrypt} rsa_mode_t;
 
 #if 1
 int main(int argc, char *argv[])
@@ -43,7 +43,7 @@ int main(int argc, char *argv[])
     FILE *input, *output;
     char fileName[100], fileOut[100]; //should be long enough for a file name!
     unsigned char *readln, *writeln;
-    mode_t mode; int i, length;
+    rsa_mode_t mode; int i, length;
     single_rsa_t rsa;
 
     if(argc <= 1 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "man") == 0 ||